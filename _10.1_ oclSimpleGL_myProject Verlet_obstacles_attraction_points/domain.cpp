@@ -0,0 +1,578 @@
+#include "domain.hpp"
+
+#include <oclUtils.h>
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+
+extern void (*pCleanup)(int);
+
+#define DOMAIN_TIMEOUT              60.0    // seconds a peer may stay silent before the run ends
+#define DOMAIN_CONNECT_RETRY_MS     100
+#define DOMAIN_SHM_RING             (1 << 20)
+#define DOMAIN_SHM_HEADER           64
+
+/**
+ *  TRANSPORTS
+ *  a transport connects every pair of ranks and moves bytes between them in
+ *  order; send and receive only return once all the bytes went through
+ */
+struct domain_transport
+{
+    bool (*open)(const char* address);
+    bool (*send)(int peer, const char* data, size_t size);
+    bool (*receive)(int peer, char* data, size_t size);
+    void (*close)();
+};
+
+static int domain_rank = 0;
+static int domain_no_ranks = 1;
+static const domain_transport* transport = NULL;
+
+static double seconds_now()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    return now.tv_sec + now.tv_usec * 1e-6;
+}
+
+/**
+ *  SHARED MEMORY
+ *  one segment with a single-producer single-consumer ring per ordered pair of ranks;
+ *  rank 0 creates it and unlinks the name once every rank mapped it
+ */
+struct shm_ring
+{
+    std::atomic<unsigned long long> written;
+    std::atomic<unsigned long long> read;
+    char data[DOMAIN_SHM_RING];
+};
+
+static char*     shm_segment = NULL;
+static size_t    shm_size = 0;
+static shm_ring* shm_rings = NULL;
+
+static bool shm_open_rings(const char* address)
+{
+    std::string name = std::string("/") + address;
+    shm_size = DOMAIN_SHM_HEADER + (size_t) domain_no_ranks * domain_no_ranks * sizeof(shm_ring);
+
+    int fd = -1;
+    if (domain_rank == 0)
+    {
+        shm_unlink(name.c_str());
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0 || ftruncate(fd, shm_size) != 0)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        // the segment only counts once rank 0 gave it its full size
+        double start = seconds_now();
+        struct stat status;
+        while ((fd = shm_open(name.c_str(), O_RDWR, 0600)) < 0 || fstat(fd, &status) != 0 || (size_t) status.st_size < shm_size)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            if (seconds_now() - start > DOMAIN_TIMEOUT)
+            {
+                return false;
+            }
+            usleep(DOMAIN_CONNECT_RETRY_MS * 1000);
+        }
+    }
+
+    void* mapping = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+
+    shm_segment = (char*) mapping;
+    shm_rings = (shm_ring*) (shm_segment + DOMAIN_SHM_HEADER);
+
+    // ftruncate zero-filled the segment, which is every ring empty and nobody attached;
+    // default construction starts the atomics' lifetime in this mapping without writing
+    std::atomic<int>* attached = new (shm_segment) std::atomic<int>;
+    for (int r = 0; r < domain_no_ranks * domain_no_ranks; r++)
+    {
+        new (&shm_rings[r]) shm_ring;
+    }
+    attached->fetch_add(1);
+
+    double start = seconds_now();
+    while (attached->load() < domain_no_ranks)
+    {
+        if (seconds_now() - start > DOMAIN_TIMEOUT)
+        {
+            return false;
+        }
+        usleep(DOMAIN_CONNECT_RETRY_MS * 1000);
+    }
+
+    if (domain_rank == 0)
+    {
+        shm_unlink(name.c_str());
+    }
+
+    return true;
+}
+
+static bool shm_send(int peer, const char* data, size_t size)
+{
+    shm_ring& ring = shm_rings[domain_rank * domain_no_ranks + peer];
+    double start = seconds_now();
+
+    while (size > 0)
+    {
+        unsigned long long written = ring.written.load(std::memory_order_relaxed);
+        size_t space = DOMAIN_SHM_RING - (size_t) (written - ring.read.load(std::memory_order_acquire));
+
+        if (space == 0)
+        {
+            if (seconds_now() - start > DOMAIN_TIMEOUT)
+            {
+                return false;
+            }
+            sched_yield();
+            continue;
+        }
+
+        // at most up to the end of the ring, the rest goes on the next turn
+        size_t at = written % DOMAIN_SHM_RING;
+        size_t n = std::min(std::min(space, size), (size_t) DOMAIN_SHM_RING - at);
+
+        memcpy(ring.data + at, data, n);
+        ring.written.store(written + n, std::memory_order_release);
+
+        data += n;
+        size -= n;
+        start = seconds_now();
+    }
+
+    return true;
+}
+
+static bool shm_receive(int peer, char* data, size_t size)
+{
+    shm_ring& ring = shm_rings[peer * domain_no_ranks + domain_rank];
+    double start = seconds_now();
+
+    while (size > 0)
+    {
+        unsigned long long read = ring.read.load(std::memory_order_relaxed);
+        size_t available = (size_t) (ring.written.load(std::memory_order_acquire) - read);
+
+        if (available == 0)
+        {
+            if (seconds_now() - start > DOMAIN_TIMEOUT)
+            {
+                return false;
+            }
+            sched_yield();
+            continue;
+        }
+
+        size_t at = read % DOMAIN_SHM_RING;
+        size_t n = std::min(std::min(available, size), (size_t) DOMAIN_SHM_RING - at);
+
+        memcpy(data, ring.data + at, n);
+        ring.read.store(read + n, std::memory_order_release);
+
+        data += n;
+        size -= n;
+        start = seconds_now();
+    }
+
+    return true;
+}
+
+static void shm_close()
+{
+    if (shm_segment)
+    {
+        munmap(shm_segment, shm_size);
+    }
+    shm_segment = NULL;
+    shm_rings = NULL;
+}
+
+/**
+ *  SOCKETS
+ *  every rank listens on the port of its entry in the address list; a rank accepts
+ *  the ranks above it and connects to the ones below, which learn who called from
+ *  the first int on the connection
+ */
+static int peer_sockets[DOMAIN_MAX_RANKS];
+
+static bool split_host_port(const std::string& entry, std::string& host, std::string& port)
+{
+    size_t colon = entry.rfind(':');
+    if (colon == std::string::npos)
+    {
+        return false;
+    }
+
+    host = entry.substr(0, colon);
+    port = entry.substr(colon + 1);
+
+    return true;
+}
+
+static bool write_all(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = recv(fd, data, size, 0);
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static void tune_socket(int fd)
+{
+    int on = 1;
+    struct timeval timeout = {(time_t) DOMAIN_TIMEOUT, 0};
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static bool socket_open(const char* address)
+{
+    // socket_close() runs on any failure below, it must only see sockets opened here
+    for (int r = 0; r < DOMAIN_MAX_RANKS; r++)
+    {
+        peer_sockets[r] = -1;
+    }
+
+    std::vector<std::string> entries;
+    std::string list(address);
+    for (size_t begin = 0, end; begin <= list.size(); begin = end + 1)
+    {
+        end = std::min(list.find(',', begin), list.size());
+        entries.push_back(list.substr(begin, end - begin));
+    }
+    if ((int) entries.size() < domain_no_ranks)
+    {
+        shrLog("Domain: %d addresses for %d ranks\n", (int) entries.size(), domain_no_ranks);
+        return false;
+    }
+
+    std::string host, port;
+    struct addrinfo hints;
+    struct addrinfo* found;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // listen before calling anyone, the ranks above may already be dialling
+    int listener = -1;
+    if (domain_rank < domain_no_ranks - 1)
+    {
+        if (!split_host_port(entries[domain_rank], host, port))
+        {
+            return false;
+        }
+
+        struct sockaddr_in any;
+        int on = 1;
+        memset(&any, 0, sizeof(any));
+        any.sin_family = AF_INET;
+        any.sin_addr.s_addr = htonl(INADDR_ANY);
+        any.sin_port = htons((unsigned short) atoi(port.c_str()));
+
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+            || bind(listener, (struct sockaddr*) &any, sizeof(any)) != 0 || listen(listener, DOMAIN_MAX_RANKS) != 0)
+        {
+            if (listener >= 0)
+            {
+                close(listener);
+            }
+            return false;
+        }
+    }
+
+    bool connected = true;
+    for (int peer = 0; connected && peer < domain_rank; peer++)
+    {
+        if (!split_host_port(entries[peer], host, port) || getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0)
+        {
+            connected = false;
+            break;
+        }
+
+        double start = seconds_now();
+        int fd;
+        while ((fd = socket(found->ai_family, found->ai_socktype, found->ai_protocol)) < 0
+               || connect(fd, found->ai_addr, found->ai_addrlen) != 0)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+            if (seconds_now() - start > DOMAIN_TIMEOUT)
+            {
+                break;
+            }
+            usleep(DOMAIN_CONNECT_RETRY_MS * 1000);
+        }
+        freeaddrinfo(found);
+
+        if (fd < 0)
+        {
+            connected = false;
+            break;
+        }
+        tune_socket(fd);
+        peer_sockets[peer] = fd;
+        connected = write_all(fd, (const char*) &domain_rank, sizeof(int));
+    }
+
+    // a rank above that never starts ends the wait like a silent peer does later
+    for (int accepted = domain_rank + 1; connected && accepted < domain_no_ranks; accepted++)
+    {
+        struct pollfd waiting = {listener, POLLIN, 0};
+        int fd = (poll(&waiting, 1, (int) (DOMAIN_TIMEOUT * 1000)) == 1) ? accept(listener, NULL, NULL) : -1;
+        int peer = -1;
+
+        if (fd < 0)
+        {
+            connected = false;
+            break;
+        }
+        tune_socket(fd);
+        if (!read_all(fd, (char*) &peer, sizeof(int)) || peer <= domain_rank || peer >= domain_no_ranks || peer_sockets[peer] >= 0)
+        {
+            close(fd);
+            connected = false;
+            break;
+        }
+        peer_sockets[peer] = fd;
+    }
+
+    if (listener >= 0)
+    {
+        close(listener);
+    }
+
+    return connected;
+}
+
+static bool socket_send(int peer, const char* data, size_t size)
+{
+    return write_all(peer_sockets[peer], data, size);
+}
+
+static bool socket_receive(int peer, char* data, size_t size)
+{
+    return read_all(peer_sockets[peer], data, size);
+}
+
+static void socket_close()
+{
+    for (int r = 0; r < domain_no_ranks; r++)
+    {
+        if (peer_sockets[r] >= 0)
+        {
+            close(peer_sockets[r]);
+        }
+        peer_sockets[r] = -1;
+    }
+}
+
+static const domain_transport transports[] =
+{
+    {shm_open_rings, shm_send, shm_receive, shm_close},         // DOMAIN_TRANSPORT_SHM
+    {socket_open, socket_send, socket_receive, socket_close}    // DOMAIN_TRANSPORT_SOCKET
+};
+
+void init_domain(int rank, int no_ranks, int transport_type, const char* address)
+{
+    domain_rank = rank;
+    domain_no_ranks = no_ranks;
+    transport = &transports[transport_type];
+
+    shrLog("Domain: rank %d of %d over %s %s...\n", rank, no_ranks,
+           (transport_type == DOMAIN_TRANSPORT_SHM) ? "shared memory" : "sockets", address);
+
+    bool connected = transport->open(address);
+    if (!connected)
+    {
+        shrLog("Domain: rank %d could not reach its peers\n", rank);
+    }
+    shrCheckErrorEX(connected, true, pCleanup);
+}
+
+void release_domain()
+{
+    if (transport)
+    {
+        transport->close();
+    }
+    transport = NULL;
+}
+
+/**
+ *  EXCHANGE
+ *  every pair of ranks swaps a size and then the bytes; all ranks walk their peers in
+ *  increasing order and the lower rank of a pair sends first, so every rank takes the
+ *  pairs in the same global order and a blocking transport cannot deadlock
+ */
+void domain_exchange(const std::vector<std::vector<char> >& outgoing, std::vector<std::vector<char> >& incoming)
+{
+    bool ok = true;
+
+    for (int peer = 0; ok && peer < domain_no_ranks; peer++)
+    {
+        if (peer == domain_rank)
+        {
+            continue;
+        }
+
+        for (int turn = 0; ok && turn < 2; turn++)
+        {
+            if ((turn == 0) == (domain_rank < peer))
+            {
+                unsigned long long size = outgoing[peer].size();
+
+                ok = transport->send(peer, (const char*) &size, sizeof(size))
+                  && (size == 0 || transport->send(peer, &outgoing[peer][0], size));
+            }
+            else
+            {
+                unsigned long long size = 0;
+
+                ok = transport->receive(peer, (char*) &size, sizeof(size));
+                incoming[peer].resize(ok ? size : 0);
+                ok = ok && (size == 0 || transport->receive(peer, &incoming[peer][0], size));
+            }
+        }
+    }
+
+    if (!ok)
+    {
+        shrLog("Domain: rank %d lost a peer\n", domain_rank);
+    }
+    shrCheckErrorEX(ok, true, pCleanup);
+}
+
+void domain_sum(std::vector<int>& values)
+{
+    std::vector<std::vector<char> > outgoing(domain_no_ranks), incoming(domain_no_ranks);
+    const char* bytes = (const char*) &values[0];
+
+    for (int peer = 0; peer < domain_no_ranks; peer++)
+    {
+        outgoing[peer].assign(bytes, bytes + values.size() * sizeof(int));
+    }
+
+    domain_exchange(outgoing, incoming);
+
+    for (int peer = 0; peer < domain_no_ranks; peer++)
+    {
+        if (peer != domain_rank)
+        {
+            shrCheckErrorEX(incoming[peer].size() == values.size() * sizeof(int), true, pCleanup);
+
+            const int* theirs = (const int*) &incoming[peer][0];
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                values[i] += theirs[i];
+            }
+        }
+    }
+}
+
+/**
+ *  PARTITION
+ *  cuts at the quantiles of the load; every row also weighs a little, less than
+ *  one agent over the whole grid, so rows without agents are shared out evenly too,
+ *  and a cut is pushed on until both sides keep min_rows
+ */
+void domain_partition(const std::vector<int>& row_load, int no_ranks, int min_rows, std::vector<int>& rows)
+{
+    int no_rows = (int) row_load.size();
+    std::vector<long long> cumulative(no_rows + 1, 0);
+
+    for (int r = 0; r < no_rows; r++)
+    {
+        cumulative[r + 1] = cumulative[r] + (long long) row_load[r] * no_rows + 1;
+    }
+
+    rows.assign(no_ranks + 1, 0);
+    rows[no_ranks] = no_rows;
+
+    for (int k = 1; k < no_ranks; k++)
+    {
+        long long share = cumulative[no_rows] * k / no_ranks;
+        int cut = (int) (std::lower_bound(cumulative.begin(), cumulative.end(), share) - cumulative.begin());
+
+        rows[k] = std::min(std::max(cut, rows[k - 1] + min_rows), no_rows - (no_ranks - k) * min_rows);
+    }
+}
+
+float domain_imbalance(const std::vector<int>& row_load, const std::vector<int>& rows)
+{
+    int no_ranks = (int) rows.size() - 1;
+    long long total = 0, largest = 0;
+
+    for (int k = 0; k < no_ranks; k++)
+    {
+        long long load = 0;
+        for (int r = rows[k]; r < rows[k + 1]; r++)
+        {
+            load += row_load[r];
+        }
+
+        total += load;
+        largest = std::max(largest, load);
+    }
+
+    return (total > 0) ? (float) largest * no_ranks / total : 1.0f;
+}
@@ -0,0 +1,34 @@
+#ifndef DOMAIN_H_INCLUDED
+#define DOMAIN_H_INCLUDED
+
+#include <vector>
+
+/**
+ *  DOMAIN DECOMPOSITION
+ *  host side of a run split over several processes, the ranks: a transport moving
+ *  byte messages between every pair of ranks and the split of the grid rows into
+ *  one strip per rank. Every call blocks until all the other ranks made the same
+ *  call, a rank that went away ends the run through pCleanup.
+ */
+#define DOMAIN_MAX_RANKS            8
+
+#define DOMAIN_TRANSPORT_SHM        0       // one shared memory segment, all ranks on one node
+#define DOMAIN_TRANSPORT_SOCKET     1       // a TCP connection per pair of ranks, any nodes
+
+// address is the segment name for shm, "host:port,host:port,..." with one entry per rank for sockets
+void init_domain(int rank, int no_ranks, int transport, const char* address);
+void release_domain();
+
+// outgoing[peer] is sent to every other rank and incoming[peer] receives what it sent, the rank's own entries are left alone
+void domain_exchange(const std::vector<std::vector<char> >& outgoing, std::vector<std::vector<char> >& incoming);
+
+// element-wise sum over all ranks, in place
+void domain_sum(std::vector<int>& values);
+
+// rows[r] .. rows[r + 1] is the strip of rank r: even shares of row_load, every strip at least min_rows high
+void domain_partition(const std::vector<int>& row_load, int no_ranks, int min_rows, std::vector<int>& rows);
+
+// largest load of a strip over the mean load, 1 for an even split
+float domain_imbalance(const std::vector<int>& row_load, const std::vector<int>& rows);
+
+#endif // DOMAIN_H_INCLUDED
@@ -0,0 +1,146 @@
+#ifndef GRID_LAYOUT_H_INCLUDED
+#define GRID_LAYOUT_H_INCLUDED
+
+/**
+ *  GRID LAYOUT
+ *  maps a grid cell (x, y) to its slot in every grid buffer (matrix, neighbours,
+ *  lookahead, activated); shared by the host and by simpleGL.cl, which gets this
+ *  file prepended to its source and GRID_LAYOUT passed as a build option
+ *
+ *  GRID_LAYOUT_ROW_MAJOR   193 * y + x, the original layout
+ *  GRID_LAYOUT_TILED       8x8 tiles stored one after the other, row-major inside a tile
+ *  GRID_LAYOUT_MORTON      Z-order of the cell, a 3x3 stencil mostly stays in one tile
+ */
+#define GRID_SIDE                   193
+#define GRID_CELLS                  (GRID_SIDE * GRID_SIDE)
+
+#define GRID_LAYOUT_ROW_MAJOR       0
+#define GRID_LAYOUT_TILED           1
+#define GRID_LAYOUT_MORTON          2
+
+#define GRID_TILE_BITS              3
+#define GRID_TILE                   (1 << GRID_TILE_BITS)
+#define GRID_TILES_PER_ROW          ((GRID_SIDE + GRID_TILE - 1) / GRID_TILE)
+#define GRID_MORTON_SIDE            256
+
+#ifndef GRID_LAYOUT
+#define GRID_LAYOUT                 GRID_LAYOUT_MORTON
+#endif
+
+#ifdef __OPENCL_VERSION__
+#define GRID_FN
+#else
+#define GRID_FN                     inline
+#endif
+
+/* cell coordinate of a world coordinate, the grid starts at -0.96 with 0.01 cells */
+GRID_FN int grid_cell(float coordinate)
+{
+    return (int) (coordinate * 100 + 96 + .5);
+}
+
+/* a world coordinate as 16 bits over [-1, 1], steps of 1 / 32768 are far below a 0.01 cell */
+GRID_FN unsigned int grid_quantise(float coordinate)
+{
+    int quantised = (int) ((coordinate + 1.0f) * 32768.0f + .5f);
+
+    return (unsigned int) ((quantised < 0) ? 0 : ((quantised > 0xffff) ? 0xffff : quantised));
+}
+
+GRID_FN float grid_dequantise(unsigned int quantised)
+{
+    return quantised * (1.0f / 32768.0f) - 1.0f;
+}
+
+/* a world point in one 32 bit word, x in the low half */
+GRID_FN unsigned int grid_pack_point(float x, float y)
+{
+    return grid_quantise(x) | (grid_quantise(y) << 16);
+}
+
+/**
+ *  FIXED-POINT POSITIONS
+ *  with FIXED_POSITIONS set the agents' positions are signed 16 bit numbers,
+ *  GRID_FIXED_ONE per 0.01 cell and 0 at the lower edge of cell 96 (-0.005 in the
+ *  world), so the cell of a position is a shift; the range covers [-1.285, 1.275)
+ *  in steps of 1 / 25600
+ */
+#define GRID_FIXED_BITS             8
+#define GRID_FIXED_ONE              (1 << GRID_FIXED_BITS)
+
+GRID_FN int grid_fix(float coordinate)
+{
+    // biased to stay positive, the truncation then rounds to the nearest
+    int fixed = (int) ((coordinate * 100 + .5f) * GRID_FIXED_ONE + 32768.5f) - 32768;
+
+    return (fixed < -32768) ? -32768 : ((fixed > 32767) ? 32767 : fixed);
+}
+
+GRID_FN float grid_unfix(int fixed)
+{
+    return (fixed * (1.0f / GRID_FIXED_ONE) - .5f) * .01f;
+}
+
+/* grid_cell() of a fixed-point coordinate, 128 cells are the bias that keeps the shift on positive numbers */
+GRID_FN int grid_fixed_cell(int fixed)
+{
+    return ((fixed + 32768) >> GRID_FIXED_BITS) - 128 + 96;
+}
+
+/* 8 bits of value moved to the even bits of the result */
+GRID_FN unsigned int grid_spread_bits(unsigned int value)
+{
+    value &= 0xff;
+    value = (value | (value << 4)) & 0x0f0f;
+    value = (value | (value << 2)) & 0x3333;
+    value = (value | (value << 1)) & 0x5555;
+
+    return value;
+}
+
+/* a cell outside the grid is clamped to the nearest border cell, so stencils may reach one past the border */
+GRID_FN int grid_index_in(int layout, int x, int y)
+{
+    x = (x < 0) ? 0 : ((x > GRID_SIDE - 1) ? GRID_SIDE - 1 : x);
+    y = (y < 0) ? 0 : ((y > GRID_SIDE - 1) ? GRID_SIDE - 1 : y);
+
+    if (layout == GRID_LAYOUT_TILED)
+    {
+        int tile = (y >> GRID_TILE_BITS) * GRID_TILES_PER_ROW + (x >> GRID_TILE_BITS);
+
+        return (tile << (2 * GRID_TILE_BITS)) + ((y & (GRID_TILE - 1)) << GRID_TILE_BITS) + (x & (GRID_TILE - 1));
+    }
+    if (layout == GRID_LAYOUT_MORTON)
+    {
+        return grid_spread_bits(x) | (grid_spread_bits(y) << 1);
+    }
+
+    return GRID_SIDE * y + x;
+}
+
+/* number of slots a grid buffer needs, tiled and Morton layouts pad the 193x193 cells */
+GRID_FN int grid_size_in(int layout)
+{
+    if (layout == GRID_LAYOUT_TILED)
+    {
+        return GRID_TILES_PER_ROW * GRID_TILES_PER_ROW * GRID_TILE * GRID_TILE;
+    }
+    if (layout == GRID_LAYOUT_MORTON)
+    {
+        return GRID_MORTON_SIDE * GRID_MORTON_SIDE;
+    }
+
+    return GRID_CELLS;
+}
+
+GRID_FN int grid_index(int x, int y)
+{
+    return grid_index_in(GRID_LAYOUT, x, y);
+}
+
+GRID_FN int grid_size()
+{
+    return grid_size_in(GRID_LAYOUT);
+}
+
+#endif // GRID_LAYOUT_H_INCLUDED
@@ -24,15 +24,31 @@
 #include <iostream>
 #include <cassert>
 #include <vector>
+#include <map>
 #include <fstream>
 #include <string>
+#include <algorithm>
+#include <cmath>
+#include <climits>
+#include <thread>
 
 #include <sys/time.h>
+#include <unistd.h>
 
 // Utilities, OpenCL and system includes
 #include <oclUtils.h>
 #include <shrQATest.h>
 
+#include "primitives.hpp"
+#include "domain.hpp"
+#include "tasks.hpp"
+#include "worksize.hpp"
+
+// layout of the grid buffers, picked with the "layout" flag and passed on to the kernels
+extern int grid_layout;
+#define GRID_LAYOUT grid_layout
+#include "grid_layout.h"
+
 #if defined (__APPLE__) || defined(MACOSX)
    #define GL_SHARING_EXTENSION "cl_APPLE_gl_sharing"
 #else
@@ -62,29 +78,145 @@ cl_program  cpProgram;
 cl_int      ciErrNum;
 char*       cPathAndName    = NULL;             // var for full paths to data, src, etc.
 char*       cSourceCL       = NULL;             // Buffer to hold source for compilation
+char*       cGridLayoutCL   = NULL;             // grid_layout.h, prepended to cSourceCL
 const char* cExecutableName = NULL;
 
+/**
+ *  COMPUTE DEVICES
+ *  "devicetype" picks gpu (the default), cpu or all, the CPU is taken when there is
+ *  no GPU. A device without GL sharing runs the No-GL sequence for "frames" frames.
+ *  A CPU without GL is split into one sub-device per NUMA node: every sub-device
+ *  gets a queue and a contiguous share of the active agents in the per-agent
+ *  kernels, and the agent buffers are first touched by their share's node.
+ */
+#define MAX_SUB_DEVICES     16
+#define NO_GL_FRAMES        1000
+
+cl_device_type      device_type = CL_DEVICE_TYPE_GPU;
+cl_device_id        device_used;
+cl_uint             no_sub_devices = 0;
+cl_device_id        sub_devices[MAX_SUB_DEVICES];
+cl_command_queue    sub_queues[MAX_SUB_DEVICES];        // sub_queues[0] is cqCommandQueue
+int                 no_gl_frames = NO_GL_FRAMES;
+
+bool split_by_numa(cl_device_id device);
+void enqueue_agent_kernel(cl_kernel kernel, int no_agents, const cl_int2* cuts);
+cl_mem create_agent_buffer(cl_mem_flags flags, size_t bytes_per_agent, const void* data);
+
+/**
+ *  LARGE CROWDS
+ *  agents are counted and indexed by an int on both sides, up to AGENT_MAX_COUNT of
+ *  them, while every byte count and offset on the host is a size_t. No buffer may
+ *  pass the device's CL_DEVICE_MAX_MEM_ALLOC_SIZE: device_bytes() checks each
+ *  allocation and leaves with the most items that would fit, the neighbour list
+ *  stops doubling there. Long ranges are launched in chunks, see worksize.hpp.
+ */
+#define AGENT_MAX_COUNT     (INT_MAX / 4)   // the colour bytes are indexed by an int, 4 an agent; also bounds the outbox records
+
+cl_ulong    max_alloc_bytes = 0;
+
+size_t device_bytes(size_t no_items, size_t bytes_per_item);
+size_t agent_bytes(size_t bytes_per_agent);
+
+/**
+ *  LOAD BALANCE
+ *  crowds pile up, so the sub-devices' shares of the active list are cut by work
+ *  rather than by agents: an agent costs one plus its listed neighbours. The cuts are
+ *  recomputed whenever the active list or the neighbour lists changed, which moves
+ *  agents out of a share that got crowded and into its quieter neighbours. The
+ *  "telemetry" flag logs agents and neighbour pairs per share (and per rank), and the
+ *  agent type buckets, every TELEMETRY_INTERVAL frames.
+ */
+#define TELEMETRY_INTERVAL          64
+
+bool    telemetry = false;
+int     telemetry_frame = 0;
+bool    work_shares_valid = false;
+cl_int2 work_cuts[MAX_SUB_DEVICES + 1];         // first active entry of every share, work before it
+cl_mem  cl_agent_work;
+cl_mem  cl_work_cuts;
+
+void createLoadBalanceBuffers();
+void cut_work_shares(cl_mem agents, int no_agents, cl_int2* cuts);
+void balance_work_shares();
+void log_work_telemetry();
+
+/**
+ *  HOST TASKS
+ *  the loops left on the host (grid build, obstacle table, domain bookkeeping and
+ *  the benchmark references) run as small tasks on the work-stealing pool of
+ *  tasks.hpp. The "threads" flag sets its workers, by default one per hardware
+ *  thread, shared out between the ranks of a node when they run over shm.
+ */
+#define HOST_GRAIN_ROWS             8       // grid rows per task
+#define HOST_GRAIN_ITEMS            4096    // agents or grid slots per task
+#define HOST_GRAIN_OBSTACLES        64      // obstacles per task
+
+int host_threads = 0;
+
 void init_world();
 void map_obstacles_to_matrix();
+void benchmark_grid_layouts();
 
 /**
- *   NEIGHBOURS DEFINITION
+ *  KERNEL SPECIALISATION
+ *  a world sets the scenario constants of simpleGL.cl (the ones under #ifndef there)
+ *  with trailing "constant|NAME value" lines in world.ads. They are passed as -D build
+ *  options, so the kernels fold them just like the defaults in the source. Every set
+ *  of build options is one program variant, built once per run and kept on disk as a
+ *  binary named by a hash of the device, the driver, the source and the options.
  */
-GLint   *neighbours_x;
-GLint   *neighbours_y;
-GLuint  vbo_neighbours_x;
-GLuint  vbo_neighbours_y;
-cl_mem  vbo_cl_neighbours_x;
-cl_mem  vbo_cl_neighbours_y;
+#define VARIANT_FILE_PREFIX         "oclSimpleGL_variant_"
+
+std::vector<std::pair<std::string, std::string> > kernel_constants;    // name, value, in world.ads order
+std::map<std::string, cl_program> program_variants;                    // by build options
+
+void add_kernel_constant(const std::string& line);
+double kernel_constant(const char* name, double default_value);
+void check_kernel_constants();
+std::string variant_file_name(const std::string& options);
+cl_program load_program_variant(const std::string& options, const std::string& file_name);
+void save_program_variant(cl_program program, const std::string& file_name);
+cl_program createSimulationProgram(int layout);
 
-void map_points_to_neighbours();
-void createVBONeighboursX(GLuint* vbo);
-void createVBONeighboursY(GLuint* vbo);
+/**
+ *   NEIGHBOURS DEFINITION
+ *   agents binned per cell, then one compressed sparse row per agent with the agents
+ *   closer than LIMIT_PROXIMITY + NEIGHBOUR_SKIN; the list grows with the crowd and is
+ *   only rebuilt once some agent moved more than half the skin since the last build.
+ *   The largest move is read a frame late, the threshold keeps one step in hand for it
+ */
+#define NEIGHBOUR_SKIN              0.02f
+
+bool    neighbour_lists_valid = false;
+int     neighbour_rebuilds = 0;
+int     neighbour_list_capacity = 0;
+int     neighbour_list_entries = 0;
+cl_mem  cl_cell_counts;
+cl_mem  cl_cell_start;
+cl_mem  cl_cell_agents;
+cl_mem  cl_agent_rank;
+cl_mem  cl_neighbour_offsets;
+cl_mem  cl_neighbour_list;
+cl_mem  cl_position_at_build;
+cl_mem  cl_displacement;
+cl_mem  cl_max_displacement;
+cl_mem  cl_neighbour_total;
+float   max_displacement_read = 0.0f;           // read back without waiting, looked at a frame later
+float   neighbour_step_margin = 0.0015f;        // ORCA_MAX_SPEED, the step taken since the read
+cl_event displacement_read = NULL;
+
+void createNeighbourListBuffers();
+void build_neighbour_lists();
+void update_neighbour_lists();
 
 /**
  *  MATRIX DEFINITION
+ *  matrix holds the 193x193 cell positions row by row, every other grid buffer
+ *  has grid_size() slots indexed with grid_index()
  */
-int     matrix_size = 37249;
+int     grid_layout = GRID_LAYOUT_MORTON;
+int     matrix_size = GRID_CELLS;
 GLfloat *matrix;
 GLint   *matrix_x;
 GLint   *matrix_y;
@@ -101,26 +233,21 @@ void createVBOMatrixX(GLuint* vbo);
 void createVBOMatrixY(GLuint* vbo);
 
 /**
- *  LOOKAHEAD X & Y MATRIX MAPPING
+ *  OBSTACLE TABLE
+ *  every grid cell holds the id of the obstacle covering it, 0 for none and i + 1
+ *  for obstacle i; the y range and the end activation of an obstacle are stored
+ *  once, in tables indexed by that id whose entry 0 stays all zero
  */
-GLfloat *lookahead_x;
-GLfloat *lookahead_y;
-GLuint vbo_lookahead_x;
-GLuint vbo_lookahead_y;
-cl_mem vbo_cl_lookahead_x;
-cl_mem vbo_cl_lookahead_y;
-
-void createVBOLookaheadX(GLuint* vbo);
-void createVBOLookaheadY(GLuint* vbo);
+#define MAX_OBSTACLE_ID 65535
 
-/**
- *  ACTIVATION MATIX MAPPING
- */
-GLint *activated;
-GLuint vbo_activated;
-cl_mem vbo_cl_activated;
+GLushort *obstacle_id;
+GLfloat  *obstacle_range;           // 2 per id: min y, max y
+GLint    *obstacle_activation;      // 2 per id: start end, end end
+cl_mem   cl_obstacle_id;
+cl_mem   cl_obstacle_range;
+cl_mem   cl_obstacle_activation;
 
-void createVBOActivated(GLuint* vbo);
+void createObstacleTableBuffers();
 
 /**
  *  OBSTACLES POSITIONS DEFINITION
@@ -134,17 +261,63 @@ cl_mem  vbo_cl_obstacle_positions;
 void createVBOObstaclePositions(GLuint* vbo);
 
 /**
- *  OBSTACLES Y RANGES
+ *  OBSTACLE SEGMENTS
+ *  every obstacle is a polyline whose segments carry its id; they are rasterised
+ *  into matrix_x, matrix_y and the obstacle ids on the device, one work-item per
+ *  column (or row) a segment crosses
+ */
+std::vector<cl_float4> obstacle_segments;       // x0, y0, x1, y1
+std::vector<GLushort>  segment_obstacle_ids;
+bool    obstacles_rasterised = false;
+cl_mem  cl_obstacle_segments;
+cl_mem  cl_segment_obstacle_ids;
+cl_mem  cl_segment_span_offsets;
+
+std::vector<GLint>     obstacle_segment_offsets;  // segments of id are [offsets[id - 1], offsets[id])
+
+void add_obstacle_polyline(const GLfloat* points, int no_polyline_points, int id, int first_segment);
+void rasterise_obstacles();
+void rasterise_segment_list(cl_mem segments, cl_mem segment_ids, int no_segments);
+
+/**
+ *  MOVING OBSTACLES
+ *  an obstacle given a velocity (world units per step) or a spin (radians per step
+ *  about its first point) in world.ads is transformed every step from its initial
+ *  segments; only the cells of its old and new bounding boxes are cleared and the
+ *  segments touching them rasterised again, so the cost follows the motion
+ */
+GLfloat *obstacle_velocities;                   // 2 per obstacle position, as read from world.ads
+GLfloat *obstacle_spins;                        // 1 per obstacle position
+std::vector<GLint>     moving_obstacles;        // ids
+std::vector<cl_float2> moving_obstacle_offset;
+std::vector<GLfloat>   moving_obstacle_angle;
+std::vector<cl_float4> initial_segments;
+std::vector<cl_int4>   dirty_rectangles;        // inclusive cell bounds x0, y0, x1, y1
+std::vector<GLint>     dirty_rectangle_offsets;
+std::vector<cl_float4> dirty_segments;
+std::vector<GLushort>  dirty_segment_ids;
+int     dirty_rectangle_capacity = 0;
+int     dirty_segment_capacity = 0;
+cl_mem  cl_dirty_rectangles;
+cl_mem  cl_dirty_rectangle_offsets;
+cl_mem  cl_dirty_segments;
+cl_mem  cl_dirty_segment_ids;
+cl_event obstacle_upload = NULL;                // last write of the frame, the host arrays wait for it
+
+cl_int4 segments_bounding_cells(int first_segment, int end_segment);
+void move_obstacles();
+
+/**
+ *  DISTANCE FIELD
+ *  signed distance to the nearest wall, its direction and the wall's obstacle id,
+ *  one float4 per cell; rebuilt by jump flooding whenever the obstacles changed
  */
-GLint* start_index_y_obstacle;
-GLint* end_index_y_obstacle;
-GLuint vbo_start_index_y_obstacle;
-GLuint vbo_end_index_y_obstacle;
-cl_mem vbo_cl_start_index_y_obstacle;
-cl_mem vbo_cl_end_index_y_obstacle;
+bool    distance_field_valid = false;
+cl_mem  cl_jfa_seeds[2];
+cl_mem  cl_distance_field;
 
-void createVBOStartIndexTObstacle(GLuint* vbo);
-void createVBOEndIndexTObstacle(GLuint* vbo);
+void createDistanceFieldBuffers();
+void build_distance_field();
 
 /**
  *  OBSTACLES COLOR DEFINITION
@@ -165,10 +338,22 @@ cl_mem  vbo_cl_points_position;
 
 void createVBOPointsPosition(GLuint* vbo);
 
+/**
+ *  FIXED-POINT POSITIONS
+ *  with the "fixedpoint" flag the device keeps the positions as grid_fix() shorts,
+ *  4 bytes an agent instead of 8: the kernels are built with FIXED_POSITIONS, the
+ *  cell of an agent is a shift and a step is added as whole units, so the sums are
+ *  exact. Steps under 1/25600 of the world are lost; the velocities stay floats.
+ *  points_position keeps the floats of world.ads on the host.
+ */
+bool    fixed_positions = false;
+size_t  position_bytes = 2 * sizeof(GLfloat);
+
 /**
  *  POINTS COLOR DEFINITION
+ *  RGBA8, the colours never change and are only drawn
  */
-GLfloat *points_color;
+GLubyte *points_color;
 GLuint  vbo_points_color;
 cl_mem  vbo_cl_points_color;
 
@@ -176,6 +361,8 @@ void createVBOPointsColor(GLuint* vbo);
 
 /**
  *  POINTS TARGET DEFINITION
+ *  the floats of world.ads stay on the host, the device gets them packed by
+ *  grid_pack_point() into one word per agent
  */
 GLfloat *points_target;
 GLuint vbo_points_target;
@@ -190,12 +377,221 @@ int no_attractions;
 
 
 /**
- *  ATTRACTION KERNEL USER INPUT
+ *  OBSTACLE COMMANDS
+ *  obstacle edits queued by the host and applied on the device in one launch on
+ *  the next frame; nothing is launched while no command is pending
+ */
+std::vector<cl_int4> obstacle_commands;
+int     obstacle_command_capacity = 0;
+cl_mem  cl_obstacle_commands;
+
+void queue_obstacle_command(int obstacle, int end_start, int value);
+void toggle_obstacle_attraction(int obstacle, int end_start);
+void apply_obstacle_commands();
+
+/**
+ *  ACTIVE AGENTS DEFINITION
+ *  agents that did not reach their target yet; the list is compacted
+ *  every ACTIVE_COMPACTION_INTERVAL frames
+ */
+#define ACTIVE_COMPACTION_INTERVAL  8
+
+int     no_active;
+int     current_active_list = 0;
+int     frames_since_compaction = 0;
+GLint   *active_agents;
+cl_mem  cl_active_agents[2];
+cl_mem  cl_active_flags;
+cl_mem  cl_no_active;
+
+void createActiveAgentsBuffers();
+void compact_active_agents();
+
+/**
+ *  AGENT VELOCITIES
+ *  the step every agent took last frame, which its neighbours avoid with ORCA;
+ *  new_velocity holds the new steps until labirinth applies them
+ */
+cl_mem  cl_agent_velocity;
+cl_mem  cl_new_velocity;
+
+void createVelocityBuffers();
+
+/**
+ *  CONTINUUM CROWD
+ *  for very dense crowds: density and mean velocity are splatted to the grid and
+ *  every goal group walks down its own potential. Targets are binned into square
+ *  goal regions of CONTINUUM_GOAL_REGION cells, grown until there are at most
+ *  CONTINUUM_MAX_GROUPS of them. The potentials are kept between frames and refined
+ *  by CONTINUUM_SWEEPS_PER_FRAME sweeps, a full warm-up runs first and again
+ *  whenever the obstacles changed.
+ */
+#define CONTINUUM_GOAL_REGION       8
+#define CONTINUUM_MAX_GROUPS        16
+#define CONTINUUM_SWEEPS_PER_FRAME  8
+#define CONTINUUM_WARM_UP_SWEEPS    (4 * GRID_SIDE)
+#define CONTINUUM_FAR               1e9f
+
+int     no_goal_groups = 0;
+int     continuum_warm_up = CONTINUUM_WARM_UP_SWEEPS;
+int     current_potential = 0;
+cl_mem  cl_goal_group;
+cl_mem  cl_crowd_splat;
+cl_mem  cl_crowd_density;
+cl_mem  cl_crowd_speed;
+cl_mem  cl_crowd_potential[2];
+
+void createContinuumBuffers();
+void update_crowd_fields();
+
+/**
+ *  CROWD MODEL & LEVEL OF DETAIL
+ *  which agents get ORCA and which follow the continuum potential, per cell of the
+ *  lod table: all micro for CROWD_ORCA, all macro for CROWD_CONTINUUM ("continuum"
+ *  flag), and for CROWD_HYBRID ("hybrid" flag) micro inside the focus regions of
+ *  world.ads and wherever the crowd is sparse; the space bar cycles the models
+ */
+#define CROWD_ORCA                  0
+#define CROWD_CONTINUUM             1
+#define CROWD_HYBRID                2
+
+#define LOD_MACRO                   0
+#define LOD_MICRO                   1
+
+int     crowd_model = CROWD_ORCA;
+std::vector<cl_float4> focus_regions;
+cl_mem  cl_lod;
+cl_mem  cl_lod_focus;
+cl_mem  cl_lod_changed;
+int     lod_changed_read = 0;                   // read back without waiting, looked at a frame later
+int     lod_changed_clear = 0;
+cl_event lod_read = NULL;
+
+void createLevelOfDetailBuffers();
+void set_crowd_model(int model);
+void update_level_of_detail();
+
+/**
+ *  MULTI-RATE STEPPING
+ *  with the "multirate" flag quiet tiles of the grid step every 2, 4 or 8 frames by
+ *  that many steps; the tile intervals are reclassified once per ACTIVITY_WINDOW
+ *  frames, so within a window every agent covers the same time, and the tiles an
+ *  obstacle moved through stay at every frame for ACTIVITY_HOLD_WINDOWS windows
+ */
+#define ACTIVITY_WINDOW             8
+#define ACTIVITY_HOLD_WINDOWS       2
+#define ACTIVITY_HOLD_MARGIN        3           // cells, WALL_RANGE
+#define ACTIVITY_TILES              (GRID_TILES_PER_ROW * GRID_TILES_PER_ROW)
+
+bool    multirate = false;
+int     activity_frame = 0;
+int     activity_hold_margin = ACTIVITY_HOLD_MARGIN;    // cells, follows the world's WALL_RANGE
+std::vector<GLint> tile_hold;
+cl_mem  cl_tile_stats;
+cl_mem  cl_tile_hold;
+cl_mem  cl_tile_interval;
+cl_mem  cl_step_multiplier;
+cl_mem  cl_last_step;                           // frame every agent's time is covered up to
+
+void createMultirateBuffers();
+void hold_tiles(const cl_int4& rectangle);
+void schedule_agents();
+
+/**
+ *  AGENT TYPES
+ *  every frame the active agents are bucketed by behaviour with agent_types() of
+ *  simpleGL.cl and a stable radix sort on the type, and every velocity kernel runs
+ *  over its own bucket only, so no kernel tests what an agent does and a wavefront
+ *  never mixes ORCA agents with continuum or idle ones. A new behaviour is a new type
+ *  below AGENT_TYPES, its case in agent_types() and its kernel in solve_velocities();
+ *  the agents of the other types never enter that kernel. With a single crowd model
+ *  and no multirate only one type is possible, the active list is then the bucket.
+ */
+#define AGENT_TYPE_MICRO            0           // ORCA, orca_velocities
+#define AGENT_TYPE_MACRO            1           // continuum potential, continuum_velocities
+#define AGENT_TYPE_IDLE             2           // waiting for its tile's frame, or arrived
+#define AGENT_TYPES                 3
+#define AGENT_TYPE_BITS             2
+
+bool    agents_bucketed = false;                // cl_bucket_agents holds this frame's buckets
+GLint   type_counts[AGENT_TYPES];
+GLint   type_first[AGENT_TYPES];
+cl_int2 micro_cuts[MAX_SUB_DEVICES + 1];        // work cuts of the micro bucket, with several sub-devices
+cl_mem  cl_type_keys;
+cl_mem  cl_bucket_agents;
+cl_mem  cl_type_counts;
+
+void createAgentTypeBuffers();
+void bucket_agent_types();
+void solve_velocities();
+
+/**
+ *  DOMAIN DECOMPOSITION
+ *  "ranks=n" splits the run over n processes, started with "rank=0" .. "rank=n-1" and
+ *  joined by "transport=shm" (the default, segment named by "address") or
+ *  "transport=socket" ("address=host:port,..." with one entry per rank). Each rank
+ *  steps the agents in its strip of grid rows; every slot is kept on every rank and
+ *  the ones owned elsewhere are ghosts, refreshed by the halo exchange at the start
+ *  of every frame. Every DOMAIN_REPARTITION_INTERVAL frames the strips are cut again
+ *  once their work, as the sub-device shares count it, is more than DOMAIN_IMBALANCE apart.
+ */
+#define DOMAIN_HALO_ROWS            6           // NEIGHBOUR_SEARCH_CELLS and the longest multirate step
+#define DOMAIN_MIN_ROWS             (2 * DOMAIN_HALO_ROWS + 2)
+#define DOMAIN_RECORDS_PER_AGENT    2           // strips of DOMAIN_MIN_ROWS put an agent in at most 2 halos
+#define DOMAIN_REPARTITION_INTERVAL 128
+#define DOMAIN_IMBALANCE            1.2f
+#define DOMAIN_OWNER_MASK           0xffff
+#define DOMAIN_SENT_SHIFT           16
+#define DOMAIN_HANDOFF              0x10000
+
+int     no_ranks = 1;
+int     domain_rank = 0;
+int     domain_transport = DOMAIN_TRANSPORT_SHM;
+char*   domain_address = NULL;
+int     domain_frame = 0;
+int     domain_handoffs = 0;
+std::vector<GLint> domain_rows;
+std::vector<GLint> agent_domain;
+cl_mem  cl_domain_rows;
+cl_mem  cl_agent_domain;
+cl_mem  cl_outbox_count;
+cl_mem  cl_outbox_info;
+cl_mem  cl_outbox_state;
+cl_mem  cl_inbox_info;
+cl_mem  cl_inbox_state;
+cl_mem  cl_row_load;
+
+void createDomainBuffers();
+int  domain_of_row(int row);
+int  domain_halo_mask(int row);
+void exchange_halos();
+int  apply_domain_records(std::vector<std::vector<char> >& incoming);
+void rebuild_active_agents();
+void broadcast_owned_agents();
+void repartition_domains();
+
+/**
+ *  MORTON REORDERING DEFINITION
+ *  agent slots are re-sorted along the Z-order curve of their cell every
+ *  MORTON_REORDER_INTERVAL frames, agent_ids maps a slot back to its world.ads id
  */
-int start_index_y;
-int end_start;
-int value;
-int no_points_obstacle = 1;
+#define MORTON_REORDER_INTERVAL     64
+#define MORTON_KEY_BITS             16
+
+int     frames_since_reorder = 0;
+int     current_agent_ids = 0;
+GLint   *agent_ids;
+cl_mem  cl_agent_ids[2];
+cl_mem  cl_morton_keys;
+cl_mem  cl_morton_order;
+cl_mem  cl_sorted_position;
+cl_mem  cl_sorted_target;
+cl_mem  cl_sorted_color;
+cl_mem  cl_sorted_velocity;
+cl_mem  cl_sorted_last_step;
+
+void createMortonBuffers();
+void reorder_agents_morton();
 
 // vbo variables
 
@@ -253,7 +649,38 @@ void timerEvent(int value);
  *  KERNELS
  */
 cl_kernel ckKernel_labirinth;
-cl_kernel ckKernel_activate_deactivate_obstacle_attraction;
+cl_kernel ckKernel_orca_velocities;
+cl_kernel ckKernel_splat_crowd;
+cl_kernel ckKernel_resolve_crowd_splat;
+cl_kernel ckKernel_crowd_speed;
+cl_kernel ckKernel_eikonal_sweep;
+cl_kernel ckKernel_continuum_velocities;
+cl_kernel ckKernel_update_lod;
+cl_kernel ckKernel_tile_activity;
+cl_kernel ckKernel_classify_tiles;
+cl_kernel ckKernel_schedule_agents;
+cl_kernel ckKernel_agent_types;
+cl_kernel ckKernel_agent_work;
+cl_kernel ckKernel_work_cuts;
+cl_kernel ckKernel_domain_outbox;
+cl_kernel ckKernel_domain_inbox;
+cl_kernel ckKernel_domain_flag_agents;
+cl_kernel ckKernel_domain_row_load;
+cl_kernel ckKernel_apply_obstacle_commands;
+cl_kernel ckKernel_count_segment_spans;
+cl_kernel ckKernel_rasterise_segments;
+cl_kernel ckKernel_clear_dirty_rectangles;
+cl_kernel ckKernel_jfa_init;
+cl_kernel ckKernel_jfa_step;
+cl_kernel ckKernel_jfa_distance;
+cl_kernel ckKernel_flag_active_agents;
+cl_kernel ckKernel_morton_keys;
+cl_kernel ckKernel_count_cell_agents;
+cl_kernel ckKernel_fill_cell_agents;
+cl_kernel ckKernel_count_neighbours;
+cl_kernel ckKernel_fill_neighbours;
+cl_kernel ckKernel_neighbour_displacement;
+cl_kernel ckKernel_gather_agents;
 //cl_kernel ckKernel_neighbours;
 //cl_kernel ckKernel_create_collision_map;
 //cl_kernel ckKernel_compute_velocity;
@@ -302,7 +729,66 @@ int main(int argc, char** argv)
     {
         bQATest   = shrCheckCmdLineFlag(argc, (const char**)argv, "qatest");
         bNoPrompt = shrCheckCmdLineFlag(argc, (const char**)argv, "noprompt");
+        crowd_model = shrCheckCmdLineFlag(argc, (const char**)argv, "continuum") ? CROWD_CONTINUUM
+                    : (shrCheckCmdLineFlag(argc, (const char**)argv, "hybrid") ? CROWD_HYBRID : CROWD_ORCA);
+        multirate = shrCheckCmdLineFlag(argc, (const char**)argv, "multirate");
+        fixed_positions = shrCheckCmdLineFlag(argc, (const char**)argv, "fixedpoint");
+        position_bytes = fixed_positions ? 2 * sizeof(cl_short) : 2 * sizeof(GLfloat);
+        telemetry = shrCheckCmdLineFlag(argc, (const char**)argv, "telemetry");
+
+        char* layout_name;
+        if (shrGetCmdLineArgumentstr(argc, (const char**)argv, "layout", &layout_name))
+        {
+            grid_layout = (strcmp(layout_name, "row") == 0) ? GRID_LAYOUT_ROW_MAJOR
+                        : ((strcmp(layout_name, "tiled") == 0) ? GRID_LAYOUT_TILED : GRID_LAYOUT_MORTON);
+        }
+
+        char* device_type_name;
+        if (shrGetCmdLineArgumentstr(argc, (const char**)argv, "devicetype", &device_type_name))
+        {
+            device_type = (strcmp(device_type_name, "cpu") == 0) ? CL_DEVICE_TYPE_CPU
+                        : ((strcmp(device_type_name, "all") == 0) ? CL_DEVICE_TYPE_ALL : CL_DEVICE_TYPE_GPU);
+        }
+        shrGetCmdLineArgumenti(argc, (const char**)argv, "frames", &no_gl_frames);
+
+        char* transport_name;
+        if (shrGetCmdLineArgumentstr(argc, (const char**)argv, "transport", &transport_name))
+        {
+            domain_transport = (strcmp(transport_name, "socket") == 0) ? DOMAIN_TRANSPORT_SOCKET : DOMAIN_TRANSPORT_SHM;
+        }
+        shrGetCmdLineArgumenti(argc, (const char**)argv, "ranks", &no_ranks);
+        shrGetCmdLineArgumenti(argc, (const char**)argv, "rank", &domain_rank);
+        shrGetCmdLineArgumentstr(argc, (const char**)argv, "address", &domain_address);
+        shrGetCmdLineArgumenti(argc, (const char**)argv, "threads", &host_threads);
+    }
+
+    // a rank only holds its strip up to date, nobody has the whole picture to draw
+    // and the continuum fields would be splatted from stale ghosts
+    // clamping would hand two processes the same rank, which only shows as a lost peer later
+    int max_ranks = std::min(DOMAIN_MAX_RANKS, GRID_SIDE / DOMAIN_MIN_ROWS);
+    if (no_ranks < 1 || no_ranks > max_ranks || domain_rank < 0 || domain_rank >= no_ranks)
+    {
+        shrLog("Domain: rank %d of %d ranks, ranks must be 1 to %d and rank 0 to ranks - 1\n", domain_rank, no_ranks, max_ranks);
+        Cleanup(EXIT_FAILURE);
+    }
+    if (no_ranks > 1)
+    {
+        if (crowd_model != CROWD_ORCA)
+        {
+            shrLog("Domain decomposition only steps ORCA agents, the crowd model is set to ORCA\n");
+            crowd_model = CROWD_ORCA;
+        }
+        bQATest = shrTRUE;
+
+        init_domain(domain_rank, no_ranks, domain_transport, domain_address ? domain_address : "oclSimpleGL");
+    }
+
+    if (host_threads <= 0 && no_ranks > 1 && domain_transport == DOMAIN_TRANSPORT_SHM)
+    {
+        host_threads = std::max((int) std::thread::hardware_concurrency() / no_ranks, 1);
     }
+    init_tasks(host_threads);
+    shrLog("Host tasks on %d workers\n\n", tasks_workers());
 
     // Initialize OpenGL items (if not No-GL QA test)
     shrLog("%sInitGL...\n\n", bQATest ? "Skipping " : "Calling ");
@@ -315,17 +801,23 @@ int main(int argc, char** argv)
     ciErrNum = oclGetPlatformID(&cpPlatform);
     oclCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-    // Get the number of GPU devices available to the platform
-    ciErrNum = clGetDeviceIDs(cpPlatform, CL_DEVICE_TYPE_GPU, 0, NULL, &uiDevCount);
+    // Get the number of devices of the requested type available to the platform, CPU-only nodes fall back to the CPU
+    ciErrNum = clGetDeviceIDs(cpPlatform, device_type, 0, NULL, &uiDevCount);
+    if (ciErrNum == CL_DEVICE_NOT_FOUND && device_type == CL_DEVICE_TYPE_GPU)
+    {
+        shrLog("No GPU device found, using the CPU...\n\n");
+        device_type = CL_DEVICE_TYPE_CPU;
+        ciErrNum = clGetDeviceIDs(cpPlatform, device_type, 0, NULL, &uiDevCount);
+    }
     oclCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
     // Create the device list
     cdDevices = new cl_device_id [uiDevCount];
-    ciErrNum = clGetDeviceIDs(cpPlatform, CL_DEVICE_TYPE_GPU, uiDevCount, cdDevices, NULL);
+    ciErrNum = clGetDeviceIDs(cpPlatform, device_type, uiDevCount, cdDevices, NULL);
     oclCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-    // Get device requested on command line, if any
-    unsigned int uiDeviceUsed = 0;
+    // Get device requested on command line, if any; ranks sharing a node spread over its devices
+    unsigned int uiDeviceUsed = domain_rank % uiDevCount;
     unsigned int uiEndDev = uiDevCount - 1;
     if(shrGetCmdLineArgumentu(argc, (const char**)argv, "device", &uiDeviceUsed ))
     {
@@ -371,9 +863,19 @@ int main(int argc, char** argv)
             }
         }
 
-        shrLog("%s...\n\n", bSharingSupported ? "Using CL-GL Interop" : "No device found that supports CL/GL context sharing");
-        oclCheckErrorEX(bSharingSupported, true, pCleanup);
+        shrLog("%s...\n\n", bSharingSupported ? "Using CL-GL Interop" : "No device found that supports CL/GL context sharing, running without GL");
+
+        // the simulation does not need the window, it runs as the No-GL sequence
+        if (!bSharingSupported)
+        {
+            glutDestroyWindow(iGLUTWindowHandle);
+            iGLUTWindowHandle = 0;
+            bQATest = shrTRUE;
+        }
+    }
 
+    if(!bQATest)
+    {
         // Define OS-specific context properties and create the OpenCL context
         #if defined (__APPLE__)
             CGLContextObj kCGLContext = CGLGetCurrentContext();
@@ -409,7 +911,16 @@ int main(int argc, char** argv)
     else
     {
         cl_context_properties props[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)cpPlatform, 0};
-        cxGPUContext = clCreateContext(props, 1, &cdDevices[uiDeviceUsed], NULL, NULL, &ciErrNum);
+
+        // a CPU split by NUMA node gets one context over all its sub-devices
+        if (split_by_numa(cdDevices[uiDeviceUsed]))
+        {
+            cxGPUContext = clCreateContext(props, no_sub_devices, sub_devices, NULL, NULL, &ciErrNum);
+        }
+        else
+        {
+            cxGPUContext = clCreateContext(props, 1, &cdDevices[uiDeviceUsed], NULL, NULL, &ciErrNum);
+        }
     }
 
     shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
@@ -419,48 +930,128 @@ int main(int argc, char** argv)
     oclPrintDevName(LOGBOTH, cdDevices[uiDeviceUsed]);
     shrLog("\n");
 
-    // create a command-queue
-    cqCommandQueue = clCreateCommandQueue(cxGPUContext, cdDevices[uiDeviceUsed], 0, &ciErrNum);
+    // create a command-queue, and one more per NUMA sub-device
+    device_used = (no_sub_devices > 1) ? sub_devices[0] : cdDevices[uiDeviceUsed];
+    cqCommandQueue = clCreateCommandQueue(cxGPUContext, device_used, 0, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    sub_queues[0] = cqCommandQueue;
+    for (cl_uint d = 1; d < no_sub_devices; d++)
+    {
+        sub_queues[d] = clCreateCommandQueue(cxGPUContext, sub_devices[d], 0, &ciErrNum);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+
+    ciErrNum = clGetDeviceInfo(device_used, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc_bytes), &max_alloc_bytes, NULL);
     shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    shrLog("Largest buffer: %llu MB\n", (unsigned long long) (max_alloc_bytes >> 20));
 
     // Program Setup
     size_t program_length;
+    cPathAndName = shrFindFilePath("grid_layout.h", argv[0]);
+    shrCheckErrorEX(cPathAndName != NULL, shrTRUE, pCleanup);
+    cGridLayoutCL = oclLoadProgSource(cPathAndName, "", &program_length);
+    shrCheckErrorEX(cGridLayoutCL != NULL, shrTRUE, pCleanup);
+    free(cPathAndName);
+
     cPathAndName = shrFindFilePath("simpleGL.cl", argv[0]);
     shrCheckErrorEX(cPathAndName != NULL, shrTRUE, pCleanup);
     cSourceCL = oclLoadProgSource(cPathAndName, "", &program_length);
     shrCheckErrorEX(cSourceCL != NULL, shrTRUE, pCleanup);
 
-    // create the program
-    cpProgram = clCreateProgramWithSource(cxGPUContext, 1,
-					  (const char **) &cSourceCL, &program_length, &ciErrNum);
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    // the world comes first, its constants specialise the program
+    init_matrix();
+    init_world();
+    map_obstacles_to_matrix();
+    check_kernel_constants();
+
+    // create and build the program for the selected grid layout
+    shrLog("Grid layout %d\n", grid_layout);
+    cpProgram = createSimulationProgram(grid_layout);
+
+    init_primitives(cxGPUContext, device_used, cqCommandQueue, argv[0]);
+    init_worksizes(device_used, cqCommandQueue, !shrCheckCmdLineFlag(argc, (const char**) argv, "retune"));
 
-    // build the program
-    ciErrNum = clBuildProgram(cpProgram, 0, NULL, "-cl-fast-relaxed-math", NULL, NULL);
-    if (ciErrNum != CL_SUCCESS)
+    // If specified, time and check the parallel primitives and the grid layouts, then leave
+    if(shrCheckCmdLineFlag(argc, (const char**) argv, "benchmark"))
     {
-        // write out standard error, Build Log and PTX, then cleanup and exit
-        shrLogEx(LOGBOTH | ERRORMSG, ciErrNum, STDERROR);
-        oclLogBuildInfo(cpProgram, oclGetFirstDev(cxGPUContext));
-        oclLogPtx(cpProgram, oclGetFirstDev(cxGPUContext), "oclSimpleGL.ptx");
-        Cleanup(EXIT_FAILURE);
+        benchmark_primitives();
+        benchmark_grid_layouts();
+        Cleanup(EXIT_SUCCESS);
     }
 
     /*
      *   END OF INITIAL SETUP
      */
 
-    init_matrix();
-    init_world();
-    map_obstacles_to_matrix();
-    map_points_to_neighbours();
-
     /**
      *  KERNELS & VBOs CREATION
      */
     ckKernel_labirinth = clCreateKernel(cpProgram, "labirinth", &ciErrNum);
     shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    ckKernel_activate_deactivate_obstacle_attraction = clCreateKernel(cpProgram, "activate_deactivate_obstacle_attraction", &ciErrNum);
+    ckKernel_orca_velocities = clCreateKernel(cpProgram, "orca_velocities", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_splat_crowd = clCreateKernel(cpProgram, "splat_crowd", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_resolve_crowd_splat = clCreateKernel(cpProgram, "resolve_crowd_splat", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_crowd_speed = clCreateKernel(cpProgram, "crowd_speed", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_eikonal_sweep = clCreateKernel(cpProgram, "eikonal_sweep", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_continuum_velocities = clCreateKernel(cpProgram, "continuum_velocities", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_update_lod = clCreateKernel(cpProgram, "update_lod", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_tile_activity = clCreateKernel(cpProgram, "tile_activity", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_classify_tiles = clCreateKernel(cpProgram, "classify_tiles", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_schedule_agents = clCreateKernel(cpProgram, "schedule_agents", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_agent_types = clCreateKernel(cpProgram, "agent_types", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_agent_work = clCreateKernel(cpProgram, "agent_work", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_work_cuts = clCreateKernel(cpProgram, "work_cuts", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_domain_outbox = clCreateKernel(cpProgram, "domain_outbox", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_domain_inbox = clCreateKernel(cpProgram, "domain_inbox", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_domain_flag_agents = clCreateKernel(cpProgram, "domain_flag_agents", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_domain_row_load = clCreateKernel(cpProgram, "domain_row_load", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_apply_obstacle_commands = clCreateKernel(cpProgram, "apply_obstacle_commands", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_count_segment_spans = clCreateKernel(cpProgram, "count_segment_spans", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_rasterise_segments = clCreateKernel(cpProgram, "rasterise_segments", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_clear_dirty_rectangles = clCreateKernel(cpProgram, "clear_dirty_rectangles", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_jfa_init = clCreateKernel(cpProgram, "jfa_init", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_jfa_step = clCreateKernel(cpProgram, "jfa_step", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_jfa_distance = clCreateKernel(cpProgram, "jfa_distance", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_flag_active_agents = clCreateKernel(cpProgram, "flag_active_agents", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_morton_keys = clCreateKernel(cpProgram, "morton_keys", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_count_cell_agents = clCreateKernel(cpProgram, "count_cell_agents", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_fill_cell_agents = clCreateKernel(cpProgram, "fill_cell_agents", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_count_neighbours = clCreateKernel(cpProgram, "count_neighbours", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_fill_neighbours = clCreateKernel(cpProgram, "fill_neighbours", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_neighbour_displacement = clCreateKernel(cpProgram, "neighbour_displacement", &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_gather_agents = clCreateKernel(cpProgram, "gather_agents", &ciErrNum);
     shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 //    ckKernel_neighbours = clCreateKernel(cpProgram, "neighbours", &ciErrNum);
 //    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
@@ -479,16 +1070,23 @@ int main(int argc, char** argv)
     createVBOMatrix(&vbo_matrix);
     createVBOMatrixX(&vbo_matrix_x);
     createVBOMatrixY(&vbo_matrix_y);
-    createVBONeighboursX(&vbo_neighbours_x);
-    createVBONeighboursY(&vbo_neighbours_y);
     createVBOPointsPosition(&vbo_points_positon);
     createVBOPointsColor(&vbo_points_color);
     createVBOObstaclePositions(&vbo_obstacle_positions);
     createVBOObstacleColors(&vbo_obstacle_colors);
     createVBOPointsTarget(&vbo_points_target);
-    createVBOLookaheadX(&vbo_lookahead_x);
-    createVBOLookaheadY(&vbo_lookahead_y);
-    createVBOActivated(&vbo_activated);
+    createObstacleTableBuffers();
+    createDistanceFieldBuffers();
+    createActiveAgentsBuffers();
+    createVelocityBuffers();
+    createContinuumBuffers();
+    createLevelOfDetailBuffers();
+    createMultirateBuffers();
+    createAgentTypeBuffers();
+    createDomainBuffers();
+    createMortonBuffers();
+    createNeighbourListBuffers();
+    createLoadBalanceBuffers();
 //    createVBOStartIndexTObstacle(&vbo_start_index_y_obstacle);
 //    createVBOEndIndexTObstacle(&vbo_end_index_y_obstacle);
 
@@ -505,18 +1103,195 @@ int main(int argc, char** argv)
 //
     ciErrNum  = clSetKernelArg(ckKernel_labirinth, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
     ciErrNum |= clSetKernelArg(ckKernel_labirinth, 1, sizeof(cl_mem), (void *) &vbo_cl_points_target);
-    ciErrNum |= clSetKernelArg(ckKernel_labirinth, 2, sizeof(cl_mem), (void *) &vbo_cl_matrix_x);
-    ciErrNum |= clSetKernelArg(ckKernel_labirinth, 3, sizeof(cl_mem), (void *) &vbo_cl_matrix_y);
-    ciErrNum |= clSetKernelArg(ckKernel_labirinth, 4, sizeof(cl_mem), (void *) &vbo_cl_neighbours_x);
-    ciErrNum |= clSetKernelArg(ckKernel_labirinth, 5, sizeof(cl_mem), (void *) &vbo_cl_neighbours_y);
-    ciErrNum |= clSetKernelArg(ckKernel_labirinth, 6, sizeof(cl_mem), (void *) &vbo_cl_lookahead_x);
-    ciErrNum |= clSetKernelArg(ckKernel_labirinth, 7, sizeof(cl_mem), (void *) &vbo_cl_lookahead_y);
-    ciErrNum |= clSetKernelArg(ckKernel_labirinth, 8, sizeof(cl_mem), (void *) &vbo_cl_activated);
+    ciErrNum |= clSetKernelArg(ckKernel_labirinth, 2, sizeof(cl_mem), (void *) &cl_distance_field);
+    ciErrNum |= clSetKernelArg(ckKernel_labirinth, 3, sizeof(cl_mem), (void *) &cl_agent_velocity);
+    ciErrNum |= clSetKernelArg(ckKernel_labirinth, 4, sizeof(cl_mem), (void *) &cl_new_velocity);
+    ciErrNum |= clSetKernelArg(ckKernel_labirinth, 7, sizeof(cl_mem), (void *) &cl_step_multiplier);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum  = clSetKernelArg(ckKernel_orca_velocities, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_orca_velocities, 1, sizeof(cl_mem), (void *) &vbo_cl_points_target);
+    ciErrNum |= clSetKernelArg(ckKernel_orca_velocities, 2, sizeof(cl_mem), (void *) &cl_distance_field);
+    ciErrNum |= clSetKernelArg(ckKernel_orca_velocities, 3, sizeof(cl_mem), (void *) &cl_obstacle_range);
+    ciErrNum |= clSetKernelArg(ckKernel_orca_velocities, 4, sizeof(cl_mem), (void *) &cl_obstacle_activation);
+    ciErrNum |= clSetKernelArg(ckKernel_orca_velocities, 5, sizeof(cl_mem), (void *) &cl_neighbour_offsets);
+    ciErrNum |= clSetKernelArg(ckKernel_orca_velocities, 6, sizeof(cl_mem), (void *) &cl_neighbour_list);
+    ciErrNum |= clSetKernelArg(ckKernel_orca_velocities, 7, sizeof(cl_mem), (void *) &cl_agent_velocity);
+    ciErrNum |= clSetKernelArg(ckKernel_orca_velocities, 8, sizeof(cl_mem), (void *) &cl_new_velocity);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum  = clSetKernelArg(ckKernel_splat_crowd, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_splat_crowd, 1, sizeof(cl_mem), (void *) &cl_agent_velocity);
+    ciErrNum |= clSetKernelArg(ckKernel_splat_crowd, 2, sizeof(int), &no_points);
+    ciErrNum |= clSetKernelArg(ckKernel_splat_crowd, 3, sizeof(cl_mem), (void *) &cl_crowd_splat);
+    ciErrNum |= clSetKernelArg(ckKernel_resolve_crowd_splat, 0, sizeof(cl_mem), (void *) &cl_crowd_splat);
+    ciErrNum |= clSetKernelArg(ckKernel_resolve_crowd_splat, 1, sizeof(cl_mem), (void *) &cl_crowd_density);
+    ciErrNum |= clSetKernelArg(ckKernel_crowd_speed, 0, sizeof(cl_mem), (void *) &cl_crowd_density);
+    ciErrNum |= clSetKernelArg(ckKernel_crowd_speed, 1, sizeof(cl_mem), (void *) &cl_obstacle_id);
+    ciErrNum |= clSetKernelArg(ckKernel_crowd_speed, 2, sizeof(cl_mem), (void *) &cl_crowd_speed);
+    ciErrNum |= clSetKernelArg(ckKernel_eikonal_sweep, 2, sizeof(cl_mem), (void *) &cl_crowd_speed);
+    ciErrNum |= clSetKernelArg(ckKernel_eikonal_sweep, 3, sizeof(cl_mem), (void *) &cl_goal_group);
+    ciErrNum |= clSetKernelArg(ckKernel_eikonal_sweep, 4, sizeof(cl_mem), (void *) &cl_obstacle_id);
+    ciErrNum |= clSetKernelArg(ckKernel_eikonal_sweep, 5, sizeof(int), &no_goal_groups);
+    ciErrNum |= clSetKernelArg(ckKernel_continuum_velocities, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_continuum_velocities, 1, sizeof(cl_mem), (void *) &vbo_cl_points_target);
+    ciErrNum |= clSetKernelArg(ckKernel_continuum_velocities, 3, sizeof(cl_mem), (void *) &cl_crowd_speed);
+    ciErrNum |= clSetKernelArg(ckKernel_continuum_velocities, 4, sizeof(cl_mem), (void *) &cl_goal_group);
+    ciErrNum |= clSetKernelArg(ckKernel_continuum_velocities, 5, sizeof(cl_mem), (void *) &cl_new_velocity);
+    ciErrNum |= clSetKernelArg(ckKernel_update_lod, 0, sizeof(cl_mem), (void *) &cl_crowd_density);
+    ciErrNum |= clSetKernelArg(ckKernel_update_lod, 1, sizeof(cl_mem), (void *) &cl_lod_focus);
+    ciErrNum |= clSetKernelArg(ckKernel_update_lod, 2, sizeof(cl_mem), (void *) &cl_lod);
+    ciErrNum |= clSetKernelArg(ckKernel_update_lod, 3, sizeof(cl_mem), (void *) &cl_lod_changed);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum  = clSetKernelArg(ckKernel_tile_activity, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_tile_activity, 1, sizeof(cl_mem), (void *) &cl_agent_velocity);
+    ciErrNum |= clSetKernelArg(ckKernel_tile_activity, 2, sizeof(int), &no_points);
+    ciErrNum |= clSetKernelArg(ckKernel_tile_activity, 3, sizeof(cl_mem), (void *) &cl_tile_stats);
+    ciErrNum |= clSetKernelArg(ckKernel_classify_tiles, 0, sizeof(cl_mem), (void *) &cl_tile_stats);
+    ciErrNum |= clSetKernelArg(ckKernel_classify_tiles, 1, sizeof(cl_mem), (void *) &cl_tile_hold);
+    ciErrNum |= clSetKernelArg(ckKernel_classify_tiles, 2, sizeof(cl_mem), (void *) &cl_tile_interval);
+    ciErrNum |= clSetKernelArg(ckKernel_schedule_agents, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_schedule_agents, 1, sizeof(cl_mem), (void *) &vbo_cl_points_target);
+    ciErrNum |= clSetKernelArg(ckKernel_schedule_agents, 2, sizeof(cl_mem), (void *) &cl_distance_field);
+    ciErrNum |= clSetKernelArg(ckKernel_schedule_agents, 3, sizeof(cl_mem), (void *) &cl_tile_interval);
+    ciErrNum |= clSetKernelArg(ckKernel_schedule_agents, 7, sizeof(cl_mem), (void *) &cl_step_multiplier);
+    ciErrNum |= clSetKernelArg(ckKernel_schedule_agents, 8, sizeof(cl_mem), (void *) &cl_neighbour_offsets);
+    ciErrNum |= clSetKernelArg(ckKernel_schedule_agents, 9, sizeof(cl_mem), (void *) &cl_neighbour_list);
+    ciErrNum |= clSetKernelArg(ckKernel_schedule_agents, 11, sizeof(cl_mem), (void *) &cl_last_step);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum  = clSetKernelArg(ckKernel_agent_types, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_agent_types, 1, sizeof(cl_mem), (void *) &vbo_cl_points_target);
+    ciErrNum |= clSetKernelArg(ckKernel_agent_types, 4, sizeof(cl_mem), (void *) &cl_lod);
+    ciErrNum |= clSetKernelArg(ckKernel_agent_types, 5, sizeof(cl_mem), (void *) &cl_step_multiplier);
+    ciErrNum |= clSetKernelArg(ckKernel_agent_types, 6, sizeof(cl_mem), (void *) &cl_type_keys);
+    ciErrNum |= clSetKernelArg(ckKernel_agent_types, 7, sizeof(cl_mem), (void *) &cl_bucket_agents);
+    ciErrNum |= clSetKernelArg(ckKernel_agent_types, 8, sizeof(cl_mem), (void *) &cl_type_counts);
     shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-    ciErrNum  = clSetKernelArg(ckKernel_activate_deactivate_obstacle_attraction, 3, sizeof(cl_mem), (void *) &vbo_cl_activated);
+    ciErrNum  = clSetKernelArg(ckKernel_agent_work, 2, sizeof(cl_mem), (void *) &cl_neighbour_offsets);
+    ciErrNum |= clSetKernelArg(ckKernel_agent_work, 4, sizeof(cl_mem), (void *) &cl_agent_work);
+    ciErrNum |= clSetKernelArg(ckKernel_work_cuts, 0, sizeof(cl_mem), (void *) &cl_agent_work);
+    ciErrNum |= clSetKernelArg(ckKernel_work_cuts, 3, sizeof(cl_mem), (void *) &cl_work_cuts);
     shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
+    set_crowd_model(crowd_model);
+
+    ciErrNum  = clSetKernelArg(ckKernel_jfa_init, 0, sizeof(cl_mem), (void *) &cl_obstacle_id);
+    ciErrNum |= clSetKernelArg(ckKernel_jfa_init, 1, sizeof(cl_mem), (void *) &cl_jfa_seeds[0]);
+    ciErrNum |= clSetKernelArg(ckKernel_jfa_distance, 1, sizeof(cl_mem), (void *) &cl_obstacle_id);
+    ciErrNum |= clSetKernelArg(ckKernel_jfa_distance, 2, sizeof(cl_mem), (void *) &cl_distance_field);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum  = clSetKernelArg(ckKernel_apply_obstacle_commands, 2, sizeof(cl_mem), (void *) &cl_obstacle_activation);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum  = clSetKernelArg(ckKernel_count_segment_spans, 2, sizeof(cl_mem), (void *) &cl_segment_span_offsets);
+    ciErrNum |= clSetKernelArg(ckKernel_rasterise_segments, 2, sizeof(cl_mem), (void *) &cl_segment_span_offsets);
+    ciErrNum |= clSetKernelArg(ckKernel_rasterise_segments, 4, sizeof(cl_mem), (void *) &vbo_cl_matrix_x);
+    ciErrNum |= clSetKernelArg(ckKernel_rasterise_segments, 5, sizeof(cl_mem), (void *) &vbo_cl_matrix_y);
+    ciErrNum |= clSetKernelArg(ckKernel_rasterise_segments, 6, sizeof(cl_mem), (void *) &cl_obstacle_id);
+    ciErrNum |= clSetKernelArg(ckKernel_clear_dirty_rectangles, 3, sizeof(cl_mem), (void *) &vbo_cl_matrix_x);
+    ciErrNum |= clSetKernelArg(ckKernel_clear_dirty_rectangles, 4, sizeof(cl_mem), (void *) &vbo_cl_matrix_y);
+    ciErrNum |= clSetKernelArg(ckKernel_clear_dirty_rectangles, 5, sizeof(cl_mem), (void *) &cl_obstacle_id);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum  = clSetKernelArg(ckKernel_flag_active_agents, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_flag_active_agents, 1, sizeof(cl_mem), (void *) &vbo_cl_points_target);
+    ciErrNum |= clSetKernelArg(ckKernel_flag_active_agents, 4, sizeof(cl_mem), (void *) &cl_active_flags);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum  = clSetKernelArg(ckKernel_count_cell_agents, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_count_cell_agents, 1, sizeof(int), &no_points);
+    ciErrNum |= clSetKernelArg(ckKernel_count_cell_agents, 2, sizeof(cl_mem), (void *) &cl_cell_counts);
+    ciErrNum |= clSetKernelArg(ckKernel_count_cell_agents, 3, sizeof(cl_mem), (void *) &cl_agent_rank);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_cell_agents, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_cell_agents, 1, sizeof(int), &no_points);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_cell_agents, 2, sizeof(cl_mem), (void *) &cl_cell_counts);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_cell_agents, 3, sizeof(cl_mem), (void *) &cl_agent_rank);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_cell_agents, 4, sizeof(cl_mem), (void *) &cl_cell_start);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_cell_agents, 5, sizeof(cl_mem), (void *) &cl_cell_agents);
+    ciErrNum |= clSetKernelArg(ckKernel_count_neighbours, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_count_neighbours, 1, sizeof(int), &no_points);
+    ciErrNum |= clSetKernelArg(ckKernel_count_neighbours, 2, sizeof(cl_mem), (void *) &cl_cell_start);
+    ciErrNum |= clSetKernelArg(ckKernel_count_neighbours, 3, sizeof(cl_mem), (void *) &cl_cell_agents);
+    ciErrNum |= clSetKernelArg(ckKernel_count_neighbours, 4, sizeof(cl_mem), (void *) &cl_neighbour_offsets);
+    ciErrNum |= clSetKernelArg(ckKernel_count_neighbours, 5, sizeof(cl_mem), (void *) &cl_lod);
+    ciErrNum |= clSetKernelArg(ckKernel_count_neighbours, 6, sizeof(cl_mem), (void *) &cl_neighbour_total);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_neighbours, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_neighbours, 1, sizeof(int), &no_points);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_neighbours, 2, sizeof(cl_mem), (void *) &cl_cell_start);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_neighbours, 3, sizeof(cl_mem), (void *) &cl_cell_agents);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_neighbours, 4, sizeof(cl_mem), (void *) &cl_neighbour_offsets);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_neighbours, 5, sizeof(cl_mem), (void *) &cl_neighbour_list);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_neighbours, 6, sizeof(cl_mem), (void *) &cl_position_at_build);
+    ciErrNum |= clSetKernelArg(ckKernel_fill_neighbours, 7, sizeof(cl_mem), (void *) &cl_lod);
+    ciErrNum |= clSetKernelArg(ckKernel_neighbour_displacement, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_neighbour_displacement, 1, sizeof(cl_mem), (void *) &cl_position_at_build);
+    ciErrNum |= clSetKernelArg(ckKernel_neighbour_displacement, 2, sizeof(int), &no_points);
+    ciErrNum |= clSetKernelArg(ckKernel_neighbour_displacement, 3, sizeof(cl_mem), (void *) &cl_displacement);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum  = clSetKernelArg(ckKernel_morton_keys, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_morton_keys, 1, sizeof(cl_mem), (void *) &cl_morton_keys);
+    ciErrNum |= clSetKernelArg(ckKernel_morton_keys, 2, sizeof(cl_mem), (void *) &cl_morton_order);
+    ciErrNum |= clSetKernelArg(ckKernel_morton_keys, 3, sizeof(int), &no_points);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum  = clSetKernelArg(ckKernel_gather_agents, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 1, sizeof(cl_mem), (void *) &vbo_cl_points_target);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 2, sizeof(cl_mem), (void *) &vbo_cl_points_color);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 4, sizeof(cl_mem), (void *) &cl_morton_order);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 5, sizeof(int), &no_points);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 6, sizeof(cl_mem), (void *) &cl_sorted_position);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 7, sizeof(cl_mem), (void *) &cl_sorted_target);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 8, sizeof(cl_mem), (void *) &cl_sorted_color);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 10, sizeof(cl_mem), (void *) &cl_active_flags);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 12, sizeof(cl_mem), (void *) &cl_agent_velocity);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 13, sizeof(cl_mem), (void *) &cl_sorted_velocity);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 14, sizeof(cl_mem), (void *) &cl_last_step);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 15, sizeof(cl_mem), (void *) &cl_sorted_last_step);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    if (no_ranks > 1)
+    {
+        int halo_rows = DOMAIN_HALO_ROWS;
+        int outbox_capacity = DOMAIN_RECORDS_PER_AGENT * no_points;
+
+        ciErrNum  = clSetKernelArg(ckKernel_domain_outbox, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_outbox, 1, sizeof(cl_mem), (void *) &cl_agent_velocity);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_outbox, 2, sizeof(cl_mem), (void *) &cl_agent_domain);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_outbox, 3, sizeof(int), &no_points);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_outbox, 4, sizeof(cl_mem), (void *) &cl_domain_rows);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_outbox, 5, sizeof(int), &no_ranks);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_outbox, 6, sizeof(int), &domain_rank);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_outbox, 7, sizeof(int), &halo_rows);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_outbox, 8, sizeof(cl_mem), (void *) &cl_outbox_count);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_outbox, 9, sizeof(cl_mem), (void *) &cl_outbox_info);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_outbox, 10, sizeof(cl_mem), (void *) &cl_outbox_state);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_outbox, 11, sizeof(int), &outbox_capacity);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_inbox, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_inbox, 1, sizeof(cl_mem), (void *) &cl_agent_velocity);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_inbox, 2, sizeof(cl_mem), (void *) &cl_agent_domain);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_inbox, 3, sizeof(cl_mem), (void *) &cl_inbox_info);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_inbox, 4, sizeof(cl_mem), (void *) &cl_inbox_state);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_inbox, 6, sizeof(int), &domain_rank);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_flag_agents, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_flag_agents, 1, sizeof(cl_mem), (void *) &vbo_cl_points_target);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_flag_agents, 2, sizeof(cl_mem), (void *) &cl_agent_domain);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_flag_agents, 3, sizeof(int), &no_points);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_flag_agents, 4, sizeof(int), &domain_rank);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_flag_agents, 5, sizeof(cl_mem), (void *) &cl_active_flags);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_row_load, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_row_load, 3, sizeof(cl_mem), (void *) &cl_row_load);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_row_load, 4, sizeof(cl_mem), (void *) &cl_neighbour_offsets);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        // every slot started out active, only the owned ones stay on this rank's list
+        rebuild_active_agents();
+    }
+
 //    ciErrNum  = clSetKernelArg(ckKernel_neighbours, 0, sizeof(cl_mem), (void *) &vbo_cl_points_position);
 //    ciErrNum |= clSetKernelArg(ckKernel_neighbours, 1, sizeof(cl_mem), (void *) &vbo_cl_points_target);
 //    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
@@ -564,6 +1339,32 @@ int main(int argc, char** argv)
     {
         glutMainLoop();
     }
+    else
+    {
+        struct timeval begin, end;
+
+        gettimeofday(&begin, NULL);
+        for (int frame = 0; frame < no_gl_frames; frame++)
+        {
+            runKernel();
+        }
+        gettimeofday(&end, NULL);
+
+        double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_usec - begin.tv_usec) * 1e-6;
+        shrLog("%d frames, %.3f ms per frame, active agents %d, neighbour rebuilds %d\n",
+               no_gl_frames, 1000.0 * seconds / std::max(no_gl_frames, 1), no_active, neighbour_rebuilds);
+
+        if (no_ranks > 1)
+        {
+            std::vector<int> totals(2);
+            totals[0] = no_active;
+            totals[1] = domain_handoffs;
+            domain_sum(totals);
+
+            shrLog("rank %d of %d, rows %d..%d, active agents over all ranks %d, agents handed over %d\n",
+                   domain_rank, no_ranks, domain_rows[domain_rank], domain_rows[domain_rank + 1], totals[0], totals[1]);
+        }
+    }
 
     // Normally unused return path
     Cleanup(EXIT_SUCCESS);
@@ -614,26 +1415,19 @@ void runKernel()
     ciErrNum = CL_SUCCESS;
 
 #ifdef GL_INTEROP
-    // map OpenGL buffer object for writing from OpenCL
-    glFinish();
-    ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_points_position, 0, 0, 0 );
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_points_target, 0, 0, 0 );
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_matrix_x, 0, 0, 0 );
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_matrix_y, 0, 0, 0 );
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_neighbours_x, 0, 0, 0 );
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_neighbours_y, 0, 0, 0 );
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_lookahead_x, 0, 0, 0 );
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_lookahead_y, 0, 0, 0 );
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_activated, 0, 0, 0 );
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    // map OpenGL buffer object for writing from OpenCL, without GL they are plain buffers
+    if (!bQATest)
+    {
+        glFinish();
+        ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_points_position, 0, 0, 0 );
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+        ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_points_target, 0, 0, 0 );
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+        ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_matrix_x, 0, 0, 0 );
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+        ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_matrix_y, 0, 0, 0 );
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
 //    ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_start_index_y_obstacle, 0, 0, 0 );
 //    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 //    ciErrNum  = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_end_index_y_obstacle, 0, 0, 0 );
@@ -658,18 +1452,89 @@ void runKernel()
 //        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 //    }
 #endif
-    size_t szGlobalWorkSize[] = {(size_t) no_points, 1};
-    size_t szGlobalWorkSizeObstacle[] = {(size_t) no_points_obstacle, 1};
 
-    ciErrNum  = clSetKernelArg(ckKernel_activate_deactivate_obstacle_attraction, 0, sizeof(int), &start_index_y);
-    ciErrNum |= clSetKernelArg(ckKernel_activate_deactivate_obstacle_attraction, 1, sizeof(int), &end_start);
-    ciErrNum |= clSetKernelArg(ckKernel_activate_deactivate_obstacle_attraction, 2, sizeof(int), &value);
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    if (!obstacles_rasterised)
+    {
+        rasterise_obstacles();
+    }
+    else if (!moving_obstacles.empty())
+    {
+        move_obstacles();
+    }
 
-    ciErrNum = clEnqueueNDRangeKernel(cqCommandQueue, ckKernel_activate_deactivate_obstacle_attraction, 1, NULL, szGlobalWorkSizeObstacle, NULL, 0, 0, 0 );
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    ciErrNum = clEnqueueNDRangeKernel(cqCommandQueue, ckKernel_labirinth, 1, NULL, szGlobalWorkSize, NULL, 0, 0, 0 );
-    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    if (!obstacle_commands.empty())
+    {
+        apply_obstacle_commands();
+    }
+
+    if (!distance_field_valid)
+    {
+        build_distance_field();
+    }
+
+    if (telemetry && telemetry_frame++ % TELEMETRY_INTERVAL == 0)
+    {
+        log_work_telemetry();
+    }
+
+    // every rank takes part in the exchange, whether it has agents left to step or not
+    if (no_ranks > 1)
+    {
+        exchange_halos();
+
+        if (++domain_frame % DOMAIN_REPARTITION_INTERVAL == 0)
+        {
+            repartition_domains();
+        }
+    }
+
+    // finished agents are frozen, only the active list is stepped
+    if (no_active > 0)
+    {
+        if (crowd_model != CROWD_ORCA)
+        {
+            update_crowd_fields();
+        }
+        if (crowd_model == CROWD_HYBRID)
+        {
+            update_level_of_detail();
+        }
+        if (crowd_model != CROWD_CONTINUUM)
+        {
+            update_neighbour_lists();
+        }
+        if (no_sub_devices > 1 || telemetry)
+        {
+            balance_work_shares();
+        }
+        schedule_agents();
+
+        // every new velocity is solved from the old positions before any agent moves,
+        // each kernel only takes the agents of its own bucket
+        bucket_agent_types();
+        solve_velocities();
+
+        ciErrNum  = clSetKernelArg(ckKernel_labirinth, 5, sizeof(cl_mem), (void *) &cl_active_agents[current_active_list]);
+        ciErrNum |= clSetKernelArg(ckKernel_labirinth, 6, sizeof(int), &no_active);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        enqueue_agent_kernel(ckKernel_labirinth, no_active, work_shares_valid ? work_cuts : NULL);
+
+        // the reorder rebuilds the active list as well; with several ranks a slot is the
+        // same agent on every rank, so the slots stay where they are
+        if (no_ranks == 1 && ++frames_since_reorder == MORTON_REORDER_INTERVAL)
+        {
+            reorder_agents_morton();
+            frames_since_reorder = 0;
+            neighbour_lists_valid = false;
+            frames_since_compaction = 0;
+        }
+        else if (++frames_since_compaction == ACTIVE_COMPACTION_INTERVAL)
+        {
+            compact_active_agents();
+            frames_since_compaction = 0;
+        }
+    }
 //    ciErrNum = clEnqueueNDRangeKernel(cqCommandQueue, ckKernel_neighbours, 1, NULL, szGlobalWorkSize, NULL, 0, 0, 0 );
 //    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 //    ciErrNum = clEnqueueNDRangeKernel(cqCommandQueue, ckKernel_compute_velocity, 1, NULL, szGlobalWorkSize, NULL, 0, 0, 0 );
@@ -683,15 +1548,13 @@ void runKernel()
 //    }
 #ifdef GL_INTEROP
     // unmap buffer object
-    ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_points_position, 0, 0, 0 );
-    ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_points_target, 0, 0, 0 );
-    ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_matrix_x, 0, 0, 0 );
-    ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_matrix_y, 0, 0, 0 );
-    ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_neighbours_x, 0, 0, 0 );
-    ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_neighbours_y, 0, 0, 0 );
-    ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_lookahead_x, 0, 0, 0 );
-    ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_lookahead_y, 0, 0, 0 );
-    ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_activated, 0, 0, 0 );
+    if (!bQATest)
+    {
+        ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_points_position, 0, 0, 0 );
+        ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_points_target, 0, 0, 0 );
+        ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_matrix_x, 0, 0, 0 );
+        ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_matrix_y, 0, 0, 0 );
+    }
 //    ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_start_index_y_obstacle, 0, 0, 0 );
 //    ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_end_index_y_obstacle, 0, 0, 0 );
 //    ciErrNum  = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_positions, 0, 0, 0 );
@@ -723,173 +1586,272 @@ void runKernel()
 #endif
 }
 
-int value_0 = 0;
-int value_1 = 0;
-int value_2 = 0;
-int value_3 = 0;
-int value_4 = 0;
-int value_5 = 0;
-int value_6 = 0;
-int value_7 = 0;
-int value_8 = 0;
-int value_9 = 0;
-int value_10 = 0;
-int value_11 = 0;
-int value_12 = 0;
-int value_13 = 0;
-
 /**
- *  KEYBOARD CONTROL
+ *  COMPACT ACTIVE AGENTS
+ *  drops the agents that reached their target from the active list
  */
-void KeyboardGL(unsigned char key, int x, int y)
+void compact_active_agents()
 {
-    switch(key)
-    {
-         case 033: // octal equivalent of the Escape key
-            glutLeaveMainLoop();
-            break;
-        case '0':
-            {
-                no_points_obstacle = end_index_y_obstacle[0] - start_index_y_obstacle[0] + 1;
-                start_index_y = start_index_y_obstacle[0];
-                end_start = 0;
-                value_0 = 1 - value_0;
+    ciErrNum  = clSetKernelArg(ckKernel_flag_active_agents, 2, sizeof(cl_mem), (void *) &cl_active_agents[current_active_list]);
+    ciErrNum |= clSetKernelArg(ckKernel_flag_active_agents, 3, sizeof(int), &no_active);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-                value = value_0;
-            }
-            break;
-        case '1':
-            {
-                no_points_obstacle = end_index_y_obstacle[0] - start_index_y_obstacle[0] + 1;
-                start_index_y = start_index_y_obstacle[0];
-                end_start = 1;
-                value_1 = (1- value_1);
+    ciErrNum = worksize_enqueue(ckKernel_flag_active_agents, no_active);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-                value = value_1;
-            }
-            break;
-        case '2':
-            {
-                no_points_obstacle = end_index_y_obstacle[1] - start_index_y_obstacle[1] + 1;
-                start_index_y = start_index_y_obstacle[1];
-                end_start = 0;
-                value_2 = (1- value_2);
+    primitives_compact(cl_active_flags, cl_active_agents[current_active_list], no_active,
+                       cl_active_agents[1 - current_active_list], cl_no_active);
 
-                value = value_2;
-            }
-            break;
-        case '3':
-            {
-                no_points_obstacle = end_index_y_obstacle[1] - start_index_y_obstacle[1] + 1;
-                start_index_y = start_index_y_obstacle[1];
-                end_start = 1;
-                value_3 = (1- value_3);
+    ciErrNum = clEnqueueReadBuffer(cqCommandQueue, cl_no_active, CL_TRUE, 0, sizeof(int), &no_active, 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-                value = value_3;
-            }
-            break;
-        case '4':
-            {
-                no_points_obstacle = end_index_y_obstacle[2] - start_index_y_obstacle[2] + 1;
-                start_index_y = start_index_y_obstacle[2];
-                end_start = 0;
-                value_4 = (1- value_4);
+    current_active_list = 1 - current_active_list;
+    work_shares_valid = false;
+}
 
-                value = value_4;
-            }
-            break;
-        case '5':
-            {
-                no_points_obstacle = end_index_y_obstacle[2] - start_index_y_obstacle[2] + 1;
-                start_index_y = start_index_y_obstacle[2];
-                end_start = 1;
-                value_5 = (1- value_5);
+/**
+ *  REORDER AGENTS ALONG THE MORTON CURVE
+ *  sorts the agent slots by the Z-order of their cell, the active list is rebuilt
+ *  from the sorted slots since the old one holds stale indices
+ */
+void reorder_agents_morton()
+{
+#ifdef GL_INTEROP
+    if (!bQATest)
+    {
+        ciErrNum = clEnqueueAcquireGLObjects(cqCommandQueue, 1, &vbo_cl_points_color, 0, 0, 0 );
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+#endif
 
-                value = value_5;
-            }
-            break;
-        case '6':
-            {
-                no_points_obstacle = end_index_y_obstacle[3] - start_index_y_obstacle[3] + 1;
-                start_index_y = start_index_y_obstacle[3];
-                end_start = 0;
-                value_6 = (1- value_6);
+    ciErrNum = worksize_enqueue(ckKernel_morton_keys, no_points);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-                value = value_6;
-            }
-            break;
-        case '7':
-            {
-                no_points_obstacle = end_index_y_obstacle[3] - start_index_y_obstacle[3] + 1;
-                start_index_y = start_index_y_obstacle[3];
-                end_start = 1;
-                value_7 = (1- value_7);
+    primitives_radix_sort(cl_morton_keys, cl_morton_order, no_points, MORTON_KEY_BITS);
 
-                value = value_7;
-            }
-            break;
-        case '8':
-            {
-                no_points_obstacle = end_index_y_obstacle[4] - start_index_y_obstacle[4] + 1;
-                start_index_y = start_index_y_obstacle[4];
-                end_start = 0;
-                value_8 = (1- value_8);
+    ciErrNum  = clSetKernelArg(ckKernel_gather_agents, 3, sizeof(cl_mem), (void *) &cl_agent_ids[current_agent_ids]);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 9, sizeof(cl_mem), (void *) &cl_agent_ids[1 - current_agent_ids]);
+    ciErrNum |= clSetKernelArg(ckKernel_gather_agents, 11, sizeof(cl_mem), (void *) &cl_active_agents[1 - current_active_list]);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-                value = value_8;
-            }
-            break;
-        case '9':
-            {
-                no_points_obstacle = end_index_y_obstacle[4] - start_index_y_obstacle[4] + 1;
-                start_index_y = start_index_y_obstacle[4];
-                end_start = 1;
-                value_9 = (1- value_9);
+    ciErrNum = worksize_enqueue(ckKernel_gather_agents, no_points);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-                value = value_9;
-            }
-            break;
-         case 100: // octal code for d
-            {
-                no_points_obstacle = end_index_y_obstacle[5] - start_index_y_obstacle[5] + 1;
-                start_index_y = start_index_y_obstacle[5];
-                end_start = 0;
-                value_10 = (1- value_10);
+    // the GL buffers keep their handles, the sorted copies go back into them
+    ciErrNum  = clEnqueueCopyBuffer(cqCommandQueue, cl_sorted_position, vbo_cl_points_position, 0, 0, no_points * position_bytes, 0, NULL, NULL);
+    ciErrNum |= clEnqueueCopyBuffer(cqCommandQueue, cl_sorted_target, vbo_cl_points_target, 0, 0, no_points * sizeof(GLuint), 0, NULL, NULL);
+    ciErrNum |= clEnqueueCopyBuffer(cqCommandQueue, cl_sorted_color, vbo_cl_points_color, 0, 0, (size_t) no_points * 4 * sizeof(GLubyte), 0, NULL, NULL);
+    ciErrNum |= clEnqueueCopyBuffer(cqCommandQueue, cl_sorted_velocity, cl_agent_velocity, 0, 0, (size_t) no_points * 2 * sizeof(GLfloat), 0, NULL, NULL);
+    ciErrNum |= clEnqueueCopyBuffer(cqCommandQueue, cl_sorted_last_step, cl_last_step, 0, 0, (size_t) no_points * sizeof(GLint), 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-                value = value_10;
-            }
-            break;
-         case 119: // octal code for w
-            {
-                no_points_obstacle = end_index_y_obstacle[5] - start_index_y_obstacle[5] + 1;
-                start_index_y = start_index_y_obstacle[5];
-                end_start = 1;
-                value_11 = (1- value_11);
+    primitives_compact(cl_active_flags, cl_active_agents[1 - current_active_list], no_points,
+                       cl_active_agents[current_active_list], cl_no_active);
 
-                value = value_11;
-            }
-            break;
-         case 101: // octal code for e
-            {
-                no_points_obstacle = end_index_y_obstacle[6] - start_index_y_obstacle[6] + 1;
-                start_index_y = start_index_y_obstacle[6];
-                end_start = 0;
-                value_12 = (1- value_12);
+    ciErrNum = clEnqueueReadBuffer(cqCommandQueue, cl_no_active, CL_TRUE, 0, sizeof(int), &no_active, 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-                value = value_12;
-            }
+#ifdef GL_INTEROP
+    if (!bQATest)
+    {
+        ciErrNum = clEnqueueReleaseGLObjects(cqCommandQueue, 1, &vbo_cl_points_color, 0, 0, 0 );
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+#endif
+
+    current_agent_ids = 1 - current_agent_ids;
+    work_shares_valid = false;
+}
+
+/**
+ *  BUILD NEIGHBOUR LISTS
+ *  count-then-fill twice: agents per cell, then neighbours per agent; the list
+ *  buffer is grown whenever the crowd has more interactions than it can hold
+ */
+void build_neighbour_lists()
+{
+    ciErrNum = worksize_enqueue(ckKernel_count_cell_agents, no_points);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    primitives_exclusive_scan(cl_cell_counts, cl_cell_start, grid_size() + 1);
+
+    // the scanned total wraps past 2^32, the count kernel sums the counts in 64 bits as well
+    static const cl_uint zero_total[2] = {0, 0};
+    cl_uint total[2];
+
+    ciErrNum  = clEnqueueWriteBuffer(cqCommandQueue, cl_neighbour_total, CL_FALSE, 0, sizeof(zero_total), zero_total, 0, NULL, NULL);
+    ciErrNum |= worksize_enqueue(ckKernel_fill_cell_agents, no_points);
+    ciErrNum |= worksize_enqueue(ckKernel_count_neighbours, no_points);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    primitives_exclusive_scan(cl_neighbour_offsets, cl_neighbour_offsets, no_points + 1);
+
+    ciErrNum = clEnqueueReadBuffer(cqCommandQueue, cl_neighbour_total, CL_TRUE, 0, sizeof(total), total, 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    unsigned long long no_neighbours = ((unsigned long long) total[1] << 32) | total[0];
+    if (no_neighbours > INT_MAX)
+    {
+        shrLog("The neighbour lists need %llu entries, their offsets hold at most %d\n", no_neighbours, INT_MAX);
+        Cleanup(EXIT_FAILURE);
+    }
+    neighbour_list_entries = (int) no_neighbours;
+
+    if ((int) no_neighbours > neighbour_list_capacity)
+    {
+        clReleaseMemObject(cl_neighbour_list);
+
+        // doubling stops at the largest buffer, a list that needs more leaves in device_bytes()
+        size_t capacity = std::max((size_t) no_neighbours, 2 * (size_t) neighbour_list_capacity);
+        capacity = std::min(capacity, std::max((size_t) (max_alloc_bytes / sizeof(GLint)), (size_t) no_neighbours));
+        neighbour_list_capacity = (int) std::min(capacity, (size_t) INT_MAX);
+        cl_neighbour_list = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, device_bytes(neighbour_list_capacity, sizeof(GLint)), NULL, &ciErrNum);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        ciErrNum  = clSetKernelArg(ckKernel_fill_neighbours, 5, sizeof(cl_mem), (void *) &cl_neighbour_list);
+        ciErrNum |= clSetKernelArg(ckKernel_orca_velocities, 6, sizeof(cl_mem), (void *) &cl_neighbour_list);
+        ciErrNum |= clSetKernelArg(ckKernel_schedule_agents, 9, sizeof(cl_mem), (void *) &cl_neighbour_list);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+
+    ciErrNum = worksize_enqueue(ckKernel_fill_neighbours, no_points);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    neighbour_lists_valid = true;
+    neighbour_rebuilds++;
+    work_shares_valid = false;
+}
+
+/**
+ *  UPDATE NEIGHBOUR LISTS
+ *  the lists hold every agent that can get adjacent before someone moves half the
+ *  skin, the device reduces the largest move and the lists are rebuilt past it; the
+ *  move is read without a stall and looked at on the next frame, one step later
+ */
+void update_neighbour_lists()
+{
+    if (displacement_read)
+    {
+        ciErrNum = clWaitForEvents(1, &displacement_read);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+        clReleaseEvent(displacement_read);
+        displacement_read = NULL;
+
+        if (max_displacement_read > 0.5f * NEIGHBOUR_SKIN - neighbour_step_margin)
+        {
+            neighbour_lists_valid = false;
+        }
+    }
+
+    if (!neighbour_lists_valid)
+    {
+        build_neighbour_lists();
+    }
+
+    ciErrNum = worksize_enqueue(ckKernel_neighbour_displacement, no_points);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    primitives_reduce(cl_displacement, no_points, cl_max_displacement, REDUCE_MAX);
+
+    ciErrNum = clEnqueueReadBuffer(cqCommandQueue, cl_max_displacement, CL_FALSE, 0, sizeof(float), &max_displacement_read, 0, NULL, &displacement_read);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+/**
+ *  OBSTACLE COMMANDS
+ *  a command pending for the same obstacle end only has its value replaced
+ */
+void queue_obstacle_command(int obstacle, int end_start, int value)
+{
+    for (unsigned int i = 0; i < obstacle_commands.size(); i++)
+    {
+        cl_int4& command = obstacle_commands[i];
+
+        if (command.s[0] == obstacle && command.s[1] == end_start)
+        {
+            command.s[2] = value;
+            return;
+        }
+    }
+
+    cl_int4 command;
+    command.s[0] = obstacle;
+    command.s[1] = end_start;
+    command.s[2] = value;
+    command.s[3] = 0;
+
+    obstacle_commands.push_back(command);
+}
+
+/* the host copy of the activation table mirrors the device one once the commands are applied */
+void toggle_obstacle_attraction(int obstacle, int end_start)
+{
+    if (obstacle < 0 || obstacle >= no_obstacles / 2)
+    {
+        return;
+    }
+
+    int id = obstacle + 1;
+    int& value = obstacle_activation[2 * id + end_start];
+    value = 1 - value;
+
+    queue_obstacle_command(id, end_start, value);
+}
+
+void apply_obstacle_commands()
+{
+    int no_commands = obstacle_commands.size();
+
+    if (no_commands > obstacle_command_capacity)
+    {
+        if(cl_obstacle_commands)clReleaseMemObject(cl_obstacle_commands);
+
+        obstacle_command_capacity = std::max(no_commands, 2 * obstacle_command_capacity);
+        cl_obstacle_commands = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, obstacle_command_capacity * sizeof(cl_int4), NULL, &ciErrNum);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        ciErrNum  = clSetKernelArg(ckKernel_apply_obstacle_commands, 0, sizeof(cl_mem), (void *) &cl_obstacle_commands);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+
+    ciErrNum  = clEnqueueWriteBuffer(cqCommandQueue, cl_obstacle_commands, CL_TRUE, 0, no_commands * sizeof(cl_int4), &obstacle_commands[0], 0, NULL, NULL);
+    ciErrNum |= clSetKernelArg(ckKernel_apply_obstacle_commands, 1, sizeof(int), &no_commands);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum = worksize_enqueue(ckKernel_apply_obstacle_commands, no_commands);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    obstacle_commands.clear();
+}
+
+/**
+ *  KEYBOARD CONTROL
+ */
+#define OBSTACLE_KEYS   "0123456789dwertyuiopasfghjklzxcvbnm"
+
+void KeyboardGL(unsigned char key, int x, int y)
+{
+    switch(key)
+    {
+         case 033: // octal equivalent of the Escape key
+            glutLeaveMainLoop();
             break;
-         case 114: // octal code for r
+        case ' ':
+            set_crowd_model((crowd_model + 1) % 3);
+            break;
+        default:
             {
-                no_points_obstacle = end_index_y_obstacle[6] - start_index_y_obstacle[6] + 1;
-                start_index_y = start_index_y_obstacle[6];
-                end_start = 1;
-                value_13 = (1- value_13);
+                // two keys per obstacle, one per end: 0/1 for obstacle 0, 2/3 for obstacle 1, ...
+                const char* key_position = key != 0 ? strchr(OBSTACLE_KEYS, key) : NULL;
 
-                value = value_13;
+                if (key_position != NULL)
+                {
+                    int key_index = key_position - OBSTACLE_KEYS;
+
+                    toggle_obstacle_attraction(key_index / 2, key_index % 2);
+                }
             }
             break;
-        default:
-            break;
     }
 }
 
@@ -912,174 +1874,1627 @@ void DisplayGL()
 
     glEnableClientState(GL_VERTEX_ARRAY);
     glBindBuffer(GL_ARRAY_BUFFER, vbo_points_positon);
+    glVertexPointer(2, fixed_positions ? GL_SHORT : GL_FLOAT, 0, 0);
+
+    glEnableClientState(GL_COLOR_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_points_color);
+    glColorPointer(4, GL_UNSIGNED_BYTE, 0, 0);
+
+    // grid_unfix() as a transform, the shorts are drawn as they are
+    glPushMatrix();
+    if (fixed_positions)
+    {
+        glTranslatef(-.005f, -.005f, 0.0f);
+        glScalef(1.0f / (100 * GRID_FIXED_ONE), 1.0f / (100 * GRID_FIXED_ONE), 1.0f);
+    }
+
+    glPointSize(3*MIN_POINT_SIZE);
+    glDrawArrays(GL_POINTS, 0, no_points);
+    glPopMatrix();
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_obstacle_positions);
     glVertexPointer(2, GL_FLOAT, 0, 0);
 
-    glEnableClientState(GL_COLOR_ARRAY);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo_points_color);
-    glColorPointer(4, GL_FLOAT, 0, 0);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_obstacle_colors);
+    glColorPointer(4, GL_FLOAT, 0, 0);
+
+    glLineWidth(MIN_POINT_SIZE);
+    glDrawArrays(GL_LINES, 0, no_obstacles);
+
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+
+    // flip backbuffer to screen
+    glutSwapBuffers();
+
+    gettimeofday(&stop, NULL);
+
+    time_sum += stop.tv_usec - start.tv_usec;
+
+    if (time_increment == 100)
+    {
+        printf("took %lu, active agents %d, neighbour rebuilds %d\n", time_sum / 100, no_active, neighbour_rebuilds);
+        time_increment = 0;
+        time_sum  = 0;
+        neighbour_rebuilds = 0;
+    }
+}
+
+/**
+ *  NUMA SUB-DEVICES
+ *  one sub-device per NUMA node of a CPU device, when it has more than one node and
+ *  the implementation can split it; false leaves the whole device in use, and always
+ *  does against pre-1.2 headers, where the single-device paths are the only ones
+ */
+bool split_by_numa(cl_device_id device)
+{
+#ifdef CL_VERSION_1_2
+    cl_device_type type = 0;
+    cl_device_affinity_domain domains = 0;
+    cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+    cl_uint count = 0;
+
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    if (!(type & CL_DEVICE_TYPE_CPU))
+    {
+        return false;
+    }
+
+    clGetDeviceInfo(device, CL_DEVICE_PARTITION_AFFINITY_DOMAIN, sizeof(domains), &domains, NULL);
+    if (!(domains & CL_DEVICE_AFFINITY_DOMAIN_NUMA)
+     || clCreateSubDevices(device, properties, 0, NULL, &count) != CL_SUCCESS || count < 2 || count > MAX_SUB_DEVICES)
+    {
+        shrLog("CPU device not split by NUMA node\n\n");
+        return false;
+    }
+
+    ciErrNum = clCreateSubDevices(device, properties, count, sub_devices, &no_sub_devices);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    shrLog("CPU device split into %u NUMA sub-devices\n\n", no_sub_devices);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ *  BALANCE WORK SHARES
+ *  costs of a list of agents, scanned, and one binary search per cut; only the
+ *  no_shares + 1 cuts come back to the host. The active list is cut once per list,
+ *  the micro bucket every frame it is launched over the sub-devices
+ */
+void cut_work_shares(cl_mem agents, int no_agents, cl_int2* cuts)
+{
+    int no_shares = std::max((int) no_sub_devices, 1);
+
+    // the costs are scanned in 32 bits, agents plus their pairs past INT_MAX are cut by agents only
+    int use_neighbours = (crowd_model != CROWD_CONTINUUM) && neighbour_lists_valid
+                      && (long long) no_agents + neighbour_list_entries <= INT_MAX;
+
+    ciErrNum  = clSetKernelArg(ckKernel_agent_work, 0, sizeof(cl_mem), (void *) &agents);
+    ciErrNum |= clSetKernelArg(ckKernel_agent_work, 1, sizeof(int), &no_agents);
+    ciErrNum |= clSetKernelArg(ckKernel_agent_work, 3, sizeof(int), &use_neighbours);
+    ciErrNum |= clSetKernelArg(ckKernel_work_cuts, 1, sizeof(int), &no_agents);
+    ciErrNum |= clSetKernelArg(ckKernel_work_cuts, 2, sizeof(int), &no_shares);
+    ciErrNum |= worksize_enqueue(ckKernel_agent_work, no_agents + 1);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    primitives_exclusive_scan(cl_agent_work, cl_agent_work, no_agents + 1);
+
+    ciErrNum  = worksize_enqueue(ckKernel_work_cuts, no_shares + 1);
+    ciErrNum |= clEnqueueReadBuffer(cqCommandQueue, cl_work_cuts, CL_TRUE, 0, (no_shares + 1) * sizeof(cl_int2), cuts, 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+void balance_work_shares()
+{
+    if (work_shares_valid)
+    {
+        return;
+    }
+
+    cut_work_shares(cl_active_agents[current_active_list], no_active, work_cuts);
+    work_shares_valid = true;
+}
+
+/**
+ *  WORK TELEMETRY
+ *  agents and neighbour pairs per share of this rank, the largest share over the
+ *  mean; with several ranks rank 0 also logs the ranks against each other
+ */
+void log_work_telemetry()
+{
+    int no_shares = std::max((int) no_sub_devices, 1);
+    long long total = 0, largest = 0;
+
+    if (no_active > 0)
+    {
+        balance_work_shares();
+    }
+
+    for (int d = 0; d < no_shares && no_active > 0; d++)
+    {
+        int agents = work_cuts[d + 1].s[0] - work_cuts[d].s[0];
+        int work = work_cuts[d + 1].s[1] - work_cuts[d].s[1];
+
+        shrLog("  frame %d, share %d: %d agents, %d neighbour pairs\n", telemetry_frame, d, agents, work - agents);
+
+        total += work;
+        largest = std::max(largest, (long long) work);
+    }
+    shrLog("  frame %d: imbalance over %d shares %.2f\n", telemetry_frame, no_shares,
+           (total > 0) ? (double) largest * no_shares / total : 1.0);
+    shrLog("  frame %d: buckets of the last step %d micro, %d macro, %d idle\n", telemetry_frame,
+           type_counts[AGENT_TYPE_MICRO], type_counts[AGENT_TYPE_MACRO], type_counts[AGENT_TYPE_IDLE]);
+
+    if (no_ranks > 1)
+    {
+        // two slots per rank, zero on the others, so the sum lines them up
+        std::vector<int> per_rank(2 * no_ranks, 0);
+        per_rank[2 * domain_rank]     = no_active;
+        per_rank[2 * domain_rank + 1] = (no_active > 0) ? work_cuts[no_shares].s[1] - no_active : 0;
+        domain_sum(per_rank);
+
+        for (int r = 0; r < no_ranks && domain_rank == 0; r++)
+        {
+            shrLog("  frame %d, rank %d (rows %d..%d): %d agents, %d neighbour pairs\n", telemetry_frame, r,
+                   domain_rows[r], domain_rows[r + 1], per_rank[2 * r], per_rank[2 * r + 1]);
+        }
+    }
+}
+
+/**
+ *  PER-AGENT LAUNCH
+ *  a kernel over no_agents active agents, every sub-device takes a contiguous share
+ *  through the global offset, cut by work where cut_work_shares() gave cuts for this
+ *  list and evenly otherwise; the shares wait for everything enqueued before
+ *  them and the main queue waits for all shares, so the queue order is kept. A share
+ *  keeps the driver's local size, padding it would run into the next share, and is
+ *  launched in chunks like any other long range.
+ */
+void enqueue_agent_kernel(cl_kernel kernel, int no_agents, const cl_int2* cuts)
+{
+    if (no_sub_devices < 2)
+    {
+        ciErrNum = worksize_enqueue(kernel, no_agents);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+        return;
+    }
+
+#ifdef CL_VERSION_1_2
+    cl_event ready;
+    cl_event done[MAX_SUB_DEVICES];
+
+    ciErrNum = clEnqueueMarkerWithWaitList(cqCommandQueue, 0, NULL, &ready);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    bool by_work = cuts && cuts[no_sub_devices].s[0] == no_agents;
+
+    for (cl_uint d = 0; d < no_sub_devices; d++)
+    {
+        size_t begin = by_work ? (size_t) cuts[d].s[0] : (size_t) no_agents * d / no_sub_devices;
+        size_t end   = by_work ? (size_t) cuts[d + 1].s[0] : (size_t) no_agents * (d + 1) / no_sub_devices;
+
+        if (end > begin)
+        {
+            ciErrNum = worksize_enqueue_range(sub_queues[d], kernel, begin, end, &ready, &done[d]);
+        }
+        else
+        {
+            ciErrNum = clEnqueueMarkerWithWaitList(sub_queues[d], 1, &ready, &done[d]);
+        }
+        ciErrNum |= clFlush(sub_queues[d]);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+
+    ciErrNum = clEnqueueBarrierWithWaitList(cqCommandQueue, no_sub_devices, done, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    clReleaseEvent(ready);
+    for (cl_uint d = 0; d < no_sub_devices; d++)
+    {
+        clReleaseEvent(done[d]);
+    }
+#endif
+}
+
+/**
+ *  AGENT BUFFERS
+ *  bytes_per_agent for every agent, filled from data when given; split by NUMA node,
+ *  every share is first touched by the queue of the sub-device that steps it, so its
+ *  pages stay on that node's memory
+ */
+cl_mem create_agent_buffer(cl_mem_flags flags, size_t bytes_per_agent, const void* data)
+{
+    size_t size = agent_bytes(bytes_per_agent);
+
+#ifdef CL_VERSION_1_2
+    if (no_sub_devices >= 2)
+    {
+        cl_mem buffer = clCreateBuffer(cxGPUContext, flags | CL_MEM_ALLOC_HOST_PTR, size, NULL, &ciErrNum);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        cl_uchar zero = 0;
+        for (cl_uint d = 0; d < no_sub_devices; d++)
+        {
+            size_t begin = (size_t) no_points * d / no_sub_devices * bytes_per_agent;
+            size_t end   = (size_t) no_points * (d + 1) / no_sub_devices * bytes_per_agent;
+
+            if (end > begin)
+            {
+                ciErrNum = clEnqueueFillBuffer(sub_queues[d], buffer, &zero, sizeof(zero), begin, end - begin, 0, NULL, NULL);
+                if (data)
+                {
+                    ciErrNum |= clEnqueueWriteBuffer(sub_queues[d], buffer, CL_FALSE, begin, end - begin, (const char*) data + begin, 0, NULL, NULL);
+                }
+                shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+            }
+        }
+        for (cl_uint d = 0; d < no_sub_devices; d++)
+        {
+            clFinish(sub_queues[d]);
+        }
+
+        return buffer;
+    }
+#endif
+
+    return clCreateBuffer(cxGPUContext, flags | (data ? CL_MEM_COPY_HOST_PTR : 0), size, (void*) data, &ciErrNum);
+}
+
+/**
+ *  BUFFER SIZES
+ *  bytes of no_items items, the run ends here when one buffer of them would pass the
+ *  device's largest allocation
+ */
+size_t device_bytes(size_t no_items, size_t bytes_per_item)
+{
+    size_t size = no_items * bytes_per_item;
+
+    if (max_alloc_bytes > 0 && size > max_alloc_bytes)
+    {
+        shrLog("A buffer of %llu items of %u bytes passes the largest allocation of the device, it holds %llu of them\n",
+               (unsigned long long) no_items, (unsigned int) bytes_per_item, (unsigned long long) (max_alloc_bytes / bytes_per_item));
+        Cleanup(EXIT_FAILURE);
+    }
+
+    return size;
+}
+
+size_t agent_bytes(size_t bytes_per_agent)
+{
+    return device_bytes(no_points, bytes_per_agent);
+}
+
+/**
+ *  KERNEL CONSTANTS
+ *  only the constants simpleGL.cl guards can be set, with a plain number as value
+ */
+void add_kernel_constant(const std::string& line)
+{
+    const char* specialised[] = {"GRAVITATIONAL_FORCE", "ATTRACTION_FORCE", "ARRIVAL_DISTANCE", "LIMIT_PROXIMITY",
+                                 "WALL_RANGE", "WALL_REPULSION", "LOD_SPARSE_DENSITY", "LOD_DENSE_DENSITY",
+                                 "ORCA_MAX_NEIGHBOURS", "ORCA_RADIUS", "ORCA_TIME_HORIZON", "ORCA_MAX_SPEED",
+                                 "CONTINUUM_MIN_DENSITY", "CONTINUUM_MAX_DENSITY", "CONTINUUM_MAX_SPEED", "CONTINUUM_MIN_SPEED",
+                                 "CONTINUUM_PATH_WEIGHT", "CONTINUUM_TIME_WEIGHT", "ACTIVITY_BUSY_AGENTS", "ACTIVITY_BUSY_VARIANCE"};
+    char *pointer;
+    char *line_char = strdup(line.c_str());
+
+    strtok_r(line_char, "| ", &pointer);
+    char *name = strtok_r(NULL, "| ", &pointer);
+    char *value = strtok_r(NULL, "| ", &pointer);
+
+    char *number_end = value;
+    if (value != NULL)
+    {
+        strtod(value, &number_end);
+    }
+
+    bool known = false;
+    for (size_t c = 0; name != NULL && c < sizeof(specialised) / sizeof(specialised[0]); c++)
+    {
+        known = known || strcmp(name, specialised[c]) == 0;
+    }
+
+    if (!known || number_end == value || (*number_end != '\0' && strcmp(number_end, "f") != 0))
+    {
+        shrLog("world.ads: '%s' ignored, not a kernel constant with a number\n", line.c_str());
+        free(line_char);
+        return;
+    }
+
+    for (size_t c = 0; c < kernel_constants.size(); c++)
+    {
+        if (kernel_constants[c].first == name)
+        {
+            kernel_constants.erase(kernel_constants.begin() + c);
+            break;
+        }
+    }
+    kernel_constants.push_back(std::make_pair(std::string(name), std::string(value)));
+    shrLog("Kernel constant %s = %s\n", name, value);
+
+    free(line_char);
+}
+
+double kernel_constant(const char* name, double default_value)
+{
+    for (size_t c = 0; c < kernel_constants.size(); c++)
+    {
+        if (kernel_constants[c].first == name)
+        {
+            return atof(kernel_constants[c].second.c_str());
+        }
+    }
+
+    return default_value;
+}
+
+/* the host margins that follow from kernel constants, with the defaults of simpleGL.cl */
+void check_kernel_constants()
+{
+    activity_hold_margin = (int) (kernel_constant("WALL_RANGE", 0.03) * 100 + .999);
+    neighbour_step_margin = (float) kernel_constant("ORCA_MAX_SPEED", 0.0015);
+
+    // a ghost must be visible as far as the neighbour search reaches plus the longest multirate step
+    int search_cells = (int) ((kernel_constant("LIMIT_PROXIMITY", 0.02) + NEIGHBOUR_SKIN) * 100 + .999);
+    int step_cells = (int) (ACTIVITY_WINDOW * kernel_constant("ORCA_MAX_SPEED", 0.0015) * 100 + .999);
+    if (no_ranks > 1 && search_cells + step_cells > DOMAIN_HALO_ROWS)
+    {
+        shrLog("The kernel constants need %d halo rows, domains have %d\n", search_cells + step_cells, DOMAIN_HALO_ROWS);
+        Cleanup(EXIT_FAILURE);
+    }
+}
+
+/* FNV-1a of everything the binary depends on; empty when the context holds several devices */
+std::string variant_file_name(const std::string& options)
+{
+    if (no_sub_devices > 1)
+    {
+        return "";
+    }
+
+    char device_name[256] = "", driver_version[256] = "";
+    clGetDeviceInfo(device_used, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    clGetDeviceInfo(device_used, CL_DRIVER_VERSION, sizeof(driver_version), driver_version, NULL);
+
+    std::string key = std::string(device_name) + "\n" + driver_version + "\n" + options + "\n" + cGridLayoutCL + cSourceCL;
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t c = 0; c < key.size(); c++)
+    {
+        hash = (hash ^ (unsigned char) key[c]) * 1099511628211ULL;
+    }
+
+    char file_name[64];
+    sprintf(file_name, VARIANT_FILE_PREFIX "%016llx.bin", hash);
+
+    return file_name;
+}
+
+/* the variant from its binary on disk, NULL when there is none or the device refuses it */
+cl_program load_program_variant(const std::string& options, const std::string& file_name)
+{
+    std::ifstream file(file_name.c_str(), std::ios::binary);
+    if (file_name.empty() || !file.is_open())
+    {
+        return NULL;
+    }
+
+    std::vector<unsigned char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (binary.empty())
+    {
+        return NULL;
+    }
+
+    const unsigned char* binaries[] = {&binary[0]};
+    size_t lengths[] = {binary.size()};
+    cl_int binary_status;
+
+    cl_program program = clCreateProgramWithBinary(cxGPUContext, 1, &device_used, lengths, binaries, &binary_status, &ciErrNum);
+    if (ciErrNum != CL_SUCCESS || binary_status != CL_SUCCESS)
+    {
+        if (program)
+        {
+            clReleaseProgram(program);
+        }
+        return NULL;
+    }
+
+    if (clBuildProgram(program, 0, NULL, options.c_str(), NULL, NULL) != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    shrLog("Program variant loaded from %s\n", file_name.c_str());
+    return program;
+}
+
+void save_program_variant(cl_program program, const std::string& file_name)
+{
+    size_t size = 0;
+    if (file_name.empty() || clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0)
+    {
+        return;
+    }
+
+    std::vector<unsigned char> binary(size);
+    unsigned char* binaries[] = {&binary[0]};
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) != CL_SUCCESS)
+    {
+        return;
+    }
+
+    // written aside and renamed, ranks sharing a node may build the same variant
+    char temporary[128];
+    sprintf(temporary, "%s.%d", file_name.c_str(), (int) getpid());
+
+    std::ofstream file(temporary, std::ios::binary);
+    file.write((const char*) &binary[0], size);
+    file.close();
+
+    rename(temporary, file_name.c_str());
+}
+
+/**
+ *  CREATE SIMULATION PROGRAM
+ *  grid_layout.h followed by simpleGL.cl, built for the given grid layout
+ */
+cl_program createSimulationProgram(int layout)
+{
+    const char* sources[] = {cGridLayoutCL, cSourceCL};
+    size_t lengths[] = {strlen(cGridLayoutCL), strlen(cSourceCL)};
+
+    char options[160];
+    sprintf(options, "-cl-fast-relaxed-math -D GRID_LAYOUT=%d -D NEIGHBOUR_SKIN=%ff%s", layout, NEIGHBOUR_SKIN,
+            fixed_positions ? " -D FIXED_POSITIONS" : "");
+
+    std::string variant = options;
+    for (size_t c = 0; c < kernel_constants.size(); c++)
+    {
+        variant += " -D " + kernel_constants[c].first + "=" + kernel_constants[c].second;
+    }
+
+    // the cache keeps a reference of its own, every caller releases the one it got
+    std::map<std::string, cl_program>::iterator built = program_variants.find(variant);
+    if (built != program_variants.end())
+    {
+        clRetainProgram(built->second);
+        return built->second;
+    }
+
+    std::string file_name = variant_file_name(variant);
+    cl_program program = load_program_variant(variant, file_name);
+
+    if (program == NULL)
+    {
+        // create the program
+        program = clCreateProgramWithSource(cxGPUContext, 2, sources, lengths, &ciErrNum);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        // build the program
+        ciErrNum = clBuildProgram(program, 0, NULL, variant.c_str(), NULL, NULL);
+        if (ciErrNum != CL_SUCCESS)
+        {
+            // write out standard error, Build Log and PTX, then cleanup and exit
+            shrLogEx(LOGBOTH | ERRORMSG, ciErrNum, STDERROR);
+            oclLogBuildInfo(program, oclGetFirstDev(cxGPUContext));
+            oclLogPtx(program, oclGetFirstDev(cxGPUContext), "oclSimpleGL.ptx");
+            Cleanup(EXIT_FAILURE);
+        }
+
+        save_program_variant(program, file_name);
+    }
+
+    program_variants[variant] = program;
+    clRetainProgram(program);
+
+    return program;
+}
+
+/**
+ *  GRID LAYOUT BENCHMARK
+ *  times the 3x3 stencil of labirinth in every layout, over cells in random order
+ *  and over the same cells in Z-order, the agent order after a Morton reorder
+ */
+#define GRID_BENCHMARK_CELLS        (1 << 20)
+#define GRID_BENCHMARK_REPETITIONS  20
+
+void benchmark_grid_layouts()
+{
+    const char* layout_names[] = {"row-major", "tiled 8x8", "morton"};
+    struct timeval begin, end;
+
+    std::vector<cl_int> occupied(GRID_CELLS);
+    std::vector<cl_int> cells(2 * GRID_BENCHMARK_CELLS);
+    std::vector<cl_int> reference(GRID_BENCHMARK_CELLS);
+    std::vector<cl_int> sums(GRID_BENCHMARK_CELLS);
+
+    srand(GRID_CELLS);
+    for (int i = 0; i < GRID_CELLS; i++)
+    {
+        occupied[i] = rand() & 1;
+    }
+    for (int i = 0; i < GRID_BENCHMARK_CELLS; i++)
+    {
+        cells[2 * i]     = 1 + rand() % (GRID_SIDE - 2);
+        cells[2 * i + 1] = 1 + rand() % (GRID_SIDE - 2);
+    }
+
+    cl_mem cl_cells = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, cells.size() * sizeof(cl_int), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_mem cl_sums = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, sums.size() * sizeof(cl_int), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    shrLog("\nGrid layouts, 3x3 stencil over %d cells, %d repetitions\n", GRID_BENCHMARK_CELLS, GRID_BENCHMARK_REPETITIONS);
+
+    for (int order = 0; order < 2; order++)
+    {
+        if (order == 1)
+        {
+            std::vector<std::pair<int, int> > keys(GRID_BENCHMARK_CELLS);
+            for (int i = 0; i < GRID_BENCHMARK_CELLS; i++)
+            {
+                keys[i] = std::make_pair(grid_index_in(GRID_LAYOUT_MORTON, cells[2 * i], cells[2 * i + 1]), i);
+            }
+            std::sort(keys.begin(), keys.end());
+
+            std::vector<cl_int> sorted(cells.size());
+            for (int i = 0; i < GRID_BENCHMARK_CELLS; i++)
+            {
+                sorted[2 * i]     = cells[2 * keys[i].second];
+                sorted[2 * i + 1] = cells[2 * keys[i].second + 1];
+            }
+            cells.swap(sorted);
+        }
+
+        tasks_for(0, GRID_BENCHMARK_CELLS, HOST_GRAIN_ITEMS, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; i++)
+            {
+                reference[i] = 0;
+                for (int dy = -1; dy <= 1; dy++)
+                {
+                    for (int dx = -1; dx <= 1; dx++)
+                    {
+                        reference[i] += occupied[GRID_SIDE * (cells[2 * i + 1] + dy) + cells[2 * i] + dx] << ((dy + 1) * 3 + dx + 1);
+                    }
+                }
+            }
+        });
+
+        ciErrNum = clEnqueueWriteBuffer(cqCommandQueue, cl_cells, CL_TRUE, 0, cells.size() * sizeof(cl_int), &cells[0], 0, NULL, NULL);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        for (int layout = GRID_LAYOUT_ROW_MAJOR; layout <= GRID_LAYOUT_MORTON; layout++)
+        {
+            std::vector<cl_int> grid(grid_size_in(layout), 0);
+            tasks_for(0, GRID_SIDE, HOST_GRAIN_ROWS, [&](int begin, int end)
+            {
+                for (int y = begin; y < end; y++)
+                {
+                    for (int x = 0; x < GRID_SIDE; x++)
+                    {
+                        grid[grid_index_in(layout, x, y)] = occupied[GRID_SIDE * y + x];
+                    }
+                }
+            });
+
+            cl_program program = createSimulationProgram(layout);
+            cl_kernel kernel = clCreateKernel(program, "grid_stencil", &ciErrNum);
+            shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+            cl_mem cl_grid = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, grid.size() * sizeof(cl_int), &grid[0], &ciErrNum);
+            shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+            int no_cells = GRID_BENCHMARK_CELLS;
+            size_t szGlobalWorkSize[] = {GRID_BENCHMARK_CELLS, 1};
+
+            ciErrNum  = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *) &cl_grid);
+            ciErrNum |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *) &cl_cells);
+            ciErrNum |= clSetKernelArg(kernel, 2, sizeof(int), &no_cells);
+            ciErrNum |= clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *) &cl_sums);
+            ciErrNum |= clEnqueueNDRangeKernel(cqCommandQueue, kernel, 1, NULL, szGlobalWorkSize, NULL, 0, 0, 0 );
+            ciErrNum |= clFinish(cqCommandQueue);
+            shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+            gettimeofday(&begin, NULL);
+            for (int r = 0; r < GRID_BENCHMARK_REPETITIONS; r++)
+            {
+                clEnqueueNDRangeKernel(cqCommandQueue, kernel, 1, NULL, szGlobalWorkSize, NULL, 0, 0, 0 );
+            }
+            clFinish(cqCommandQueue);
+            gettimeofday(&end, NULL);
+
+            ciErrNum = clEnqueueReadBuffer(cqCommandQueue, cl_sums, CL_TRUE, 0, sums.size() * sizeof(cl_int), &sums[0], 0, NULL, NULL);
+            shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+            double ms = ((end.tv_sec - begin.tv_sec) * 1000.0 + (end.tv_usec - begin.tv_usec) / 1000.0) / GRID_BENCHMARK_REPETITIONS;
+            shrLog("%-10s %-8s cells : %8.3f ms  %s\n", layout_names[layout], order ? "z-order" : "random", ms,
+                   (sums == reference) ? "PASSED" : "FAILED");
+
+            clReleaseMemObject(cl_grid);
+            clReleaseKernel(kernel);
+            clReleaseProgram(program);
+        }
+    }
+
+    clReleaseMemObject(cl_cells);
+    clReleaseMemObject(cl_sums);
+}
+
+/**
+ *  INITIALIZE MATRIX
+ *  also initializes the obstacle id of every cell
+ */
+void init_matrix()
+{
+    float m_position_x = -0.96;
+    float m_position_y = -0.96;
+    float m_increment_position_x = 0.01;
+    float m_increment_position_y = 0.01;
+
+    matrix = new GLfloat [2 * matrix_size];
+    matrix_x = new GLint [grid_size()];
+    matrix_y = new GLint [grid_size()];
+
+    obstacle_id = new GLushort[grid_size()];
+
+    // the coordinates are summed up one cell after the other, as they always were,
+    // then the rows are filled as tasks
+    std::vector<float> column_x(GRID_SIDE), row_y(GRID_SIDE);
+    for (int i = 0; i < GRID_SIDE; i++)
+    {
+        column_x[i] = m_position_x;
+        row_y[i] = m_position_y;
+
+        m_position_x += m_increment_position_x;
+        m_position_y += m_increment_position_y;
+    }
+
+    tasks_for(0, GRID_SIDE, HOST_GRAIN_ROWS, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            for (int j = 0; j < GRID_SIDE; j++)
+            {
+                matrix[2 * (GRID_SIDE * i + j)]     = column_x[j];
+                matrix[2 * (GRID_SIDE * i + j) + 1] = row_y[i];
+            }
+        }
+    });
+
+    // padding slots of the tiled and Morton layouts are cleared as well
+    tasks_for(0, grid_size(), HOST_GRAIN_ITEMS, [&](int begin, int end)
+    {
+        for (int matrix_xy_index = begin; matrix_xy_index < end; matrix_xy_index++)
+        {
+            matrix_x[matrix_xy_index] = 0;
+            matrix_y[matrix_xy_index] = 0;
+            obstacle_id[matrix_xy_index] = 0;
+        }
+    });
+}
+
+/**
+ *  MAP OBSTACLES TO MATRIX
+ *  builds the obstacle table and the segments of every obstacle, the cells
+ *  themselves are marked on the device by rasterise_obstacles()
+ */
+void map_obstacles_to_matrix()
+{
+    // the ids of the cells are 16 bits
+    shrCheckErrorEX(no_obstacles / 2 < MAX_OBSTACLE_ID, shrTRUE, pCleanup);
+
+    int no_polylines = no_obstacles / 2;
+
+    obstacle_range      = new GLfloat[2 * (no_polylines + 1)];
+    obstacle_activation = new GLint[2 * (no_polylines + 1)];
+
+    obstacle_range[0]      = 0.0f;
+    obstacle_range[1]      = 0.0f;
+    obstacle_activation[0] = 0;
+    obstacle_activation[1] = 0;
+
+    // every pair of obstacle positions in world.ads is a two point polyline, so the
+    // segments of every obstacle have their slots before any of them is built
+    obstacle_segment_offsets.resize(no_polylines + 1);
+    for (int i = 0; i <= no_polylines; i++)
+    {
+        obstacle_segment_offsets[i] = i;
+    }
+    obstacle_segments.resize(obstacle_segment_offsets[no_polylines]);
+    segment_obstacle_ids.resize(obstacle_segment_offsets[no_polylines]);
+
+    tasks_for(0, no_polylines, HOST_GRAIN_OBSTACLES, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            obstacle_activation[2 * (i + 1)]     = 0;
+            obstacle_activation[2 * (i + 1) + 1] = 0;
+
+            add_obstacle_polyline(&obstacle_positions[4 * i], 2, i + 1, obstacle_segment_offsets[i]);
+        }
+    });
+
+    for (int i = 0; i < no_polylines; i++)
+    {
+        // the motion of an obstacle is the one given with its first position
+        if (obstacle_velocities[4 * i] != 0.0f || obstacle_velocities[4 * i + 1] != 0.0f || obstacle_spins[2 * i] != 0.0f)
+        {
+            cl_float2 offset = {{0.0f, 0.0f}};
+
+            moving_obstacles.push_back(i + 1);
+            moving_obstacle_offset.push_back(offset);
+            moving_obstacle_angle.push_back(0.0f);
+        }
+    }
+
+    initial_segments = obstacle_segments;
+}
+
+/**
+ *  ADD OBSTACLE POLYLINE
+ *  points holds x, y pairs, its segments go to the slots from first_segment on;
+ *  the y range of the obstacle spans all of them
+ */
+void add_obstacle_polyline(const GLfloat* points, int no_polyline_points, int id, int first_segment)
+{
+    float min_y = points[1];
+    float max_y = points[1];
+
+    for (int p = 1; p < no_polyline_points; p++)
+    {
+        cl_float4 segment;
+        segment.s[0] = points[2 * (p - 1)];
+        segment.s[1] = points[2 * (p - 1) + 1];
+        segment.s[2] = points[2 * p];
+        segment.s[3] = points[2 * p + 1];
+
+        obstacle_segments[first_segment + p - 1] = segment;
+        segment_obstacle_ids[first_segment + p - 1] = id;
+
+        min_y = std::min(min_y, points[2 * p + 1]);
+        max_y = std::max(max_y, points[2 * p + 1]);
+    }
+
+    obstacle_range[2 * id]     = min_y;
+    obstacle_range[2 * id + 1] = max_y;
+}
+
+/**
+ *  RASTERISE OBSTACLES
+ *  the whole world is rasterised once, on the first step
+ */
+void rasterise_obstacles()
+{
+    int no_segments = obstacle_segments.size();
+
+    obstacles_rasterised = true;
+
+    struct timeval begin, end;
+    gettimeofday(&begin, NULL);
+
+    rasterise_segment_list(cl_obstacle_segments, cl_segment_obstacle_ids, no_segments);
+    distance_field_valid = false;
+
+    clFinish(cqCommandQueue);
+    gettimeofday(&end, NULL);
+
+    shrLog("Rasterised %d obstacle segments in %.3f ms\n", no_segments,
+           (end.tv_sec - begin.tv_sec) * 1000.0 + (end.tv_usec - begin.tv_usec) / 1000.0);
+}
+
+/**
+ *  RASTERISE SEGMENT LIST
+ *  count the spans of every segment, scan them into offsets and mark the cells of
+ *  all spans in a single launch; the grid buffers must be acquired by the caller
+ */
+void rasterise_segment_list(cl_mem segments, cl_mem segment_ids, int no_segments)
+{
+    if (no_segments == 0)
+    {
+        return;
+    }
+
+    ciErrNum  = clSetKernelArg(ckKernel_count_segment_spans, 0, sizeof(cl_mem), (void *) &segments);
+    ciErrNum |= clSetKernelArg(ckKernel_count_segment_spans, 1, sizeof(int), &no_segments);
+    ciErrNum |= clSetKernelArg(ckKernel_rasterise_segments, 0, sizeof(cl_mem), (void *) &segments);
+    ciErrNum |= clSetKernelArg(ckKernel_rasterise_segments, 1, sizeof(cl_mem), (void *) &segment_ids);
+    ciErrNum |= clSetKernelArg(ckKernel_rasterise_segments, 3, sizeof(int), &no_segments);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum = worksize_enqueue(ckKernel_count_segment_spans, no_segments);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    primitives_exclusive_scan(cl_segment_span_offsets, cl_segment_span_offsets, no_segments + 1);
+
+    int no_spans;
+    ciErrNum = clEnqueueReadBuffer(cqCommandQueue, cl_segment_span_offsets, CL_TRUE, no_segments * sizeof(GLint), sizeof(GLint), &no_spans, 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    if (no_spans > 0)
+    {
+        ciErrNum = worksize_enqueue(ckKernel_rasterise_segments, no_spans);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+}
+
+/* inclusive cell bounds of segments [first_segment, end_segment), clipped to the grid */
+cl_int4 segments_bounding_cells(int first_segment, int end_segment)
+{
+    cl_int4 bounds = {{GRID_SIDE - 1, GRID_SIDE - 1, 0, 0}};
+
+    for (int i = first_segment; i < end_segment; i++)
+    {
+        const cl_float4& segment = obstacle_segments[i];
+
+        bounds.s[0] = std::min(bounds.s[0], grid_cell(std::min(segment.s[0], segment.s[2])));
+        bounds.s[1] = std::min(bounds.s[1], grid_cell(std::min(segment.s[1], segment.s[3])));
+        bounds.s[2] = std::max(bounds.s[2], grid_cell(std::max(segment.s[0], segment.s[2])));
+        bounds.s[3] = std::max(bounds.s[3], grid_cell(std::max(segment.s[1], segment.s[3])));
+    }
+
+    bounds.s[0] = std::max(bounds.s[0], 0);
+    bounds.s[1] = std::max(bounds.s[1], 0);
+    bounds.s[2] = std::min(bounds.s[2], GRID_SIDE - 1);
+    bounds.s[3] = std::min(bounds.s[3], GRID_SIDE - 1);
+
+    return bounds;
+}
+
+/* the writes are queued without waiting, their host arrays stay untouched until the write of the frame before is done */
+cl_int upload_obstacle_data(cl_mem buffer, size_t size, const void* data)
+{
+    if (obstacle_upload)
+    {
+        clReleaseEvent(obstacle_upload);
+    }
+
+    return clEnqueueWriteBuffer(cqCommandQueue, buffer, CL_FALSE, 0, size, data, 0, NULL, &obstacle_upload);
+}
+
+/**
+ *  MOVE OBSTACLES
+ *  one step of every moving obstacle; a translating obstacle turns back at the
+ *  border of the world. Its uploads do not block, the next step waits for them
+ *  before it touches the host arrays again, a frame later
+ */
+void move_obstacles()
+{
+    if (obstacle_upload)
+    {
+        ciErrNum = clWaitForEvents(1, &obstacle_upload);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+
+    dirty_rectangles.clear();
+
+    for (unsigned int m = 0; m < moving_obstacles.size(); m++)
+    {
+        int id    = moving_obstacles[m];
+        int first = obstacle_segment_offsets[id - 1];
+        int end   = obstacle_segment_offsets[id];
+        int i     = id - 1;
+
+        cl_int4 old_bounds = segments_bounding_cells(first, end);
+        std::vector<cl_float4> old_segments(obstacle_segments.begin() + first, obstacle_segments.begin() + end);
+        bool inside = false;
+
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            cl_float2& offset = moving_obstacle_offset[m];
+            offset.s[0] += obstacle_velocities[4 * i];
+            offset.s[1] += obstacle_velocities[4 * i + 1];
+            moving_obstacle_angle[m] += obstacle_spins[2 * i];
+
+            float c = cos(moving_obstacle_angle[m]);
+            float s = sin(moving_obstacle_angle[m]);
+            float hinge_x = initial_segments[first].s[0];
+            float hinge_y = initial_segments[first].s[1];
+            inside = true;
+
+            for (int k = first; k < end; k++)
+            {
+                for (int e = 0; e < 4; e += 2)
+                {
+                    float x = initial_segments[k].s[e] - hinge_x;
+                    float y = initial_segments[k].s[e + 1] - hinge_y;
+
+                    obstacle_segments[k].s[e]     = hinge_x + c * x - s * y + offset.s[0];
+                    obstacle_segments[k].s[e + 1] = hinge_y + s * x + c * y + offset.s[1];
+
+                    inside = inside && fabs(obstacle_segments[k].s[e]) <= 0.96f && fabs(obstacle_segments[k].s[e + 1]) <= 0.96f;
+                }
+            }
+
+            if (inside)
+            {
+                break;
+            }
+
+            // undo the step and reverse the motion
+            offset.s[0] -= obstacle_velocities[4 * i];
+            offset.s[1] -= obstacle_velocities[4 * i + 1];
+            moving_obstacle_angle[m] -= obstacle_spins[2 * i];
+            obstacle_velocities[4 * i]     = -obstacle_velocities[4 * i];
+            obstacle_velocities[4 * i + 1] = -obstacle_velocities[4 * i + 1];
+            obstacle_spins[2 * i]          = -obstacle_spins[2 * i];
+        }
+
+        // both ways left the world, the obstacle stays where its offset and angle say
+        if (!inside)
+        {
+            std::copy(old_segments.begin(), old_segments.end(), obstacle_segments.begin() + first);
+        }
+
+        cl_int4 new_bounds = segments_bounding_cells(first, end);
+        cl_int4 dirty = {{std::min(old_bounds.s[0], new_bounds.s[0]), std::min(old_bounds.s[1], new_bounds.s[1]),
+                          std::max(old_bounds.s[2], new_bounds.s[2]), std::max(old_bounds.s[3], new_bounds.s[3])}};
+
+        dirty_rectangles.push_back(dirty);
+        hold_tiles(dirty);
+
+        float min_y = obstacle_segments[first].s[1];
+        float max_y = obstacle_segments[first].s[1];
+        for (int k = first; k < end; k++)
+        {
+            min_y = std::min(min_y, std::min(obstacle_segments[k].s[1], obstacle_segments[k].s[3]));
+            max_y = std::max(max_y, std::max(obstacle_segments[k].s[1], obstacle_segments[k].s[3]));
+        }
+        obstacle_range[2 * id]     = min_y;
+        obstacle_range[2 * id + 1] = max_y;
+    }
+
+    int no_ids = no_obstacles / 2 + 1;
+    ciErrNum = upload_obstacle_data(cl_obstacle_range, no_ids * 2 * sizeof(GLfloat), obstacle_range);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    int no_rectangles = dirty_rectangles.size();
+    if (no_rectangles == 0)
+    {
+        return;
+    }
+
+    // every segment touching a dirty rectangle, static or not, is drawn again
+    dirty_segments.clear();
+    dirty_segment_ids.clear();
+    for (int id = 1; id < no_ids; id++)
+    {
+        for (int k = obstacle_segment_offsets[id - 1]; k < obstacle_segment_offsets[id]; k++)
+        {
+            cl_int4 bounds = segments_bounding_cells(k, k + 1);
+
+            for (int r = 0; r < no_rectangles; r++)
+            {
+                const cl_int4& rectangle = dirty_rectangles[r];
+
+                if (bounds.s[0] <= rectangle.s[2] && bounds.s[2] >= rectangle.s[0] && bounds.s[1] <= rectangle.s[3] && bounds.s[3] >= rectangle.s[1])
+                {
+                    dirty_segments.push_back(obstacle_segments[k]);
+                    dirty_segment_ids.push_back(id);
+                    break;
+                }
+            }
+        }
+    }
+
+    dirty_rectangle_offsets.resize(no_rectangles + 1);
+    dirty_rectangle_offsets[0] = 0;
+    for (int r = 0; r < no_rectangles; r++)
+    {
+        const cl_int4& rectangle = dirty_rectangles[r];
+        dirty_rectangle_offsets[r + 1] = dirty_rectangle_offsets[r] + (rectangle.s[2] - rectangle.s[0] + 1) * (rectangle.s[3] - rectangle.s[1] + 1);
+    }
+
+    if (no_rectangles > dirty_rectangle_capacity)
+    {
+        if(cl_dirty_rectangles)clReleaseMemObject(cl_dirty_rectangles);
+        if(cl_dirty_rectangle_offsets)clReleaseMemObject(cl_dirty_rectangle_offsets);
+
+        dirty_rectangle_capacity = std::max(no_rectangles, 2 * dirty_rectangle_capacity);
+        cl_dirty_rectangles = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, dirty_rectangle_capacity * sizeof(cl_int4), NULL, &ciErrNum);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+        cl_dirty_rectangle_offsets = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, (dirty_rectangle_capacity + 1) * sizeof(GLint), NULL, &ciErrNum);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        ciErrNum  = clSetKernelArg(ckKernel_clear_dirty_rectangles, 0, sizeof(cl_mem), (void *) &cl_dirty_rectangles);
+        ciErrNum |= clSetKernelArg(ckKernel_clear_dirty_rectangles, 1, sizeof(cl_mem), (void *) &cl_dirty_rectangle_offsets);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+
+    int no_dirty_segments = dirty_segments.size();
+    if (no_dirty_segments > dirty_segment_capacity)
+    {
+        if(cl_dirty_segments)clReleaseMemObject(cl_dirty_segments);
+        if(cl_dirty_segment_ids)clReleaseMemObject(cl_dirty_segment_ids);
+
+        dirty_segment_capacity = std::max(no_dirty_segments, 2 * dirty_segment_capacity);
+        cl_dirty_segments = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, dirty_segment_capacity * sizeof(cl_float4), NULL, &ciErrNum);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+        cl_dirty_segment_ids = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, dirty_segment_capacity * sizeof(GLushort), NULL, &ciErrNum);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+
+    ciErrNum  = upload_obstacle_data(cl_dirty_rectangles, no_rectangles * sizeof(cl_int4), &dirty_rectangles[0]);
+    ciErrNum |= upload_obstacle_data(cl_dirty_rectangle_offsets, (no_rectangles + 1) * sizeof(GLint), &dirty_rectangle_offsets[0]);
+    ciErrNum |= clSetKernelArg(ckKernel_clear_dirty_rectangles, 2, sizeof(int), &no_rectangles);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    ciErrNum = worksize_enqueue(ckKernel_clear_dirty_rectangles, dirty_rectangle_offsets[no_rectangles]);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    if (no_dirty_segments > 0)
+    {
+        ciErrNum  = upload_obstacle_data(cl_dirty_segments, no_dirty_segments * sizeof(cl_float4), &dirty_segments[0]);
+        ciErrNum |= upload_obstacle_data(cl_dirty_segment_ids, no_dirty_segments * sizeof(GLushort), &dirty_segment_ids[0]);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        rasterise_segment_list(cl_dirty_segments, cl_dirty_segment_ids, no_dirty_segments);
+    }
+
+    distance_field_valid = false;
+}
+
+/**
+ *  BUILD DISTANCE FIELD
+ *  jump flooding from every cell with halving steps, plus one more step of 1 that
+ *  fixes the few cells plain jump flooding gets wrong
+ */
+void build_distance_field()
+{
+    int current = 0;
+
+    ciErrNum = worksize_enqueue(ckKernel_jfa_init, GRID_CELLS);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    int first_step = 1;
+    while (2 * first_step < GRID_SIDE)
+    {
+        first_step *= 2;
+    }
+
+    // first_step, first_step / 2, ..., 2, 1 and one more pass of 1
+    int no_passes = 1;
+    for (int step = first_step; step >= 1; step /= 2)
+    {
+        no_passes++;
+    }
+
+    for (int pass = 0; pass < no_passes; pass++)
+    {
+        int step = std::max(first_step >> pass, 1);
+
+        ciErrNum  = clSetKernelArg(ckKernel_jfa_step, 0, sizeof(cl_mem), (void *) &cl_jfa_seeds[current]);
+        ciErrNum |= clSetKernelArg(ckKernel_jfa_step, 1, sizeof(cl_mem), (void *) &cl_jfa_seeds[1 - current]);
+        ciErrNum |= clSetKernelArg(ckKernel_jfa_step, 2, sizeof(int), &step);
+        ciErrNum |= worksize_enqueue(ckKernel_jfa_step, GRID_CELLS);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        current = 1 - current;
+    }
+
+    ciErrNum  = clSetKernelArg(ckKernel_jfa_distance, 0, sizeof(cl_mem), (void *) &cl_jfa_seeds[current]);
+    ciErrNum |= worksize_enqueue(ckKernel_jfa_distance, GRID_CELLS);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    distance_field_valid = true;
+
+    // the walls changed under the crowd potentials as well
+    continuum_warm_up = CONTINUUM_WARM_UP_SWEEPS;
+}
+
+/**
+ *  UPDATE CROWD FIELDS
+ *  splat, per-direction speeds and the eikonal sweeps for every goal group; the
+ *  continuum_velocities launch in runKernel() reads the potentials
+ */
+void update_crowd_fields()
+{
+    ciErrNum  = worksize_enqueue(ckKernel_splat_crowd, no_points);
+    ciErrNum |= worksize_enqueue(ckKernel_resolve_crowd_splat, GRID_CELLS);
+    ciErrNum |= worksize_enqueue(ckKernel_crowd_speed, GRID_CELLS);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    int sweeps = std::max(CONTINUUM_SWEEPS_PER_FRAME, continuum_warm_up);
+    continuum_warm_up = 0;
+
+    for (int sweep = 0; sweep < sweeps; sweep++)
+    {
+        ciErrNum  = clSetKernelArg(ckKernel_eikonal_sweep, 0, sizeof(cl_mem), (void *) &cl_crowd_potential[current_potential]);
+        ciErrNum |= clSetKernelArg(ckKernel_eikonal_sweep, 1, sizeof(cl_mem), (void *) &cl_crowd_potential[1 - current_potential]);
+        ciErrNum |= worksize_enqueue(ckKernel_eikonal_sweep, GRID_CELLS * no_goal_groups);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        current_potential = 1 - current_potential;
+    }
+}
+
+/**
+ *  CROWD MODEL
+ *  the lod table is filled for the model, the hybrid model starts all micro and
+ *  coarsens from there; the neighbour lists depend on it and are rebuilt
+ */
+void set_crowd_model(int model)
+{
+    const char* model_names[] = {"ORCA", "continuum", "hybrid"};
+    std::vector<cl_uchar> lod(grid_size(), (model == CROWD_CONTINUUM) ? LOD_MACRO : LOD_MICRO);
+
+    crowd_model = model;
+
+    ciErrNum = clEnqueueWriteBuffer(cqCommandQueue, cl_lod, CL_TRUE, 0, grid_size() * sizeof(cl_uchar), &lod[0], 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    neighbour_lists_valid = false;
+    shrLog("Crowd model: %s\n", model_names[model]);
+}
+
+/* hysteresis update of the lod table from this frame's density; the change flag is read
+   without a stall and looked at on the next frame, which then invalidates the neighbour lists */
+void update_level_of_detail()
+{
+    if (lod_read)
+    {
+        ciErrNum = clWaitForEvents(1, &lod_read);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+        clReleaseEvent(lod_read);
+        lod_read = NULL;
+
+        if (lod_changed_read)
+        {
+            // queued ahead of this frame's update, so its changes are still seen
+            ciErrNum = clEnqueueWriteBuffer(cqCommandQueue, cl_lod_changed, CL_FALSE, 0, sizeof(int), &lod_changed_clear, 0, NULL, NULL);
+            shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+            neighbour_lists_valid = false;
+        }
+    }
+
+    ciErrNum  = worksize_enqueue(ckKernel_update_lod, GRID_CELLS);
+    ciErrNum |= clEnqueueReadBuffer(cqCommandQueue, cl_lod_changed, CL_FALSE, 0, sizeof(int), &lod_changed_read, 0, NULL, &lod_read);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+/* the tiles of a rectangle of cells and those within WALL_RANGE of it step every frame for a while */
+void hold_tiles(const cl_int4& rectangle)
+{
+    int x0 = std::max(rectangle.s[0] - activity_hold_margin, 0) / GRID_TILE;
+    int y0 = std::max(rectangle.s[1] - activity_hold_margin, 0) / GRID_TILE;
+    int x1 = std::min(rectangle.s[2] + activity_hold_margin, GRID_SIDE - 1) / GRID_TILE;
+    int y1 = std::min(rectangle.s[3] + activity_hold_margin, GRID_SIDE - 1) / GRID_TILE;
+
+    for (int y = y0; y <= y1; y++)
+    {
+        for (int x = x0; x <= x1; x++)
+        {
+            tile_hold[y * GRID_TILES_PER_ROW + x] = ACTIVITY_HOLD_WINDOWS;
+        }
+    }
+}
+
+/**
+ *  MULTI-RATE SCHEDULE
+ *  at the start of every window the tiles are classified from the agents' positions
+ *  and last velocities, then every frame each active agent learns whether it steps
+ */
+void schedule_agents()
+{
+    // without the flag every tile keeps the interval of 1 it was created with
+    if (multirate && activity_frame % ACTIVITY_WINDOW == 0)
+    {
+        ciErrNum = clEnqueueWriteBuffer(cqCommandQueue, cl_tile_hold, CL_TRUE, 0, ACTIVITY_TILES * sizeof(GLint), &tile_hold[0], 0, NULL, NULL);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        for (int t = 0; t < ACTIVITY_TILES; t++)
+        {
+            tile_hold[t] = std::max(tile_hold[t] - 1, 0);
+        }
+
+        ciErrNum  = worksize_enqueue(ckKernel_tile_activity, no_points);
+        ciErrNum |= worksize_enqueue(ckKernel_classify_tiles, ACTIVITY_TILES);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+
+    int use_neighbours = (crowd_model != CROWD_CONTINUUM);
+
+    ciErrNum  = clSetKernelArg(ckKernel_schedule_agents, 4, sizeof(cl_mem), (void *) &cl_active_agents[current_active_list]);
+    ciErrNum |= clSetKernelArg(ckKernel_schedule_agents, 5, sizeof(int), &no_active);
+    ciErrNum |= clSetKernelArg(ckKernel_schedule_agents, 6, sizeof(int), &activity_frame);
+    ciErrNum |= clSetKernelArg(ckKernel_schedule_agents, 10, sizeof(int), &use_neighbours);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    enqueue_agent_kernel(ckKernel_schedule_agents, no_active, work_shares_valid ? work_cuts : NULL);
+
+    activity_frame++;
+}
+
+/**
+ *  AGENT BUCKETS
+ *  the active list sorted by type into cl_bucket_agents, type_first / type_counts give
+ *  every bucket's range; the sort is stable, a bucket keeps the order of the active list.
+ *  The counts are the one readback, the launches need them; over several sub-devices
+ *  the micro bucket, first in the sort, is cut by its neighbour pairs as well
+ */
+void bucket_agent_types()
+{
+    for (int t = 0; t < AGENT_TYPES; t++)
+    {
+        type_counts[t] = 0;
+        type_first[t] = 0;
+    }
+
+    // only one type possible, every active agent goes to its model's kernel as it is
+    agents_bucketed = (crowd_model == CROWD_HYBRID) || multirate;
+    if (!agents_bucketed)
+    {
+        type_counts[(crowd_model == CROWD_ORCA) ? AGENT_TYPE_MICRO : AGENT_TYPE_MACRO] = no_active;
+        return;
+    }
+
+    // cleared from type_first, which stays zero until the read below returned
+    ciErrNum  = clEnqueueWriteBuffer(cqCommandQueue, cl_type_counts, CL_FALSE, 0, AGENT_TYPES * sizeof(GLint), type_first, 0, NULL, NULL);
+    ciErrNum |= clSetKernelArg(ckKernel_agent_types, 2, sizeof(cl_mem), (void *) &cl_active_agents[current_active_list]);
+    ciErrNum |= clSetKernelArg(ckKernel_agent_types, 3, sizeof(int), &no_active);
+    ciErrNum |= worksize_enqueue(ckKernel_agent_types, no_active);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    primitives_radix_sort(cl_type_keys, cl_bucket_agents, no_active, AGENT_TYPE_BITS);
+
+    ciErrNum = clEnqueueReadBuffer(cqCommandQueue, cl_type_counts, CL_TRUE, 0, AGENT_TYPES * sizeof(GLint), type_counts, 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    for (int t = 1; t < AGENT_TYPES; t++)
+    {
+        type_first[t] = type_first[t - 1] + type_counts[t - 1];
+    }
+
+    if (no_sub_devices > 1 && type_counts[AGENT_TYPE_MICRO] > 0)
+    {
+        cut_work_shares(cl_bucket_agents, type_counts[AGENT_TYPE_MICRO], micro_cuts);
+    }
+}
+
+/* every type's kernel over its bucket, the idle agents keep last frame's velocity; a
+   continuum agent costs the same as any other, its bucket is cut evenly */
+void solve_velocities()
+{
+    cl_kernel solvers[AGENT_TYPES] = {ckKernel_orca_velocities, ckKernel_continuum_velocities, NULL};
+    int bucket_args[AGENT_TYPES] = {9, 6, 0};       // bucket_agents, then bucket_first and bucket_size
+
+    cl_mem buckets = agents_bucketed ? cl_bucket_agents : cl_active_agents[current_active_list];
+
+    ciErrNum = clSetKernelArg(ckKernel_continuum_velocities, 2, sizeof(cl_mem), (void *) &cl_crowd_potential[current_potential]);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    for (int t = 0; t < AGENT_TYPES; t++)
+    {
+        if (solvers[t] == NULL || type_counts[t] == 0)
+        {
+            continue;
+        }
 
-    glPointSize(3*MIN_POINT_SIZE);
-    glDrawArrays(GL_POINTS, 0, no_points);
+        ciErrNum  = clSetKernelArg(solvers[t], bucket_args[t], sizeof(cl_mem), (void *) &buckets);
+        ciErrNum |= clSetKernelArg(solvers[t], bucket_args[t] + 1, sizeof(int), &type_first[t]);
+        ciErrNum |= clSetKernelArg(solvers[t], bucket_args[t] + 2, sizeof(int), &type_counts[t]);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-    glEnableClientState(GL_VERTEX_ARRAY);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo_obstacle_positions);
-    glVertexPointer(2, GL_FLOAT, 0, 0);
+        if (!agents_bucketed)
+        {
+            enqueue_agent_kernel(solvers[t], type_counts[t], work_shares_valid ? work_cuts : NULL);
+        }
+        else
+        {
+            enqueue_agent_kernel(solvers[t], type_counts[t], (t == AGENT_TYPE_MICRO) ? micro_cuts : NULL);
+        }
+    }
+}
 
-    glEnableClientState(GL_COLOR_ARRAY);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo_obstacle_colors);
-    glColorPointer(4, GL_FLOAT, 0, 0);
+/* rank whose strip holds a grid row */
+int domain_of_row(int row)
+{
+    int owner = 0;
 
-    glLineWidth(MIN_POINT_SIZE);
-    glDrawArrays(GL_LINES, 0, no_obstacles);
+    while (row >= domain_rows[owner + 1])
+    {
+        owner++;
+    }
 
-    glDisableClientState(GL_VERTEX_ARRAY);
-    glDisableClientState(GL_COLOR_ARRAY);
+    return owner;
+}
 
-    // flip backbuffer to screen
-    glutSwapBuffers();
+/* sent bits of the ranks whose halo holds a grid row, as domain_outbox keeps them */
+int domain_halo_mask(int row)
+{
+    int mask = 0;
 
-    gettimeofday(&stop, NULL);
+    for (int r = 0; r < no_ranks; r++)
+    {
+        if (r != domain_rank && row >= domain_rows[r] - DOMAIN_HALO_ROWS && row < domain_rows[r + 1] + DOMAIN_HALO_ROWS)
+        {
+            mask |= 1 << (DOMAIN_SENT_SHIFT + r);
+        }
+    }
 
-    time_sum += stop.tv_usec - start.tv_usec;
+    return mask;
+}
 
-    if (time_increment == 100)
+/* a message is the number of records, their (slot, rank | DOMAIN_HANDOFF) and their (position, velocity) */
+void pack_domain_records(const std::vector<cl_int2>& info, const std::vector<cl_float4>& state, std::vector<char>& message)
+{
+    int no_records = (int) info.size();
+
+    message.resize(sizeof(int) + no_records * (sizeof(cl_int2) + sizeof(cl_float4)));
+    memcpy(&message[0], &no_records, sizeof(int));
+    if (no_records > 0)
     {
-        printf("took %lu\n", time_sum / 100);
-        time_increment = 0;
-        time_sum  = 0;
+        memcpy(&message[sizeof(int)], &info[0], no_records * sizeof(cl_int2));
+        memcpy(&message[sizeof(int) + no_records * sizeof(cl_int2)], &state[0], no_records * sizeof(cl_float4));
     }
 }
 
 /**
- *  INITIALIZE MATRIX
- *  also initializes the lookahead matrices
- *  also initializes the activated matrix
+ *  HALO EXCHANGE
+ *  the owned agents near or in another strip are collected on the device, sorted
+ *  by receiving rank on the host and swapped with every other rank; an agent that
+ *  changed hands leaves or joins the active list straight away
  */
-void init_matrix()
+void exchange_halos()
 {
-    float m_position_x = -0.96;
-    float m_position_y = -0.96;
-    float m_increment_position_x = 0.01;
-    float m_increment_position_y = 0.01;
+    int no_records = 0;
 
-    matrix = new GLfloat [2 * matrix_size];
-    matrix_x = new GLint [matrix_size];
-    matrix_y = new GLint [matrix_size];
+    ciErrNum  = clEnqueueWriteBuffer(cqCommandQueue, cl_outbox_count, CL_TRUE, 0, sizeof(int), &no_records, 0, NULL, NULL);
+    ciErrNum |= worksize_enqueue(ckKernel_domain_outbox, no_points);
+    ciErrNum |= clEnqueueReadBuffer(cqCommandQueue, cl_outbox_count, CL_TRUE, 0, sizeof(int), &no_records, 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    shrCheckErrorEX(no_records <= DOMAIN_RECORDS_PER_AGENT * no_points, true, pCleanup);
+
+    std::vector<cl_int2> info(no_records);
+    std::vector<cl_float4> state(no_records);
+    if (no_records > 0)
+    {
+        ciErrNum  = clEnqueueReadBuffer(cqCommandQueue, cl_outbox_info, CL_FALSE, 0, no_records * sizeof(cl_int2), &info[0], 0, NULL, NULL);
+        ciErrNum |= clEnqueueReadBuffer(cqCommandQueue, cl_outbox_state, CL_TRUE, 0, no_records * sizeof(cl_float4), &state[0], 0, NULL, NULL);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+
+    std::vector<std::vector<cl_int2> > peer_info(no_ranks);
+    std::vector<std::vector<cl_float4> > peer_state(no_ranks);
+    int handed_over = 0;
+    for (int i = 0; i < no_records; i++)
+    {
+        int peer = info[i].s[1] & DOMAIN_OWNER_MASK;
+
+        peer_info[peer].push_back(info[i]);
+        peer_state[peer].push_back(state[i]);
+        handed_over += (info[i].s[1] & DOMAIN_HANDOFF) != 0;
+    }
+
+    std::vector<std::vector<char> > outgoing(no_ranks), incoming(no_ranks);
+    for (int peer = 0; peer < no_ranks; peer++)
+    {
+        pack_domain_records(peer_info[peer], peer_state[peer], outgoing[peer]);
+    }
 
-    lookahead_x = new GLfloat[2 * matrix_size];
-    lookahead_y = new GLfloat[2 * matrix_size];
+    domain_exchange(outgoing, incoming);
 
-    activated   = new GLint[2 * matrix_size];
+    if (apply_domain_records(incoming) + handed_over > 0)
+    {
+        rebuild_active_agents();
+    }
+}
 
-    int matrix_size_index = -1;
-    int matrix_xy_index   = -1;
+/* writes the records from the other ranks into their slots, returns the agents handed to this rank;
+   the inbox holds no_points records, more than that or a short message is a broken peer */
+int apply_domain_records(std::vector<std::vector<char> >& incoming)
+{
+    std::vector<cl_int2> info;
+    std::vector<cl_float4> state;
+    int handed_over = 0;
 
-    for (int i=0; i<193; i++)
+    for (int peer = 0; peer < no_ranks; peer++)
     {
-        for (int j=0; j<193; j++)
+        if (peer == domain_rank)
         {
-            matrix[++matrix_size_index] = m_position_x;
-            matrix[++matrix_size_index] = m_position_y;
+            continue;
+        }
 
-            m_position_x += m_increment_position_x;
+        int no_records = 0;
+        shrCheckErrorEX(incoming[peer].size() >= sizeof(int), true, pCleanup);
+        memcpy(&no_records, &incoming[peer][0], sizeof(int));
+        shrCheckErrorEX(no_records >= 0 && no_records <= no_points - (int) info.size(), true, pCleanup);
+        shrCheckErrorEX(incoming[peer].size() == sizeof(int) + no_records * (sizeof(cl_int2) + sizeof(cl_float4)), true, pCleanup);
 
-            matrix_xy_index += 1;
-            matrix_x[matrix_xy_index] = 0;
-            matrix_y[matrix_xy_index] = 0;
+        const cl_int2* peer_info = (const cl_int2*) &incoming[peer][sizeof(int)];
+        const cl_float4* peer_state = (const cl_float4*) &incoming[peer][sizeof(int) + no_records * sizeof(cl_int2)];
+        for (int i = 0; i < no_records; i++)
+        {
+            cl_int2 record = peer_info[i];
 
-            lookahead_x[2 * matrix_xy_index]     = 0.0f;
-            lookahead_x[2 * matrix_xy_index + 1] = 0.0f;
-            lookahead_y[2 * matrix_xy_index]     = 0.0f;
-            lookahead_y[2 * matrix_xy_index + 1] = 0.0f;
+            // the low bits named this rank on the way out, the inbox wants the sender
+            record.s[1] = peer | (record.s[1] & DOMAIN_HANDOFF);
+            handed_over += (record.s[1] & DOMAIN_HANDOFF) != 0;
 
-            activated[2 * matrix_xy_index]     = 0;
-            activated[2 * matrix_xy_index + 1] = 0;
+            info.push_back(record);
+            state.push_back(peer_state[i]);
         }
+    }
 
-        m_position_y += m_increment_position_y;
-        m_position_x = -0.96;
+    int no_records = (int) info.size();
+    if (no_records > 0)
+    {
+        ciErrNum  = clEnqueueWriteBuffer(cqCommandQueue, cl_inbox_info, CL_FALSE, 0, no_records * sizeof(cl_int2), &info[0], 0, NULL, NULL);
+        ciErrNum |= clEnqueueWriteBuffer(cqCommandQueue, cl_inbox_state, CL_FALSE, 0, no_records * sizeof(cl_float4), &state[0], 0, NULL, NULL);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_inbox, 5, sizeof(int), &no_records);
+        ciErrNum |= worksize_enqueue(ckKernel_domain_inbox, no_records);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        // the vectors go out of scope before the queue would get to the writes
+        clFinish(cqCommandQueue);
     }
+
+    domain_handoffs += handed_over;
+
+    return handed_over;
 }
 
 /**
- *  MAP OBSTACLES TO MATRIX
- *  also populates the lookahead matrices
+ *  REBUILD ACTIVE AGENTS
+ *  the owned slots that still have to move, compacted from all the slots
  */
-void map_obstacles_to_matrix()
+void rebuild_active_agents()
 {
-    start_index_y_obstacle = new GLint[no_obstacles];
-    end_index_y_obstacle   = new GLint[no_obstacles];
+    ciErrNum  = clSetKernelArg(ckKernel_domain_flag_agents, 6, sizeof(cl_mem), (void *) &cl_active_agents[1 - current_active_list]);
+    ciErrNum |= worksize_enqueue(ckKernel_domain_flag_agents, no_points);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-    for (int i = 0; i < no_obstacles / 2; i++)
-    {
-        int start_x = (int) (obstacle_positions[4 * i] * 100 + 96 + .5);
-        int start_y = (int) (obstacle_positions[4 * i + 1] * 100 + 96 + .5);
-        int end_x = (int) (obstacle_positions[4 * i + 2] * 100 + 96 + .5);
-        int end_y = (int) (obstacle_positions[4 * i + 3] * 100 + 96 + .5);
+    primitives_compact(cl_active_flags, cl_active_agents[1 - current_active_list], no_points,
+                       cl_active_agents[current_active_list], cl_no_active);
 
-        int m_position_x_int_start = 193 * start_y + start_x;
-        int m_position_y_int_start = 193 * start_x + start_y;
-        int m_position_x_int_end = 193 * end_y + end_x;
-        int m_position_y_int_end = 193 * end_x + end_y;
+    ciErrNum = clEnqueueReadBuffer(cqCommandQueue, cl_no_active, CL_TRUE, 0, sizeof(int), &no_active, 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-        int min_x_start = m_position_x_int_start < m_position_x_int_end ? m_position_x_int_start : m_position_x_int_end;
-        int min_y_start = m_position_y_int_start < m_position_y_int_end ? m_position_y_int_start : m_position_y_int_end;
+    frames_since_compaction = 0;
+    work_shares_valid = false;
+}
 
-        int max_x_end = min_x_start + abs(m_position_x_int_start - m_position_x_int_end);
-        int max_y_end = min_y_start + abs(m_position_y_int_start - m_position_y_int_end);
+/**
+ *  BROADCAST OWNED AGENTS
+ *  after the strips moved every rank sends all its agents to all the others, so no
+ *  ghost is older than the new halos, and hands over the ones now in another strip
+ */
+void broadcast_owned_agents()
+{
+    std::vector<cl_float2> position(no_points);
+    std::vector<cl_short2> fixed_position(fixed_positions ? no_points : 0);
+    std::vector<cl_float2> velocity(no_points);
+
+    ciErrNum  = clEnqueueReadBuffer(cqCommandQueue, vbo_cl_points_position, CL_FALSE, 0, no_points * position_bytes,
+                                    fixed_positions ? (void*) &fixed_position[0] : (void*) &position[0], 0, NULL, NULL);
+    ciErrNum |= clEnqueueReadBuffer(cqCommandQueue, cl_agent_velocity, CL_FALSE, 0, no_points * sizeof(cl_float2), &velocity[0], 0, NULL, NULL);
+    ciErrNum |= clEnqueueReadBuffer(cqCommandQueue, cl_agent_domain, CL_TRUE, 0, no_points * sizeof(GLint), &agent_domain[0], 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-        float min_y_start_position = obstacle_positions[4 * i + 1] < obstacle_positions[4 * i + 3] ? obstacle_positions[4 * i + 1] : obstacle_positions[4 * i + 3];
-        float max_y_end_position = obstacle_positions[4 * i + 1] < obstacle_positions[4 * i + 3] ? obstacle_positions[4 * i + 3] : obstacle_positions[4 * i + 1];
+    for (size_t i = 0; i < fixed_position.size(); i++)
+    {
+        position[i].s[0] = grid_unfix(fixed_position[i].s[0]);
+        position[i].s[1] = grid_unfix(fixed_position[i].s[1]);
+    }
 
-        start_index_y_obstacle[i] = min_y_start;
-        end_index_y_obstacle[i]   = max_y_end;
+    // every task collects the records of its agents, joined in agent order afterwards
+    int no_pieces = (no_points + HOST_GRAIN_ITEMS - 1) / HOST_GRAIN_ITEMS;
+    std::vector<std::vector<cl_int2> > piece_info(no_pieces);
+    std::vector<std::vector<cl_float4> > piece_state(no_pieces);
+    tasks_for(0, no_points, HOST_GRAIN_ITEMS, [&](int begin, int end)
+    {
+        int piece = begin / HOST_GRAIN_ITEMS;
 
-        for (int k = min_x_start; k <= max_x_end; k++)
+        for (int i = begin; i < end; i++)
         {
-            for (int j = min_y_start; j <= max_y_end; j++)
+            if ((agent_domain[i] & DOMAIN_OWNER_MASK) != domain_rank)
             {
-                matrix_y[j] = 1;
-
-                lookahead_y[2 * j]     = min_y_start_position;
-                lookahead_y[2 * j + 1] = max_y_end_position;
+                continue;
             }
 
-            matrix_x[k] = 1;
+            int row = std::min(std::max(grid_cell(position[i].s[1]), 0), GRID_SIDE - 1);
+            int owner = domain_of_row(row);
+            cl_int2 record = {{i, owner}};
+            cl_float4 agent_state = {{position[i].s[0], position[i].s[1], velocity[i].s[0], velocity[i].s[1]}};
+
+            piece_info[piece].push_back(record);
+            piece_state[piece].push_back(agent_state);
+            agent_domain[i] = (owner == domain_rank) ? (domain_rank | domain_halo_mask(row)) : owner;
+        }
+    });
+
+    std::vector<cl_int2> info;
+    std::vector<cl_float4> state;
+    for (int k = 0; k < no_pieces; k++)
+    {
+        info.insert(info.end(), piece_info[k].begin(), piece_info[k].end());
+        state.insert(state.end(), piece_state[k].begin(), piece_state[k].end());
+    }
+
+    // the record goes to every rank, as a hand-over only to the new owner
+    std::vector<std::vector<char> > outgoing(no_ranks), incoming(no_ranks);
+    std::vector<cl_int2> peer_info(info.size());
+    for (int peer = 0; peer < no_ranks; peer++)
+    {
+        for (size_t k = 0; k < info.size(); k++)
+        {
+            peer_info[k].s[0] = info[k].s[0];
+            peer_info[k].s[1] = peer | ((info[k].s[1] == peer) ? DOMAIN_HANDOFF : 0);
         }
+        pack_domain_records(peer_info, state, outgoing[peer]);
     }
+
+    ciErrNum = clEnqueueWriteBuffer(cqCommandQueue, cl_agent_domain, CL_TRUE, 0, no_points * sizeof(GLint), &agent_domain[0], 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    domain_exchange(outgoing, incoming);
+    apply_domain_records(incoming);
 }
 
 /**
- *  MAP NEIGHBOURS TO MATRIX
+ *  REPARTITION DOMAINS
+ *  the work of the active agents per row, one plus their listed neighbours while the
+ *  lists are current and the crowd is not a continuum, is summed over the ranks,
+ *  which all cut the same new strips from the sum; nothing moves while the current
+ *  strips are even enough
  */
-void map_points_to_neighbours()
+void repartition_domains()
 {
-    neighbours_x = new GLint [matrix_size];
-    neighbours_y = new GLint [matrix_size];
+    std::vector<GLint> row_load(GRID_SIDE, 0);
 
-    int neighbours_xy_index = -1;
+    ciErrNum = clEnqueueWriteBuffer(cqCommandQueue, cl_row_load, CL_TRUE, 0, GRID_SIDE * sizeof(GLint), &row_load[0], 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
 
-    for (int i=0; i<193; i++)
+    if (no_active > 0)
     {
-        for (int j=0; j<193; j++)
-        {
-            neighbours_xy_index += 1;
-            neighbours_x[neighbours_xy_index] = 0;
-            neighbours_y[neighbours_xy_index] = 0;
-        }
+        int use_neighbours = (crowd_model != CROWD_CONTINUUM) && neighbour_lists_valid;
+
+        ciErrNum  = clSetKernelArg(ckKernel_domain_row_load, 1, sizeof(cl_mem), (void *) &cl_active_agents[current_active_list]);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_row_load, 2, sizeof(int), &no_active);
+        ciErrNum |= clSetKernelArg(ckKernel_domain_row_load, 5, sizeof(int), &use_neighbours);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+        enqueue_agent_kernel(ckKernel_domain_row_load, no_active, work_shares_valid ? work_cuts : NULL);
+
+        ciErrNum = clEnqueueReadBuffer(cqCommandQueue, cl_row_load, CL_TRUE, 0, GRID_SIDE * sizeof(GLint), &row_load[0], 0, NULL, NULL);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
     }
 
-    for (int i = 0; i < no_points; i++)
-    {
-        int pos_x = (int) (points_position[2 * i] * 100 + 96 + .5);
-        int pos_y = (int) (points_position[2 * i + 1] * 100 + 96 + .5);
+    domain_sum(row_load);
 
-        int n_position_x = 193 * pos_y + pos_x;
-        int n_position_y = 193 * pos_x + pos_y;
+    float imbalance = domain_imbalance(row_load, domain_rows);
+    std::vector<GLint> rows;
+    domain_partition(row_load, no_ranks, DOMAIN_MIN_ROWS, rows);
 
-        neighbours_x[n_position_x] = 1;
-        neighbours_y[n_position_y] = 1;
+    if (imbalance <= DOMAIN_IMBALANCE || rows == domain_rows)
+    {
+        return;
     }
+
+    domain_rows = rows;
+
+    ciErrNum = clEnqueueWriteBuffer(cqCommandQueue, cl_domain_rows, CL_TRUE, 0, (no_ranks + 1) * sizeof(GLint), &domain_rows[0], 0, NULL, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    broadcast_owned_agents();
+    rebuild_active_agents();
+    neighbour_lists_valid = false;
+
+    shrLog("Domain: imbalance %.2f, rank %d now owns rows %d..%d and %d active agents\n",
+           imbalance, domain_rank, domain_rows[domain_rank], domain_rows[domain_rank + 1], no_active);
+}
+
+/* a colour channel of world.ads, 0 .. 1, as the byte of an RGBA8 colour */
+GLubyte color_byte(const char* channel)
+{
+    float value = std::min(std::max((float) atof(channel), 0.0f), 1.0f);
+
+    return (GLubyte) (value * 255 + .5f);
 }
 
 /**
@@ -1110,11 +3525,17 @@ void init_world()
             line_char = strdup(line.c_str());
             strtok_r(line_char, ":", &pointer);
             char *no_points_char = strtok_r(NULL, ":", &pointer);
-            no_points = atoi(no_points_char);
+            long long no_points_read = strtoll(no_points_char, NULL, 10);
+            if (no_points_read < 1 || no_points_read > AGENT_MAX_COUNT)
+            {
+                shrLog("world.ads: %lld dots, from 1 up to %d are possible\n", no_points_read, AGENT_MAX_COUNT);
+                Cleanup(EXIT_FAILURE);
+            }
+            no_points = (int) no_points_read;
 
             points_position = new GLfloat [2 * no_points];
             points_target   = new GLfloat [2 * no_points];
-            points_color    = new GLfloat [4 * no_points];
+            points_color    = new GLubyte [4 * no_points];
 //            points_old_position = new GLfloat [2 * no_points];
 //            path_faithful = new GLfloat [no_points];
 //            gravitational_force = new GLfloat [no_points];
@@ -1159,6 +3580,15 @@ void init_world()
             {
                 obstacle_positions = new GLfloat [2 * no_obstacles];
                 obstacle_colors = new GLfloat [4 * no_obstacles];
+                obstacle_velocities = new GLfloat [2 * no_obstacles];
+                obstacle_spins = new GLfloat [no_obstacles];
+
+                for (int i = 0; i < no_obstacles; i++)
+                {
+                    obstacle_velocities[2 * i]     = 0.0f;
+                    obstacle_velocities[2 * i + 1] = 0.0f;
+                    obstacle_spins[i]              = 0.0f;
+                }
             }
 
             printf("no obst: %d\n", no_obstacles);
@@ -1218,13 +3648,13 @@ void init_world()
                         char *color_w_char = strtok_r(NULL, "| ", &pointer);
 
                         no_colors_index += 1;
-                        points_color[no_colors_index] = atof(color_x_char);
+                        points_color[no_colors_index] = color_byte(color_x_char);
                         no_colors_index += 1;
-                        points_color[no_colors_index] = atof(color_y_char);
+                        points_color[no_colors_index] = color_byte(color_y_char);
                         no_colors_index += 1;
-                        points_color[no_colors_index] = atof(color_z_char);
+                        points_color[no_colors_index] = color_byte(color_z_char);
                         no_colors_index += 1;
-                        points_color[no_colors_index] = atof(color_w_char);
+                        points_color[no_colors_index] = color_byte(color_w_char);
 
 //                        printf("COLORS: ");
 //                        for (int i=0; i<4; i++)
@@ -1274,6 +3704,35 @@ void init_world()
                         obstacle_positions[++no_obstacles_index] = obstacle_position_x;
                         obstacle_positions[++no_obstacles_index] = obstacle_position_y;
                     }
+                    // motion of a moving obstacle, must come before the color
+                    else if (strstr(info, "velocity"))
+                    {
+                        char *velocity_x_char = strtok_r(NULL, "| ", &pointer);
+                        char *velocity_y_char = strtok_r(NULL, "| ", &pointer);
+
+                        if (no_obstacles_index < 1)
+                        {
+                            shrLog("world.ads: velocity before any obstacle position, ignored\n");
+                        }
+                        else
+                        {
+                            obstacle_velocities[no_obstacles_index - 1] = atof(velocity_x_char);
+                            obstacle_velocities[no_obstacles_index]     = atof(velocity_y_char);
+                        }
+                    }
+                    else if (strstr(info, "spin"))
+                    {
+                        char *spin_char = strtok_r(NULL, "| ", &pointer);
+
+                        if (no_obstacles_index < 1)
+                        {
+                            shrLog("world.ads: spin before any obstacle position, ignored\n");
+                        }
+                        else
+                        {
+                            obstacle_spins[no_obstacles_index / 2] = atof(spin_char);
+                        }
+                    }
                     else if (strstr(info, "color"))
                     {
                         char *obstacle_color_x_char = strtok_r(NULL, " ", &pointer);
@@ -1296,191 +3755,67 @@ void init_world()
             }
         }
 
-        printf("DONE\n");
-    }
-
-    printf("POSITONS\n");
-    for (int i=0; i<no_obstacles; i++)
-    {
-        printf("%f %f\n", obstacle_positions[2 * i], obstacle_positions[2 * i + 1]);
-    }
-}
-
-void timerEvent(int value)
-{
-    glutPostRedisplay();
-	glutTimerFunc(REFRESH_DELAY, timerEvent,0);
-}
-
-/**************************
- *  VBO CREATION SECTION  *
- **************************/
-
-/** MATRIX VBO **/
-void createVBOMatrix(GLuint* vbo)
-{
-    // create VBO
-    unsigned int size = matrix_size * 2 * sizeof(GLfloat);
-
-    if(!bQATest)
-    {
-        // create buffer object
-        glGenBuffers(1, vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, *vbo);
-
-        // initialize buffer object
-        glBufferData(GL_ARRAY_BUFFER, size, matrix, GL_DYNAMIC_DRAW);
-
-        #ifdef GL_INTEROP
-            // create OpenCL buffer from GL VBO
-            vbo_cl_matrix = clCreateFromGLBuffer(cxGPUContext, CL_MEM_READ_WRITE, *vbo, NULL);
-        #else
-            // create standard OpenCL mem buffer
-            vbo_cl_matrix = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, size, NULL, &ciErrNum);
-        #endif
-        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    }
-    else
-    {
-        // create standard OpenCL mem buffer
-        vbo_cl_matrix = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
-        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    }
-}
-
-/** MATRIX X VBO **/
-void createVBOMatrixX(GLuint* vbo)
-{
-    // create VBO
-    unsigned int size = matrix_size * sizeof(GLint);
-
-    if(!bQATest)
-    {
-        // create buffer object
-        glGenBuffers(1, vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, *vbo);
-
-        // initialize buffer object
-        glBufferData(GL_ARRAY_BUFFER, size, matrix_x, GL_DYNAMIC_DRAW);
-
-        #ifdef GL_INTEROP
-            // create OpenCL buffer from GL VBO
-            vbo_cl_matrix_x = clCreateFromGLBuffer(cxGPUContext, CL_MEM_READ_WRITE, *vbo, NULL);
-        #else
-            // create standard OpenCL mem buffer
-            vbo_cl_matrix_x = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, size, NULL, &ciErrNum);
-        #endif
-        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    }
-    else
-    {
-        // create standard OpenCL mem buffer
-        vbo_cl_matrix_x = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
-        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    }
-}
-
-/** MATRIX Y VBO **/
-void createVBOMatrixY(GLuint* vbo)
-{
-    // create VBO
-    unsigned int size = matrix_size * sizeof(GLint);
-
-    if(!bQATest)
-    {
-        // create buffer object
-        glGenBuffers(1, vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, *vbo);
-
-        // initialize buffer object
-        glBufferData(GL_ARRAY_BUFFER, size, matrix_y, GL_DYNAMIC_DRAW);
-
-        #ifdef GL_INTEROP
-            // create OpenCL buffer from GL VBO
-            vbo_cl_matrix_y = clCreateFromGLBuffer(cxGPUContext, CL_MEM_READ_WRITE, *vbo, NULL);
-        #else
-            // create standard OpenCL mem buffer
-            vbo_cl_matrix_y = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, size, NULL, &ciErrNum);
-        #endif
-        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    }
-    else
-    {
-        // create standard OpenCL mem buffer
-        vbo_cl_matrix_y = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
-        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    }
-}
-
-/** LOOKAHEAD X VBO */
-void createVBOLookaheadX(GLuint* vbo)
-{
-     // create VBO
-    unsigned int size = matrix_size * 2 * sizeof(GLfloat);
+        // trailing focus regions for the hybrid crowd model, focus|from x0 y0|to x1 y1,
+        // and kernel constants, constant|NAME value
+        while (getline(myfile, line))
+        {
+            if (line.compare(0, 8, "constant") == 0)
+            {
+                add_kernel_constant(line);
+                continue;
+            }
+            if (line.compare(0, 5, "focus") != 0)
+            {
+                continue;
+            }
 
-    if(!bQATest)
-    {
-        // create buffer object
-        glGenBuffers(1, vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, *vbo);
+            line_char = strdup(line.c_str());
+            char *info = strtok_r(line_char, "| ", &pointer);
+            cl_float4 region = {{-1.0f, -1.0f, 1.0f, 1.0f}};
 
-        // initialize buffer object
-        glBufferData(GL_ARRAY_BUFFER, size, lookahead_x, GL_DYNAMIC_DRAW);
+            while (info != NULL)
+            {
+                if (strstr(info, "from"))
+                {
+                    region.s[0] = atof(strtok_r(NULL, "| ", &pointer));
+                    region.s[1] = atof(strtok_r(NULL, "| ", &pointer));
+                }
+                else if (strstr(info, "to"))
+                {
+                    region.s[2] = atof(strtok_r(NULL, "| ", &pointer));
+                    region.s[3] = atof(strtok_r(NULL, "| ", &pointer));
+                }
 
-        #ifdef GL_INTEROP
-            // create OpenCL buffer from GL VBO
-            vbo_cl_lookahead_x = clCreateFromGLBuffer(cxGPUContext, CL_MEM_READ_WRITE, *vbo, NULL);
-        #else
-            // create standard OpenCL mem buffer
-            vbo_cl_lookahead_x = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, size, NULL, &ciErrNum);
-        #endif
-        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+                info = strtok_r(NULL, "| ", &pointer);
+            }
+            focus_regions.push_back(region);
+        }
+
+        printf("DONE\n");
     }
-    else
+
+    printf("POSITONS\n");
+    for (int i=0; i<no_obstacles; i++)
     {
-        // create standard OpenCL mem buffer
-        vbo_cl_lookahead_x = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
-        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+        printf("%f %f\n", obstacle_positions[2 * i], obstacle_positions[2 * i + 1]);
     }
 }
 
-/** LOOKAHEAD Y VBO */
-void createVBOLookaheadY(GLuint* vbo)
+void timerEvent(int value)
 {
-    // create VBO
-    unsigned int size = matrix_size * 2 * sizeof(GLfloat);
-
-    if(!bQATest)
-    {
-        // create buffer object
-        glGenBuffers(1, vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, *vbo);
-
-        // initialize buffer object
-        glBufferData(GL_ARRAY_BUFFER, size, lookahead_y, GL_DYNAMIC_DRAW);
-
-        #ifdef GL_INTEROP
-            // create OpenCL buffer from GL VBO
-            vbo_cl_lookahead_y = clCreateFromGLBuffer(cxGPUContext, CL_MEM_READ_WRITE, *vbo, NULL);
-        #else
-            // create standard OpenCL mem buffer
-            vbo_cl_lookahead_y = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, size, NULL, &ciErrNum);
-        #endif
-        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    }
-    else
-    {
-        // create standard OpenCL mem buffer
-        vbo_cl_lookahead_y = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
-        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
-    }
+    glutPostRedisplay();
+	glutTimerFunc(REFRESH_DELAY, timerEvent,0);
 }
 
-/** ACTIVATED VBO */
-void createVBOActivated(GLuint* vbo)
+/**************************
+ *  VBO CREATION SECTION  *
+ **************************/
+
+/** MATRIX VBO **/
+void createVBOMatrix(GLuint* vbo)
 {
     // create VBO
-    unsigned int size = matrix_size * 2 * sizeof(GLint);
+    unsigned int size = matrix_size * 2 * sizeof(GLfloat);
 
     if(!bQATest)
     {
@@ -1489,30 +3824,30 @@ void createVBOActivated(GLuint* vbo)
         glBindBuffer(GL_ARRAY_BUFFER, *vbo);
 
         // initialize buffer object
-        glBufferData(GL_ARRAY_BUFFER, size, activated, GL_DYNAMIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, size, matrix, GL_DYNAMIC_DRAW);
 
         #ifdef GL_INTEROP
             // create OpenCL buffer from GL VBO
-            vbo_cl_activated = clCreateFromGLBuffer(cxGPUContext, CL_MEM_READ_WRITE, *vbo, NULL);
+            vbo_cl_matrix = clCreateFromGLBuffer(cxGPUContext, CL_MEM_READ_WRITE, *vbo, NULL);
         #else
             // create standard OpenCL mem buffer
-            vbo_cl_activated = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, size, NULL, &ciErrNum);
+            vbo_cl_matrix = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, size, NULL, &ciErrNum);
         #endif
         shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
     }
     else
     {
         // create standard OpenCL mem buffer
-        vbo_cl_activated = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
+        vbo_cl_matrix = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, matrix, &ciErrNum);
         shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
     }
 }
 
-/** NEIGHBOURS X MATRIX VBO */
-void createVBONeighboursX(GLuint* vbo)
+/** MATRIX X VBO **/
+void createVBOMatrixX(GLuint* vbo)
 {
     // create VBO
-    unsigned int size = matrix_size * sizeof(GLint);
+    unsigned int size = grid_size() * sizeof(GLint);
 
     if(!bQATest)
     {
@@ -1521,32 +3856,30 @@ void createVBONeighboursX(GLuint* vbo)
         glBindBuffer(GL_ARRAY_BUFFER, *vbo);
 
         // initialize buffer object
-        glBufferData(GL_ARRAY_BUFFER, size, neighbours_x, GL_DYNAMIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, size, matrix_x, GL_DYNAMIC_DRAW);
 
         #ifdef GL_INTEROP
             // create OpenCL buffer from GL VBO
-            vbo_cl_neighbours_x = clCreateFromGLBuffer(cxGPUContext, CL_MEM_READ_WRITE, *vbo, NULL);
+            vbo_cl_matrix_x = clCreateFromGLBuffer(cxGPUContext, CL_MEM_READ_WRITE, *vbo, NULL);
         #else
             // create standard OpenCL mem buffer
-            vbo_cl_neighbours_x = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, size, NULL, &ciErrNum);
+            vbo_cl_matrix_x = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, size, NULL, &ciErrNum);
         #endif
         shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
     }
     else
     {
         // create standard OpenCL mem buffer
-        vbo_cl_neighbours_x = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
+        vbo_cl_matrix_x = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, matrix_x, &ciErrNum);
         shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
     }
 }
 
-/**
- *  NEIGHBOURS Y MATRIX
- */
-void createVBONeighboursY(GLuint* vbo)
+/** MATRIX Y VBO **/
+void createVBOMatrixY(GLuint* vbo)
 {
     // create VBO
-    unsigned int size = matrix_size * sizeof(GLint);
+    unsigned int size = grid_size() * sizeof(GLint);
 
     if(!bQATest)
     {
@@ -1555,21 +3888,21 @@ void createVBONeighboursY(GLuint* vbo)
         glBindBuffer(GL_ARRAY_BUFFER, *vbo);
 
         // initialize buffer object
-        glBufferData(GL_ARRAY_BUFFER, size, neighbours_y, GL_DYNAMIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, size, matrix_y, GL_DYNAMIC_DRAW);
 
         #ifdef GL_INTEROP
             // create OpenCL buffer from GL VBO
-            vbo_cl_neighbours_y = clCreateFromGLBuffer(cxGPUContext, CL_MEM_READ_WRITE, *vbo, NULL);
+            vbo_cl_matrix_y = clCreateFromGLBuffer(cxGPUContext, CL_MEM_READ_WRITE, *vbo, NULL);
         #else
             // create standard OpenCL mem buffer
-            vbo_cl_neighbours_y = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, size, NULL, &ciErrNum);
+            vbo_cl_matrix_y = clCreateBuffer(cxGPUContext, CL_MEM_WRITE_ONLY, size, NULL, &ciErrNum);
         #endif
         shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
     }
     else
     {
         // create standard OpenCL mem buffer
-        vbo_cl_neighbours_y = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
+        vbo_cl_matrix_y = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, matrix_y, &ciErrNum);
         shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
     }
 }
@@ -1578,7 +3911,15 @@ void createVBONeighboursY(GLuint* vbo)
 void createVBOPointsPosition(GLuint* vbo)
 {
     // create VBO
-    unsigned int size = no_points * 2 * sizeof(GLfloat);
+    size_t size = agent_bytes(position_bytes);
+
+    std::vector<cl_short2> fixed_position(fixed_positions ? no_points : 0);
+    for (size_t i = 0; i < fixed_position.size(); i++)
+    {
+        fixed_position[i].s[0] = (cl_short) grid_fix(points_position[2 * i]);
+        fixed_position[i].s[1] = (cl_short) grid_fix(points_position[2 * i + 1]);
+    }
+    void* initial_position = fixed_positions ? (void*) &fixed_position[0] : (void*) points_position;
     if(!bQATest)
     {
         // create buffer object
@@ -1586,7 +3927,7 @@ void createVBOPointsPosition(GLuint* vbo)
         glBindBuffer(GL_ARRAY_BUFFER, *vbo);
 
         // initialize buffer object
-        glBufferData(GL_ARRAY_BUFFER, size, points_position, GL_DYNAMIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, size, initial_position, GL_DYNAMIC_DRAW);
 
         #ifdef GL_INTEROP
             // create OpenCL buffer from GL VBO
@@ -1599,8 +3940,8 @@ void createVBOPointsPosition(GLuint* vbo)
     }
     else
     {
-        // create standard OpenCL mem buffer
-        vbo_cl_points_position = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
+        // create standard OpenCL mem buffer, placed by the sub-device that steps each agent
+        vbo_cl_points_position = create_agent_buffer(CL_MEM_READ_WRITE, position_bytes, initial_position);
         shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
     }
 }
@@ -1609,7 +3950,7 @@ void createVBOPointsPosition(GLuint* vbo)
 void createVBOPointsColor(GLuint* vbo)
 {
     // create VBO
-    unsigned int size = no_points * 4 * sizeof(GLfloat);
+    size_t size = agent_bytes(4 * sizeof(GLubyte));
     if(!bQATest)
     {
         // create buffer object
@@ -1630,8 +3971,8 @@ void createVBOPointsColor(GLuint* vbo)
     }
     else
     {
-        // create standard OpenCL mem buffer
-        vbo_cl_points_color = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
+        // create standard OpenCL mem buffer, placed by the sub-device that steps each agent
+        vbo_cl_points_color = create_agent_buffer(CL_MEM_READ_WRITE, 4 * sizeof(GLubyte), points_color);
         shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
     }
 }
@@ -1640,7 +3981,13 @@ void createVBOPointsColor(GLuint* vbo)
 void createVBOPointsTarget(GLuint* vbo)
 {
     // create VBO
-    unsigned int size = no_points * 2 * sizeof(GLfloat);
+    size_t size = agent_bytes(sizeof(GLuint));
+
+    std::vector<GLuint> packed_target(no_points);
+    for (int i = 0; i < no_points; i++)
+    {
+        packed_target[i] = grid_pack_point(points_target[2 * i], points_target[2 * i + 1]);
+    }
 
     if(!bQATest)
     {
@@ -1649,7 +3996,7 @@ void createVBOPointsTarget(GLuint* vbo)
         glBindBuffer(GL_ARRAY_BUFFER, *vbo);
 
         // initialize buffer object
-        glBufferData(GL_ARRAY_BUFFER, size, points_target, GL_DYNAMIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, size, &packed_target[0], GL_DYNAMIC_DRAW);
 
         #ifdef GL_INTEROP
             // create OpenCL buffer from GL VBO
@@ -1662,8 +4009,8 @@ void createVBOPointsTarget(GLuint* vbo)
     }
     else
     {
-        // create standard OpenCL mem buffer
-        vbo_cl_points_target = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
+        // create standard OpenCL mem buffer, placed by the sub-device that steps each agent
+        vbo_cl_points_target = create_agent_buffer(CL_MEM_READ_WRITE, sizeof(GLuint), &packed_target[0]);
         shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
     }
 }
@@ -1695,7 +4042,7 @@ void createVBOObstaclePositions(GLuint* vbo)
     else
     {
         // create standard OpenCL mem buffer
-        vbo_cl_obstacle_positions = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
+        vbo_cl_obstacle_positions = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, obstacle_positions, &ciErrNum);
         shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
     }
 }
@@ -1727,11 +4074,341 @@ void createVBOObstacleColors(GLuint* vbo)
     else
     {
         // create standard OpenCL mem buffer
-        vbo_cl_obstacle_colors = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
+        vbo_cl_obstacle_colors = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, obstacle_colors, &ciErrNum);
+        shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    }
+}
+
+/** ACTIVE AGENTS BUFFERS **/
+void createActiveAgentsBuffers()
+{
+    // device only buffers, nothing here is rendered
+    size_t size = agent_bytes(sizeof(GLint));
+
+    active_agents = new GLint [no_points];
+    for (int i = 0; i < no_points; i++)
+    {
+        active_agents[i] = i;
+    }
+    no_active = no_points;
+
+    cl_active_agents[0] = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, active_agents, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_active_agents[1] = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_active_flags = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, size, NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_no_active = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, sizeof(GLint), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+/** NEIGHBOUR LISTS BUFFERS **/
+void createNeighbourListBuffers()
+{
+    // the counters are reset by the kernels themselves, they only need to start at 0
+    std::vector<GLint> zeros(std::max(grid_size(), no_points) + 1, 0);
+
+    cl_cell_counts = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, (grid_size() + 1) * sizeof(GLint), &zeros[0], &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_cell_start = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, (grid_size() + 1) * sizeof(GLint), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_cell_agents = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, agent_bytes(sizeof(GLint)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_agent_rank = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, agent_bytes(sizeof(GLint)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_neighbour_offsets = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, device_bytes(no_points + 1, sizeof(GLint)), &zeros[0], &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    neighbour_list_capacity = std::max(no_points, 1);
+    cl_neighbour_list = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, device_bytes(neighbour_list_capacity, sizeof(GLint)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    cl_position_at_build = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, agent_bytes(position_bytes), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_displacement = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, agent_bytes(sizeof(GLfloat)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_max_displacement = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, sizeof(GLfloat), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_neighbour_total = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, 2 * sizeof(cl_uint), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+/** OBSTACLE TABLE BUFFERS **/
+void createObstacleTableBuffers()
+{
+    int no_ids = no_obstacles / 2 + 1;
+    int no_segments = obstacle_segments.size();
+
+    cl_obstacle_id = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, grid_size() * sizeof(GLushort), obstacle_id, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_obstacle_range = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, no_ids * 2 * sizeof(GLfloat), obstacle_range, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_obstacle_activation = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, no_ids * 2 * sizeof(GLint), obstacle_activation, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    // a world without obstacles still gets valid (unused) segment buffers
+    cl_obstacle_segments = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, std::max(no_segments, 1) * sizeof(cl_float4), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_segment_obstacle_ids = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, std::max(no_segments, 1) * sizeof(GLushort), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_segment_span_offsets = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, (no_segments + 1) * sizeof(GLint), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    if (no_segments > 0)
+    {
+        ciErrNum  = clEnqueueWriteBuffer(cqCommandQueue, cl_obstacle_segments, CL_TRUE, 0, no_segments * sizeof(cl_float4), &obstacle_segments[0], 0, NULL, NULL);
+        ciErrNum |= clEnqueueWriteBuffer(cqCommandQueue, cl_segment_obstacle_ids, CL_TRUE, 0, no_segments * sizeof(GLushort), &segment_obstacle_ids[0], 0, NULL, NULL);
         shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
     }
 }
 
+/** DISTANCE FIELD BUFFERS **/
+void createDistanceFieldBuffers()
+{
+    cl_jfa_seeds[0] = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, grid_size() * sizeof(cl_int4), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_jfa_seeds[1] = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, grid_size() * sizeof(cl_int4), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_distance_field = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, grid_size() * sizeof(cl_float4), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+/** AGENT VELOCITY BUFFERS **/
+void createVelocityBuffers()
+{
+    // every agent starts standing still
+    std::vector<GLfloat> velocity(no_points * 2, 0.0f);
+
+    cl_agent_velocity = create_agent_buffer(CL_MEM_READ_WRITE, 2 * sizeof(GLfloat), &velocity[0]);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_new_velocity = create_agent_buffer(CL_MEM_READ_WRITE, 2 * sizeof(GLfloat), NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+/** CONTINUUM CROWD BUFFERS **/
+void createContinuumBuffers()
+{
+    std::vector<GLint> goal_group(grid_size(), -1);
+    std::vector<GLint> target_region(no_points);
+    std::vector<GLint> region_group;
+    int region = CONTINUUM_GOAL_REGION;
+
+    // goal regions grow until few enough of them hold a target
+    for (no_goal_groups = CONTINUUM_MAX_GROUPS + 1; no_goal_groups > CONTINUUM_MAX_GROUPS; region *= 2)
+    {
+        int regions_per_row = (GRID_SIDE + region - 1) / region;
+
+        region_group.assign(regions_per_row * regions_per_row, -1);
+        no_goal_groups = 0;
+
+        for (int i = 0; i < no_points; i++)
+        {
+            int target_x = std::min(std::max(grid_cell(points_target[2 * i]), 0), GRID_SIDE - 1);
+            int target_y = std::min(std::max(grid_cell(points_target[2 * i + 1]), 0), GRID_SIDE - 1);
+
+            target_region[i] = (target_y / region) * regions_per_row + target_x / region;
+            if (region_group[target_region[i]] < 0)
+            {
+                region_group[target_region[i]] = no_goal_groups++;
+            }
+        }
+    }
+
+    for (int i = 0; i < no_points; i++)
+    {
+        int target_x = std::min(std::max(grid_cell(points_target[2 * i]), 0), GRID_SIDE - 1);
+        int target_y = std::min(std::max(grid_cell(points_target[2 * i + 1]), 0), GRID_SIDE - 1);
+
+        goal_group[grid_index(target_x, target_y)] = region_group[target_region[i]];
+    }
+    shrLog("Continuum crowd: %d goal groups\n", no_goal_groups);
+
+    std::vector<GLint> splat(3 * grid_size(), 0);
+    std::vector<GLfloat> potential(std::max(no_goal_groups, 1) * grid_size(), CONTINUUM_FAR);
+
+    cl_goal_group = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, grid_size() * sizeof(GLint), &goal_group[0], &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_crowd_splat = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, splat.size() * sizeof(GLint), &splat[0], &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_crowd_density = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, grid_size() * sizeof(cl_float4), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_crowd_speed = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, grid_size() * sizeof(cl_float4), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_crowd_potential[0] = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, potential.size() * sizeof(GLfloat), &potential[0], &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_crowd_potential[1] = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, potential.size() * sizeof(GLfloat), &potential[0], &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+/** LEVEL OF DETAIL BUFFERS **/
+void createLevelOfDetailBuffers()
+{
+    std::vector<cl_uchar> focus(grid_size(), 0);
+    int lod_changed = 0;
+
+    // a cell is in focus when its centre lies in one of the focus rectangles
+    for (size_t r = 0; r < focus_regions.size(); r++)
+    {
+        for (int y = 0; y < GRID_SIDE; y++)
+        {
+            for (int x = 0; x < GRID_SIDE; x++)
+            {
+                float centre_x = (x - 96) / 100.0f;
+                float centre_y = (y - 96) / 100.0f;
+
+                if (centre_x >= focus_regions[r].s[0] && centre_y >= focus_regions[r].s[1]
+                 && centre_x <= focus_regions[r].s[2] && centre_y <= focus_regions[r].s[3])
+                {
+                    focus[grid_index(x, y)] = 1;
+                }
+            }
+        }
+    }
+
+    cl_lod = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, grid_size() * sizeof(cl_uchar), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_lod_focus = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, grid_size() * sizeof(cl_uchar), &focus[0], &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_lod_changed = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(int), &lod_changed, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+/** MULTI-RATE STEPPING BUFFERS **/
+void createMultirateBuffers()
+{
+    std::vector<GLint> stats(4 * ACTIVITY_TILES, 0);
+    std::vector<GLint> interval(ACTIVITY_TILES, 1);
+    std::vector<GLint> last_step(no_points, -1);    // one frame owed on frame 0
+
+    tile_hold.assign(ACTIVITY_TILES, 0);
+
+    cl_tile_stats = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, stats.size() * sizeof(GLint), &stats[0], &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_tile_hold = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, ACTIVITY_TILES * sizeof(GLint), &tile_hold[0], &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_tile_interval = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, ACTIVITY_TILES * sizeof(GLint), &interval[0], &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_step_multiplier = create_agent_buffer(CL_MEM_READ_WRITE, sizeof(cl_uchar), NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_last_step = create_agent_buffer(CL_MEM_READ_WRITE, sizeof(GLint), &last_step[0]);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+/** AGENT TYPES BUFFERS **/
+void createAgentTypeBuffers()
+{
+    std::vector<GLint> zeros(AGENT_TYPES, 0);
+
+    cl_type_keys = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, agent_bytes(sizeof(cl_uint)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_bucket_agents = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, agent_bytes(sizeof(GLint)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_type_counts = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, AGENT_TYPES * sizeof(GLint), &zeros[0], &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+/** LOAD BALANCE BUFFERS **/
+void createLoadBalanceBuffers()
+{
+    cl_agent_work = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, device_bytes(no_points + 1, sizeof(GLint)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_work_cuts = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, (MAX_SUB_DEVICES + 1) * sizeof(cl_int2), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+/** DOMAIN DECOMPOSITION BUFFERS **/
+void createDomainBuffers()
+{
+    if (no_ranks == 1)
+    {
+        return;
+    }
+
+    // every rank starts from the same world.ads, so they all cut the same strips from it;
+    // every task counts its agents into its own rows, summed up afterwards
+    int no_pieces = (no_points + HOST_GRAIN_ITEMS - 1) / HOST_GRAIN_ITEMS;
+    std::vector<std::vector<GLint> > piece_load(no_pieces, std::vector<GLint>(GRID_SIDE, 0));
+    tasks_for(0, no_points, HOST_GRAIN_ITEMS, [&](int begin, int end)
+    {
+        std::vector<GLint>& load = piece_load[begin / HOST_GRAIN_ITEMS];
+        for (int i = begin; i < end; i++)
+        {
+            load[std::min(std::max(grid_cell(points_position[2 * i + 1]), 0), GRID_SIDE - 1)]++;
+        }
+    });
+
+    std::vector<GLint> row_load(GRID_SIDE, 0);
+    for (int k = 0; k < no_pieces; k++)
+    {
+        for (int row = 0; row < GRID_SIDE; row++)
+        {
+            row_load[row] += piece_load[k][row];
+        }
+    }
+    domain_partition(row_load, no_ranks, DOMAIN_MIN_ROWS, domain_rows);
+
+    agent_domain.resize(no_points);
+    tasks_for(0, no_points, HOST_GRAIN_ITEMS, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            int row = std::min(std::max(grid_cell(points_position[2 * i + 1]), 0), GRID_SIDE - 1);
+            int owner = domain_of_row(row);
+
+            agent_domain[i] = (owner == domain_rank) ? (domain_rank | domain_halo_mask(row)) : owner;
+        }
+    });
+
+    shrLog("Domain: rank %d owns rows %d..%d\n", domain_rank, domain_rows[domain_rank], domain_rows[domain_rank + 1]);
+
+    cl_domain_rows = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, (no_ranks + 1) * sizeof(GLint), &domain_rows[0], &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_agent_domain = create_agent_buffer(CL_MEM_READ_WRITE, sizeof(GLint), &agent_domain[0]);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_outbox_count = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, sizeof(GLint), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_outbox_info = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, agent_bytes(DOMAIN_RECORDS_PER_AGENT * sizeof(cl_int2)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_outbox_state = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, agent_bytes(DOMAIN_RECORDS_PER_AGENT * sizeof(cl_float4)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_inbox_info = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, agent_bytes(sizeof(cl_int2)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_inbox_state = clCreateBuffer(cxGPUContext, CL_MEM_READ_ONLY, agent_bytes(sizeof(cl_float4)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_row_load = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, GRID_SIDE * sizeof(GLint), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
+/** MORTON REORDERING BUFFERS **/
+void createMortonBuffers()
+{
+    // agent i starts in slot i, the sorted copies are only staging for the gather
+    agent_ids = new GLint [no_points];
+    for (int i = 0; i < no_points; i++)
+    {
+        agent_ids[i] = i;
+    }
+
+    cl_agent_ids[0] = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, agent_bytes(sizeof(GLint)), agent_ids, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_agent_ids[1] = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, agent_bytes(sizeof(GLint)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_morton_keys = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, agent_bytes(sizeof(cl_uint)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_morton_order = clCreateBuffer(cxGPUContext, CL_MEM_READ_WRITE, agent_bytes(sizeof(GLint)), NULL, &ciErrNum);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_sorted_position = create_agent_buffer(CL_MEM_READ_WRITE, position_bytes, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_sorted_target = create_agent_buffer(CL_MEM_READ_WRITE, sizeof(GLuint), NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_sorted_color = create_agent_buffer(CL_MEM_READ_WRITE, 4 * sizeof(GLubyte), NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_sorted_velocity = create_agent_buffer(CL_MEM_READ_WRITE, 2 * sizeof(GLfloat), NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+    cl_sorted_last_step = create_agent_buffer(CL_MEM_READ_WRITE, sizeof(GLint), NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+}
+
 //void createVBOOldPositions(GLuint* vbo)
 //{
 //    // create VBO
@@ -1896,8 +4573,53 @@ void Cleanup(int iExitCode)
 //    if(ckKernel_clean_collision_map)       clReleaseKernel(ckKernel_clean_collision_map);
 //    if(ckKernel_compute_velocity)       clReleaseKernel(ckKernel_compute_velocity);
 
+    if(ckKernel_orca_velocities)        clReleaseKernel(ckKernel_orca_velocities);
+    if(ckKernel_splat_crowd)            clReleaseKernel(ckKernel_splat_crowd);
+    if(ckKernel_resolve_crowd_splat)    clReleaseKernel(ckKernel_resolve_crowd_splat);
+    if(ckKernel_crowd_speed)            clReleaseKernel(ckKernel_crowd_speed);
+    if(ckKernel_eikonal_sweep)          clReleaseKernel(ckKernel_eikonal_sweep);
+    if(ckKernel_continuum_velocities)   clReleaseKernel(ckKernel_continuum_velocities);
+    if(ckKernel_update_lod)             clReleaseKernel(ckKernel_update_lod);
+    if(ckKernel_tile_activity)          clReleaseKernel(ckKernel_tile_activity);
+    if(ckKernel_classify_tiles)         clReleaseKernel(ckKernel_classify_tiles);
+    if(ckKernel_schedule_agents)        clReleaseKernel(ckKernel_schedule_agents);
+    if(ckKernel_agent_types)            clReleaseKernel(ckKernel_agent_types);
+    if(ckKernel_agent_work)             clReleaseKernel(ckKernel_agent_work);
+    if(ckKernel_work_cuts)              clReleaseKernel(ckKernel_work_cuts);
+    if(ckKernel_domain_outbox)          clReleaseKernel(ckKernel_domain_outbox);
+    if(ckKernel_domain_inbox)           clReleaseKernel(ckKernel_domain_inbox);
+    if(ckKernel_domain_flag_agents)     clReleaseKernel(ckKernel_domain_flag_agents);
+    if(ckKernel_domain_row_load)        clReleaseKernel(ckKernel_domain_row_load);
+    if(ckKernel_apply_obstacle_commands) clReleaseKernel(ckKernel_apply_obstacle_commands);
+    if(ckKernel_count_segment_spans)    clReleaseKernel(ckKernel_count_segment_spans);
+    if(ckKernel_rasterise_segments)     clReleaseKernel(ckKernel_rasterise_segments);
+    if(ckKernel_clear_dirty_rectangles) clReleaseKernel(ckKernel_clear_dirty_rectangles);
+    if(ckKernel_jfa_init)               clReleaseKernel(ckKernel_jfa_init);
+    if(ckKernel_jfa_step)               clReleaseKernel(ckKernel_jfa_step);
+    if(ckKernel_jfa_distance)           clReleaseKernel(ckKernel_jfa_distance);
+    if(ckKernel_flag_active_agents)     clReleaseKernel(ckKernel_flag_active_agents);
+    if(ckKernel_morton_keys)            clReleaseKernel(ckKernel_morton_keys);
+    if(ckKernel_count_cell_agents)      clReleaseKernel(ckKernel_count_cell_agents);
+    if(ckKernel_fill_cell_agents)       clReleaseKernel(ckKernel_fill_cell_agents);
+    if(ckKernel_count_neighbours)       clReleaseKernel(ckKernel_count_neighbours);
+    if(ckKernel_fill_neighbours)        clReleaseKernel(ckKernel_fill_neighbours);
+    if(ckKernel_neighbour_displacement) clReleaseKernel(ckKernel_neighbour_displacement);
+    if(ckKernel_gather_agents)          clReleaseKernel(ckKernel_gather_agents);
+    release_primitives();
+    release_worksizes();
+    release_domain();
+    release_tasks();
+
     if(cpProgram)      clReleaseProgram(cpProgram);
+    for (std::map<std::string, cl_program>::iterator variant = program_variants.begin(); variant != program_variants.end(); ++variant)
+    {
+        clReleaseProgram(variant->second);
+    }
     if(cqCommandQueue) clReleaseCommandQueue(cqCommandQueue);
+    for (cl_uint d = 1; d < no_sub_devices; d++)
+    {
+        if(sub_queues[d]) clReleaseCommandQueue(sub_queues[d]);
+    }
 
 //    if(vbo_obstacle_positions)
 //    {
@@ -1979,9 +4701,91 @@ void Cleanup(int iExitCode)
 //    }
 //    if(vbo_cl_target_positions)clReleaseMemObject(vbo_cl_target_positions);
 
+    if(cl_obstacle_commands)clReleaseMemObject(cl_obstacle_commands);
+    if(cl_obstacle_id)clReleaseMemObject(cl_obstacle_id);
+    if(cl_obstacle_range)clReleaseMemObject(cl_obstacle_range);
+    if(obstacle_upload)clReleaseEvent(obstacle_upload);
+    if(cl_obstacle_activation)clReleaseMemObject(cl_obstacle_activation);
+    if(cl_obstacle_segments)clReleaseMemObject(cl_obstacle_segments);
+    if(cl_segment_obstacle_ids)clReleaseMemObject(cl_segment_obstacle_ids);
+    if(cl_segment_span_offsets)clReleaseMemObject(cl_segment_span_offsets);
+    if(cl_dirty_rectangles)clReleaseMemObject(cl_dirty_rectangles);
+    if(cl_dirty_rectangle_offsets)clReleaseMemObject(cl_dirty_rectangle_offsets);
+    if(cl_dirty_segments)clReleaseMemObject(cl_dirty_segments);
+    if(cl_dirty_segment_ids)clReleaseMemObject(cl_dirty_segment_ids);
+    if(cl_jfa_seeds[0])clReleaseMemObject(cl_jfa_seeds[0]);
+    if(cl_jfa_seeds[1])clReleaseMemObject(cl_jfa_seeds[1]);
+    if(cl_distance_field)clReleaseMemObject(cl_distance_field);
+
+    if(cl_active_agents[0])clReleaseMemObject(cl_active_agents[0]);
+    if(cl_active_agents[1])clReleaseMemObject(cl_active_agents[1]);
+    if(cl_active_flags)clReleaseMemObject(cl_active_flags);
+    if(cl_no_active)clReleaseMemObject(cl_no_active);
+    if(active_agents)delete [] active_agents;
+
+    if(cl_agent_ids[0])clReleaseMemObject(cl_agent_ids[0]);
+    if(cl_agent_ids[1])clReleaseMemObject(cl_agent_ids[1]);
+    if(cl_morton_keys)clReleaseMemObject(cl_morton_keys);
+    if(cl_morton_order)clReleaseMemObject(cl_morton_order);
+    if(cl_sorted_position)clReleaseMemObject(cl_sorted_position);
+    if(cl_sorted_target)clReleaseMemObject(cl_sorted_target);
+    if(cl_sorted_color)clReleaseMemObject(cl_sorted_color);
+    if(cl_sorted_velocity)clReleaseMemObject(cl_sorted_velocity);
+    if(cl_sorted_last_step)clReleaseMemObject(cl_sorted_last_step);
+    if(cl_agent_velocity)clReleaseMemObject(cl_agent_velocity);
+    if(cl_new_velocity)clReleaseMemObject(cl_new_velocity);
+    if(cl_goal_group)clReleaseMemObject(cl_goal_group);
+    if(cl_crowd_splat)clReleaseMemObject(cl_crowd_splat);
+    if(cl_crowd_density)clReleaseMemObject(cl_crowd_density);
+    if(cl_crowd_speed)clReleaseMemObject(cl_crowd_speed);
+    if(cl_crowd_potential[0])clReleaseMemObject(cl_crowd_potential[0]);
+    if(cl_crowd_potential[1])clReleaseMemObject(cl_crowd_potential[1]);
+    if(cl_lod)clReleaseMemObject(cl_lod);
+    if(cl_lod_focus)clReleaseMemObject(cl_lod_focus);
+    if(cl_lod_changed)clReleaseMemObject(cl_lod_changed);
+    if(lod_read)clReleaseEvent(lod_read);
+    if(displacement_read)clReleaseEvent(displacement_read);
+    if(cl_tile_stats)clReleaseMemObject(cl_tile_stats);
+    if(cl_tile_hold)clReleaseMemObject(cl_tile_hold);
+    if(cl_tile_interval)clReleaseMemObject(cl_tile_interval);
+    if(cl_step_multiplier)clReleaseMemObject(cl_step_multiplier);
+    if(cl_last_step)clReleaseMemObject(cl_last_step);
+    if(cl_type_keys)clReleaseMemObject(cl_type_keys);
+    if(cl_bucket_agents)clReleaseMemObject(cl_bucket_agents);
+    if(cl_type_counts)clReleaseMemObject(cl_type_counts);
+    if(cl_agent_work)clReleaseMemObject(cl_agent_work);
+    if(cl_work_cuts)clReleaseMemObject(cl_work_cuts);
+    if(cl_domain_rows)clReleaseMemObject(cl_domain_rows);
+    if(cl_agent_domain)clReleaseMemObject(cl_agent_domain);
+    if(cl_outbox_count)clReleaseMemObject(cl_outbox_count);
+    if(cl_outbox_info)clReleaseMemObject(cl_outbox_info);
+    if(cl_outbox_state)clReleaseMemObject(cl_outbox_state);
+    if(cl_inbox_info)clReleaseMemObject(cl_inbox_info);
+    if(cl_inbox_state)clReleaseMemObject(cl_inbox_state);
+    if(cl_row_load)clReleaseMemObject(cl_row_load);
+    if(agent_ids)delete [] agent_ids;
+
+    if(cl_cell_counts)clReleaseMemObject(cl_cell_counts);
+    if(cl_cell_start)clReleaseMemObject(cl_cell_start);
+    if(cl_cell_agents)clReleaseMemObject(cl_cell_agents);
+    if(cl_agent_rank)clReleaseMemObject(cl_agent_rank);
+    if(cl_neighbour_offsets)clReleaseMemObject(cl_neighbour_offsets);
+    if(cl_neighbour_list)clReleaseMemObject(cl_neighbour_list);
+    if(cl_position_at_build)clReleaseMemObject(cl_position_at_build);
+    if(cl_displacement)clReleaseMemObject(cl_displacement);
+    if(cl_max_displacement)clReleaseMemObject(cl_max_displacement);
+    if(cl_neighbour_total)clReleaseMemObject(cl_neighbour_total);
+
     if(cxGPUContext)clReleaseContext(cxGPUContext);
+#ifdef CL_VERSION_1_2
+    for (cl_uint d = 0; d < no_sub_devices; d++)
+    {
+        clReleaseDevice(sub_devices[d]);
+    }
+#endif
     if(cPathAndName)free(cPathAndName);
     if(cSourceCL)free(cSourceCL);
+    if(cGridLayoutCL)free(cGridLayoutCL);
     if(cdDevices)delete(cdDevices);
 
     // finalize logs and leave
@@ -0,0 +1,311 @@
+// ! general purpose parallel building blocks, driven from primitives.cpp
+
+// PRIMITIVES_GROUP_SIZE is passed as a build option by init_primitives()
+#ifndef PRIMITIVES_GROUP_SIZE
+#define PRIMITIVES_GROUP_SIZE       256
+#endif
+
+#define SCAN_BLOCK                  (2 * PRIMITIVES_GROUP_SIZE)
+#define RADIX_BITS                  4
+#define RADIX                       (1 << RADIX_BITS)
+
+#define REDUCE_SUM                  0
+#define REDUCE_MIN                  1
+#define REDUCE_MAX                  2
+
+// one padding slot every 32 values keeps the tree accesses off the same bank
+#define LOCAL_INDEX(i)              ((i) + ((i) >> 5))
+#define LOCAL_SCAN_SIZE             (SCAN_BLOCK + (SCAN_BLOCK >> 5))
+
+/**
+ *  WORK-EFFICIENT (BLELLOCH) EXCLUSIVE SCAN
+ *  scans SCAN_BLOCK values held in local memory in place, returns their total
+ */
+int local_exclusive_scan(__local int* scan)
+{
+    int lid = get_local_id(0);
+    int offset = 1;
+
+    // up-sweep
+    for (int d = SCAN_BLOCK >> 1; d > 0; d >>= 1)
+    {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < d)
+        {
+            int ai = offset * (2 * lid + 1) - 1;
+            int bi = offset * (2 * lid + 2) - 1;
+            scan[LOCAL_INDEX(bi)] += scan[LOCAL_INDEX(ai)];
+        }
+        offset <<= 1;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int total = scan[LOCAL_INDEX(SCAN_BLOCK - 1)];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid == 0)
+    {
+        scan[LOCAL_INDEX(SCAN_BLOCK - 1)] = 0;
+    }
+
+    // down-sweep
+    for (int d = 1; d < SCAN_BLOCK; d <<= 1)
+    {
+        offset >>= 1;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < d)
+        {
+            int ai = offset * (2 * lid + 1) - 1;
+            int bi = offset * (2 * lid + 2) - 1;
+            int left = scan[LOCAL_INDEX(ai)];
+            scan[LOCAL_INDEX(ai)] = scan[LOCAL_INDEX(bi)];
+            scan[LOCAL_INDEX(bi)] += left;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    return total;
+}
+
+/* each group scans SCAN_BLOCK values and leaves its total in block_sums, in and out may alias */
+__kernel void scan_blocks(__global int* in, __global int* out, unsigned int n, __global int* block_sums)
+{
+    __local int scan[LOCAL_SCAN_SIZE];
+
+    int lid = get_local_id(0);
+    unsigned int base = get_group_id(0) * SCAN_BLOCK;
+    unsigned int a = lid;
+    unsigned int b = lid + PRIMITIVES_GROUP_SIZE;
+
+    scan[LOCAL_INDEX(a)] = (base + a < n) ? in[base + a] : 0;
+    scan[LOCAL_INDEX(b)] = (base + b < n) ? in[base + b] : 0;
+
+    int total = local_exclusive_scan(scan);
+
+    if (base + a < n)
+    {
+        out[base + a] = scan[LOCAL_INDEX(a)];
+    }
+    if (base + b < n)
+    {
+        out[base + b] = scan[LOCAL_INDEX(b)];
+    }
+    if (lid == 0)
+    {
+        block_sums[get_group_id(0)] = total;
+    }
+}
+
+/* adds the scanned block totals back to every value of their block */
+__kernel void add_block_offsets(__global int* out, unsigned int n, __global int* block_sums)
+{
+    int lid = get_local_id(0);
+    unsigned int base = get_group_id(0) * SCAN_BLOCK;
+    int offset = block_sums[get_group_id(0)];
+
+    if (base + lid < n)
+    {
+        out[base + lid] += offset;
+    }
+    if (base + lid + PRIMITIVES_GROUP_SIZE < n)
+    {
+        out[base + lid + PRIMITIVES_GROUP_SIZE] += offset;
+    }
+}
+
+/**
+ *  STREAM COMPACTION
+ *  offsets is the exclusive scan of the 0/1 flags, count receives the number of kept values
+ */
+__kernel void compact_scatter(__global int* flags, __global int* offsets, __global int* values,
+                              unsigned int n, __global int* out, __global int* count)
+{
+    unsigned int i = get_global_id(0);
+
+    if (i >= n)
+    {
+        return;
+    }
+
+    if (flags[i] != 0)
+    {
+        out[offsets[i]] = values[i];
+    }
+    if (i == n - 1)
+    {
+        count[0] = offsets[i] + (flags[i] != 0);
+    }
+}
+
+/**
+ *  KEY-VALUE RADIX SORT (LSD, RADIX_BITS per pass)
+ *  every group owns a tile of SCAN_BLOCK keys; histograms are stored digit-major
+ *  so that one exclusive scan over them gives each (digit, tile) its output offset
+ */
+__kernel void radix_histogram(__global uint* keys, unsigned int n, unsigned int shift, __global int* histograms)
+{
+    __local int histogram[RADIX];
+
+    int lid = get_local_id(0);
+    unsigned int base = get_group_id(0) * SCAN_BLOCK;
+
+    if (lid < RADIX)
+    {
+        histogram[lid] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (base + lid < n)
+    {
+        atomic_inc(&histogram[(keys[base + lid] >> shift) & (RADIX - 1)]);
+    }
+    if (base + lid + PRIMITIVES_GROUP_SIZE < n)
+    {
+        atomic_inc(&histogram[(keys[base + lid + PRIMITIVES_GROUP_SIZE] >> shift) & (RADIX - 1)]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid < RADIX)
+    {
+        histograms[lid * get_num_groups(0) + get_group_id(0)] = histogram[lid];
+    }
+}
+
+__kernel void radix_scatter(__global uint* keys_in, __global int* values_in,
+                            __global uint* keys_out, __global int* values_out,
+                            unsigned int n, unsigned int shift, __global int* histograms)
+{
+    __local uint keys[SCAN_BLOCK];
+    __local int  values[SCAN_BLOCK];
+    __local int  scan[LOCAL_SCAN_SIZE];
+    __local int  digit_start[RADIX];
+
+    int lid = get_local_id(0);
+    unsigned int base = get_group_id(0) * SCAN_BLOCK;
+    int a = lid;
+    int b = lid + PRIMITIVES_GROUP_SIZE;
+
+    // padding keys sort behind every real key of the tile
+    keys[a]   = (base + a < n) ? keys_in[base + a] : UINT_MAX;
+    values[a] = (base + a < n) ? values_in[base + a] : 0;
+    keys[b]   = (base + b < n) ? keys_in[base + b] : UINT_MAX;
+    values[b] = (base + b < n) ? values_in[base + b] : 0;
+
+    // stable local sort of the tile by the current digit, one 1-bit split per bit
+    for (unsigned int bit = shift; bit < shift + RADIX_BITS; bit++)
+    {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        uint key_a = keys[a];
+        uint key_b = keys[b];
+        int value_a = values[a];
+        int value_b = values[b];
+
+        scan[LOCAL_INDEX(a)] = !((key_a >> bit) & 1);
+        scan[LOCAL_INDEX(b)] = !((key_b >> bit) & 1);
+
+        int zeros = local_exclusive_scan(scan);
+
+        int destination_a = ((key_a >> bit) & 1) ? zeros + a - scan[LOCAL_INDEX(a)] : scan[LOCAL_INDEX(a)];
+        int destination_b = ((key_b >> bit) & 1) ? zeros + b - scan[LOCAL_INDEX(b)] : scan[LOCAL_INDEX(b)];
+
+        keys[destination_a]   = key_a;
+        values[destination_a] = value_a;
+        keys[destination_b]   = key_b;
+        values[destination_b] = value_b;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint digit_a = (keys[a] >> shift) & (RADIX - 1);
+    uint digit_b = (keys[b] >> shift) & (RADIX - 1);
+
+    if (a == 0 || digit_a != ((keys[a - 1] >> shift) & (RADIX - 1)))
+    {
+        digit_start[digit_a] = a;
+    }
+    if (digit_b != ((keys[b - 1] >> shift) & (RADIX - 1)))
+    {
+        digit_start[digit_b] = b;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // after the local sort the real keys occupy the front of the tile
+    if (base + a < n)
+    {
+        int destination = histograms[digit_a * get_num_groups(0) + get_group_id(0)] + a - digit_start[digit_a];
+        keys_out[destination]   = keys[a];
+        values_out[destination] = values[a];
+    }
+    if (base + b < n)
+    {
+        int destination = histograms[digit_b * get_num_groups(0) + get_group_id(0)] + b - digit_start[digit_b];
+        keys_out[destination]   = keys[b];
+        values_out[destination] = values[b];
+    }
+}
+
+/**
+ *  SEGMENTED REDUCE
+ *  one work-group per segment, segments are [offsets[s], offsets[s + 1])
+ */
+float reduce_identity(int op)
+{
+    return (op == REDUCE_MIN) ? FLT_MAX : ((op == REDUCE_MAX) ? -FLT_MAX : 0.0f);
+}
+
+float reduce_apply(float a, float b, int op)
+{
+    return (op == REDUCE_MIN) ? fmin(a, b) : ((op == REDUCE_MAX) ? fmax(a, b) : a + b);
+}
+
+float reduce_range(__global float* values, unsigned int begin, unsigned int end, int op, __local float* partial)
+{
+    int lid = get_local_id(0);
+    float value = reduce_identity(op);
+
+    for (unsigned int i = begin + lid; i < end; i += PRIMITIVES_GROUP_SIZE)
+    {
+        value = reduce_apply(value, values[i], op);
+    }
+    partial[lid] = value;
+
+    for (int stride = PRIMITIVES_GROUP_SIZE / 2; stride > 0; stride >>= 1)
+    {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < stride)
+        {
+            partial[lid] = reduce_apply(partial[lid], partial[lid + stride], op);
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    return partial[0];
+}
+
+__kernel void segmented_reduce(__global float* values, __global int* offsets, unsigned int no_segments,
+                               __global float* out, int op)
+{
+    __local float partial[PRIMITIVES_GROUP_SIZE];
+
+    unsigned int segment = get_group_id(0);
+    float value = reduce_range(values, offsets[segment], offsets[segment + 1], op, partial);
+
+    if (get_local_id(0) == 0)
+    {
+        out[segment] = value;
+    }
+}
+
+/* segments of a fixed length, used for the two levels of a full reduction */
+__kernel void reduce_chunks(__global float* values, unsigned int n, unsigned int chunk,
+                            __global float* out, int op)
+{
+    __local float partial[PRIMITIVES_GROUP_SIZE];
+
+    unsigned int begin = get_group_id(0) * chunk;
+    float value = reduce_range(values, begin, min(n, begin + chunk), op, partial);
+
+    if (get_local_id(0) == 0)
+    {
+        out[get_group_id(0)] = value;
+    }
+}
@@ -0,0 +1,486 @@
+#include "primitives.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <sys/time.h>
+
+extern void (*pCleanup)(int);
+
+#define SCAN_BLOCK          (2 * PRIMITIVES_GROUP_SIZE)
+#define RADIX_BITS          4
+#define MAX_SCAN_LEVELS     8
+#define MAX_REDUCE_GROUPS   256
+
+/**
+ *  SCRATCH BUFFERS
+ *  grown on demand and kept for the next call
+ */
+enum
+{
+    SCRATCH_COMPACT_OFFSETS = 0,
+    SCRATCH_SORT_KEYS,
+    SCRATCH_SORT_VALUES,
+    SCRATCH_SORT_HISTOGRAMS,
+    SCRATCH_REDUCE_PARTIALS,
+    SCRATCH_SCAN_LEVELS,
+    NO_SCRATCH = SCRATCH_SCAN_LEVELS + MAX_SCAN_LEVELS
+};
+
+static cl_context       cxPrimitivesContext;
+static cl_command_queue cqPrimitivesQueue;
+static cl_program       cpPrimitives;
+static cl_int           ciPrimitivesErrNum;
+
+static cl_mem scratch[NO_SCRATCH];
+static size_t scratch_size[NO_SCRATCH];
+
+static cl_kernel ckKernel_scan_blocks;
+static cl_kernel ckKernel_add_block_offsets;
+static cl_kernel ckKernel_compact_scatter;
+static cl_kernel ckKernel_radix_histogram;
+static cl_kernel ckKernel_radix_scatter;
+static cl_kernel ckKernel_segmented_reduce;
+static cl_kernel ckKernel_reduce_chunks;
+
+static cl_mem get_scratch(int slot, size_t size)
+{
+    if (scratch_size[slot] < size)
+    {
+        if (scratch[slot])
+        {
+            clReleaseMemObject(scratch[slot]);
+        }
+
+        scratch_size[slot] = std::max(size, 2 * scratch_size[slot]);
+        scratch[slot] = clCreateBuffer(cxPrimitivesContext, CL_MEM_READ_WRITE, scratch_size[slot], NULL, &ciPrimitivesErrNum);
+        shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+    }
+
+    return scratch[slot];
+}
+
+static unsigned int no_blocks(unsigned int n, unsigned int block)
+{
+    return (n + block - 1) / block;
+}
+
+void init_primitives(cl_context context, cl_device_id device, cl_command_queue queue, const char* executable_path)
+{
+    cxPrimitivesContext = context;
+    cqPrimitivesQueue   = queue;
+
+    size_t program_length;
+    char* cPrimitivesPath = shrFindFilePath("primitives.cl", executable_path);
+    shrCheckErrorEX(cPrimitivesPath != NULL, shrTRUE, pCleanup);
+    char* cPrimitivesSource = oclLoadProgSource(cPrimitivesPath, "", &program_length);
+    shrCheckErrorEX(cPrimitivesSource != NULL, shrTRUE, pCleanup);
+
+    cpPrimitives = clCreateProgramWithSource(context, 1, (const char **) &cPrimitivesSource, &program_length, &ciPrimitivesErrNum);
+    shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+
+    char options[128];
+    sprintf(options, "-cl-fast-relaxed-math -D PRIMITIVES_GROUP_SIZE=%d", PRIMITIVES_GROUP_SIZE);
+
+    ciPrimitivesErrNum = clBuildProgram(cpPrimitives, 1, &device, options, NULL, NULL);
+    if (ciPrimitivesErrNum != CL_SUCCESS)
+    {
+        shrLogEx(LOGBOTH | ERRORMSG, ciPrimitivesErrNum, STDERROR);
+        oclLogBuildInfo(cpPrimitives, device);
+        pCleanup(EXIT_FAILURE);
+    }
+
+    free(cPrimitivesPath);
+    free(cPrimitivesSource);
+
+    ckKernel_scan_blocks = clCreateKernel(cpPrimitives, "scan_blocks", &ciPrimitivesErrNum);
+    shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_add_block_offsets = clCreateKernel(cpPrimitives, "add_block_offsets", &ciPrimitivesErrNum);
+    shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_compact_scatter = clCreateKernel(cpPrimitives, "compact_scatter", &ciPrimitivesErrNum);
+    shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_radix_histogram = clCreateKernel(cpPrimitives, "radix_histogram", &ciPrimitivesErrNum);
+    shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_radix_scatter = clCreateKernel(cpPrimitives, "radix_scatter", &ciPrimitivesErrNum);
+    shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_segmented_reduce = clCreateKernel(cpPrimitives, "segmented_reduce", &ciPrimitivesErrNum);
+    shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+    ckKernel_reduce_chunks = clCreateKernel(cpPrimitives, "reduce_chunks", &ciPrimitivesErrNum);
+    shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+}
+
+void release_primitives()
+{
+    if(ckKernel_scan_blocks)        clReleaseKernel(ckKernel_scan_blocks);
+    if(ckKernel_add_block_offsets)  clReleaseKernel(ckKernel_add_block_offsets);
+    if(ckKernel_compact_scatter)    clReleaseKernel(ckKernel_compact_scatter);
+    if(ckKernel_radix_histogram)    clReleaseKernel(ckKernel_radix_histogram);
+    if(ckKernel_radix_scatter)      clReleaseKernel(ckKernel_radix_scatter);
+    if(ckKernel_segmented_reduce)   clReleaseKernel(ckKernel_segmented_reduce);
+    if(ckKernel_reduce_chunks)      clReleaseKernel(ckKernel_reduce_chunks);
+    if(cpPrimitives)                clReleaseProgram(cpPrimitives);
+
+    for (int i = 0; i < NO_SCRATCH; i++)
+    {
+        if(scratch[i])clReleaseMemObject(scratch[i]);
+        scratch[i] = NULL;
+        scratch_size[i] = 0;
+    }
+}
+
+/**
+ *  EXCLUSIVE SCAN
+ *  every level scans blocks of SCAN_BLOCK values and recurses on the block totals
+ */
+static void exclusive_scan_level(cl_mem in, cl_mem out, unsigned int n, int level)
+{
+    unsigned int blocks = no_blocks(n, SCAN_BLOCK);
+    size_t szLocalWorkSize[]  = {PRIMITIVES_GROUP_SIZE, 1};
+    size_t szGlobalWorkSize[] = {(size_t) blocks * PRIMITIVES_GROUP_SIZE, 1};
+
+    shrCheckErrorEX(level < MAX_SCAN_LEVELS, true, pCleanup);
+    cl_mem block_sums = get_scratch(SCRATCH_SCAN_LEVELS + level, blocks * sizeof(cl_int));
+
+    ciPrimitivesErrNum  = clSetKernelArg(ckKernel_scan_blocks, 0, sizeof(cl_mem), (void *) &in);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_scan_blocks, 1, sizeof(cl_mem), (void *) &out);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_scan_blocks, 2, sizeof(cl_uint), &n);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_scan_blocks, 3, sizeof(cl_mem), (void *) &block_sums);
+    ciPrimitivesErrNum |= clEnqueueNDRangeKernel(cqPrimitivesQueue, ckKernel_scan_blocks, 1, NULL, szGlobalWorkSize, szLocalWorkSize, 0, 0, 0);
+    shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+
+    if (blocks > 1)
+    {
+        exclusive_scan_level(block_sums, block_sums, blocks, level + 1);
+
+        ciPrimitivesErrNum  = clSetKernelArg(ckKernel_add_block_offsets, 0, sizeof(cl_mem), (void *) &out);
+        ciPrimitivesErrNum |= clSetKernelArg(ckKernel_add_block_offsets, 1, sizeof(cl_uint), &n);
+        ciPrimitivesErrNum |= clSetKernelArg(ckKernel_add_block_offsets, 2, sizeof(cl_mem), (void *) &block_sums);
+        ciPrimitivesErrNum |= clEnqueueNDRangeKernel(cqPrimitivesQueue, ckKernel_add_block_offsets, 1, NULL, szGlobalWorkSize, szLocalWorkSize, 0, 0, 0);
+        shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+    }
+}
+
+void primitives_exclusive_scan(cl_mem in, cl_mem out, unsigned int n)
+{
+    if (n > 0)
+    {
+        exclusive_scan_level(in, out, n, 0);
+    }
+}
+
+/**
+ *  STREAM COMPACTION
+ */
+void primitives_compact(cl_mem flags, cl_mem values, unsigned int n, cl_mem out, cl_mem count)
+{
+    if (n == 0)
+    {
+        static const cl_int zero = 0;
+        ciPrimitivesErrNum = clEnqueueWriteBuffer(cqPrimitivesQueue, count, CL_FALSE, 0, sizeof(cl_int), &zero, 0, NULL, NULL);
+        shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+        return;
+    }
+
+    cl_mem offsets = get_scratch(SCRATCH_COMPACT_OFFSETS, n * sizeof(cl_int));
+    primitives_exclusive_scan(flags, offsets, n);
+
+    size_t szLocalWorkSize[]  = {PRIMITIVES_GROUP_SIZE, 1};
+    size_t szGlobalWorkSize[] = {shrRoundUp(PRIMITIVES_GROUP_SIZE, n), 1};
+
+    ciPrimitivesErrNum  = clSetKernelArg(ckKernel_compact_scatter, 0, sizeof(cl_mem), (void *) &flags);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_compact_scatter, 1, sizeof(cl_mem), (void *) &offsets);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_compact_scatter, 2, sizeof(cl_mem), (void *) &values);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_compact_scatter, 3, sizeof(cl_uint), &n);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_compact_scatter, 4, sizeof(cl_mem), (void *) &out);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_compact_scatter, 5, sizeof(cl_mem), (void *) &count);
+    ciPrimitivesErrNum |= clEnqueueNDRangeKernel(cqPrimitivesQueue, ckKernel_compact_scatter, 1, NULL, szGlobalWorkSize, szLocalWorkSize, 0, 0, 0);
+    shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+}
+
+/**
+ *  KEY-VALUE RADIX SORT
+ *  ping-pongs between the caller's buffers and two scratch buffers, the result
+ *  always ends up back in keys / values
+ */
+void primitives_radix_sort(cl_mem keys, cl_mem values, unsigned int n, unsigned int key_bits)
+{
+    if (n <= 1)
+    {
+        return;
+    }
+
+    unsigned int tiles = no_blocks(n, SCAN_BLOCK);
+    unsigned int no_histograms = tiles << RADIX_BITS;
+    size_t szLocalWorkSize[]  = {PRIMITIVES_GROUP_SIZE, 1};
+    size_t szGlobalWorkSize[] = {(size_t) tiles * PRIMITIVES_GROUP_SIZE, 1};
+
+    cl_mem keys_tmp   = get_scratch(SCRATCH_SORT_KEYS, n * sizeof(cl_uint));
+    cl_mem values_tmp = get_scratch(SCRATCH_SORT_VALUES, n * sizeof(cl_int));
+    cl_mem histograms = get_scratch(SCRATCH_SORT_HISTOGRAMS, no_histograms * sizeof(cl_int));
+
+    cl_mem keys_in    = keys;
+    cl_mem values_in  = values;
+    cl_mem keys_out   = keys_tmp;
+    cl_mem values_out = values_tmp;
+
+    for (unsigned int shift = 0; shift < key_bits; shift += RADIX_BITS)
+    {
+        ciPrimitivesErrNum  = clSetKernelArg(ckKernel_radix_histogram, 0, sizeof(cl_mem), (void *) &keys_in);
+        ciPrimitivesErrNum |= clSetKernelArg(ckKernel_radix_histogram, 1, sizeof(cl_uint), &n);
+        ciPrimitivesErrNum |= clSetKernelArg(ckKernel_radix_histogram, 2, sizeof(cl_uint), &shift);
+        ciPrimitivesErrNum |= clSetKernelArg(ckKernel_radix_histogram, 3, sizeof(cl_mem), (void *) &histograms);
+        ciPrimitivesErrNum |= clEnqueueNDRangeKernel(cqPrimitivesQueue, ckKernel_radix_histogram, 1, NULL, szGlobalWorkSize, szLocalWorkSize, 0, 0, 0);
+        shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+
+        primitives_exclusive_scan(histograms, histograms, no_histograms);
+
+        ciPrimitivesErrNum  = clSetKernelArg(ckKernel_radix_scatter, 0, sizeof(cl_mem), (void *) &keys_in);
+        ciPrimitivesErrNum |= clSetKernelArg(ckKernel_radix_scatter, 1, sizeof(cl_mem), (void *) &values_in);
+        ciPrimitivesErrNum |= clSetKernelArg(ckKernel_radix_scatter, 2, sizeof(cl_mem), (void *) &keys_out);
+        ciPrimitivesErrNum |= clSetKernelArg(ckKernel_radix_scatter, 3, sizeof(cl_mem), (void *) &values_out);
+        ciPrimitivesErrNum |= clSetKernelArg(ckKernel_radix_scatter, 4, sizeof(cl_uint), &n);
+        ciPrimitivesErrNum |= clSetKernelArg(ckKernel_radix_scatter, 5, sizeof(cl_uint), &shift);
+        ciPrimitivesErrNum |= clSetKernelArg(ckKernel_radix_scatter, 6, sizeof(cl_mem), (void *) &histograms);
+        ciPrimitivesErrNum |= clEnqueueNDRangeKernel(cqPrimitivesQueue, ckKernel_radix_scatter, 1, NULL, szGlobalWorkSize, szLocalWorkSize, 0, 0, 0);
+        shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+
+        std::swap(keys_in, keys_out);
+        std::swap(values_in, values_out);
+    }
+
+    // an odd number of passes leaves the result in the scratch pair
+    if (keys_in != keys)
+    {
+        ciPrimitivesErrNum  = clEnqueueCopyBuffer(cqPrimitivesQueue, keys_in, keys, 0, 0, n * sizeof(cl_uint), 0, NULL, NULL);
+        ciPrimitivesErrNum |= clEnqueueCopyBuffer(cqPrimitivesQueue, values_in, values, 0, 0, n * sizeof(cl_int), 0, NULL, NULL);
+        shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+    }
+}
+
+/**
+ *  REDUCTIONS
+ */
+void primitives_segmented_reduce(cl_mem values, cl_mem offsets, unsigned int no_segments, cl_mem out, int op)
+{
+    if (no_segments == 0)
+    {
+        return;
+    }
+
+    size_t szLocalWorkSize[]  = {PRIMITIVES_GROUP_SIZE, 1};
+    size_t szGlobalWorkSize[] = {(size_t) no_segments * PRIMITIVES_GROUP_SIZE, 1};
+
+    ciPrimitivesErrNum  = clSetKernelArg(ckKernel_segmented_reduce, 0, sizeof(cl_mem), (void *) &values);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_segmented_reduce, 1, sizeof(cl_mem), (void *) &offsets);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_segmented_reduce, 2, sizeof(cl_uint), &no_segments);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_segmented_reduce, 3, sizeof(cl_mem), (void *) &out);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_segmented_reduce, 4, sizeof(cl_int), &op);
+    ciPrimitivesErrNum |= clEnqueueNDRangeKernel(cqPrimitivesQueue, ckKernel_segmented_reduce, 1, NULL, szGlobalWorkSize, szLocalWorkSize, 0, 0, 0);
+    shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+}
+
+static void reduce_chunks(cl_mem values, unsigned int n, unsigned int chunk, cl_mem out, int op)
+{
+    size_t szLocalWorkSize[]  = {PRIMITIVES_GROUP_SIZE, 1};
+    size_t szGlobalWorkSize[] = {(size_t) no_blocks(n, chunk) * PRIMITIVES_GROUP_SIZE, 1};
+
+    ciPrimitivesErrNum  = clSetKernelArg(ckKernel_reduce_chunks, 0, sizeof(cl_mem), (void *) &values);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_reduce_chunks, 1, sizeof(cl_uint), &n);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_reduce_chunks, 2, sizeof(cl_uint), &chunk);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_reduce_chunks, 3, sizeof(cl_mem), (void *) &out);
+    ciPrimitivesErrNum |= clSetKernelArg(ckKernel_reduce_chunks, 4, sizeof(cl_int), &op);
+    ciPrimitivesErrNum |= clEnqueueNDRangeKernel(cqPrimitivesQueue, ckKernel_reduce_chunks, 1, NULL, szGlobalWorkSize, szLocalWorkSize, 0, 0, 0);
+    shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+}
+
+void primitives_reduce(cl_mem values, unsigned int n, cl_mem out, int op)
+{
+    if (n == 0)
+    {
+        // reduce_identity() of primitives.cl, per op
+        static const cl_float identity[] = {0.0f, FLT_MAX, -FLT_MAX};
+        ciPrimitivesErrNum = clEnqueueWriteBuffer(cqPrimitivesQueue, out, CL_FALSE, 0, sizeof(cl_float), &identity[op], 0, NULL, NULL);
+        shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+        return;
+    }
+
+    // at most MAX_REDUCE_GROUPS partials, then a single group folds them
+    unsigned int chunk = shrRoundUp(PRIMITIVES_GROUP_SIZE, std::max(1u, no_blocks(n, MAX_REDUCE_GROUPS)));
+    unsigned int no_partials = std::max(1u, no_blocks(n, chunk));
+
+    cl_mem partials = get_scratch(SCRATCH_REDUCE_PARTIALS, no_partials * sizeof(cl_float));
+
+    reduce_chunks(values, n, chunk, partials, op);
+    reduce_chunks(partials, no_partials, no_partials, out, op);
+}
+
+/**
+ *  MICROBENCHMARKS
+ *  ran with the "benchmark" command line flag
+ */
+#define BENCHMARK_REPETITIONS   20
+
+static double elapsed_ms(struct timeval* begin, struct timeval* end)
+{
+    return (end->tv_sec - begin->tv_sec) * 1000.0 + (end->tv_usec - begin->tv_usec) / 1000.0;
+}
+
+static void log_benchmark(const char* name, unsigned int n, double ms, bool passed)
+{
+    shrLog("%-18s n = %9u : %8.3f ms, %9.2f Melements/s  %s\n", name, n, ms, n / (ms * 1000.0), passed ? "PASSED" : "FAILED");
+}
+
+void benchmark_primitives()
+{
+    struct timeval begin, end;
+
+    shrLog("\nParallel primitives, %d repetitions per size\n", BENCHMARK_REPETITIONS);
+
+    for (unsigned int n = 1 << 10; n <= (1 << 22); n <<= 2)
+    {
+        std::vector<cl_int>   flags(n), ints(n), ints_out(n);
+        std::vector<cl_uint>  keys(n), keys_out(n);
+        std::vector<cl_float> floats(n);
+
+        srand(n);
+        for (unsigned int i = 0; i < n; i++)
+        {
+            flags[i]  = rand() & 1;
+            ints[i]   = i;
+            keys[i]   = ((cl_uint) rand() << 16) ^ (cl_uint) rand();
+            floats[i] = (float) rand() / RAND_MAX;
+        }
+
+        cl_mem cl_flags  = clCreateBuffer(cxPrimitivesContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, n * sizeof(cl_int), &flags[0], &ciPrimitivesErrNum);
+        cl_mem cl_ints   = clCreateBuffer(cxPrimitivesContext, CL_MEM_READ_WRITE, n * sizeof(cl_int), NULL, &ciPrimitivesErrNum);
+        cl_mem cl_keys   = clCreateBuffer(cxPrimitivesContext, CL_MEM_READ_WRITE, n * sizeof(cl_uint), NULL, &ciPrimitivesErrNum);
+        cl_mem cl_floats = clCreateBuffer(cxPrimitivesContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, n * sizeof(cl_float), &floats[0], &ciPrimitivesErrNum);
+        cl_mem cl_out    = clCreateBuffer(cxPrimitivesContext, CL_MEM_READ_WRITE, n * sizeof(cl_int), NULL, &ciPrimitivesErrNum);
+        cl_mem cl_count  = clCreateBuffer(cxPrimitivesContext, CL_MEM_READ_WRITE, sizeof(cl_int), NULL, &ciPrimitivesErrNum);
+        shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+
+        // exclusive scan
+        primitives_exclusive_scan(cl_flags, cl_out, n);
+        clFinish(cqPrimitivesQueue);
+        gettimeofday(&begin, NULL);
+        for (int r = 0; r < BENCHMARK_REPETITIONS; r++)
+        {
+            primitives_exclusive_scan(cl_flags, cl_out, n);
+        }
+        clFinish(cqPrimitivesQueue);
+        gettimeofday(&end, NULL);
+
+        clEnqueueReadBuffer(cqPrimitivesQueue, cl_out, CL_TRUE, 0, n * sizeof(cl_int), &ints_out[0], 0, NULL, NULL);
+        bool passed = true;
+        for (unsigned int i = 0, sum = 0; i < n; sum += flags[i], i++)
+        {
+            passed &= (ints_out[i] == (cl_int) sum);
+        }
+        log_benchmark("exclusive scan", n, elapsed_ms(&begin, &end) / BENCHMARK_REPETITIONS, passed);
+
+        // stream compaction
+        clEnqueueWriteBuffer(cqPrimitivesQueue, cl_ints, CL_TRUE, 0, n * sizeof(cl_int), &ints[0], 0, NULL, NULL);
+        gettimeofday(&begin, NULL);
+        for (int r = 0; r < BENCHMARK_REPETITIONS; r++)
+        {
+            primitives_compact(cl_flags, cl_ints, n, cl_out, cl_count);
+        }
+        clFinish(cqPrimitivesQueue);
+        gettimeofday(&end, NULL);
+
+        cl_int count;
+        clEnqueueReadBuffer(cqPrimitivesQueue, cl_count, CL_TRUE, 0, sizeof(cl_int), &count, 0, NULL, NULL);
+        clEnqueueReadBuffer(cqPrimitivesQueue, cl_out, CL_TRUE, 0, n * sizeof(cl_int), &ints_out[0], 0, NULL, NULL);
+        passed = true;
+        cl_int kept = 0;
+        for (unsigned int i = 0; i < n; i++)
+        {
+            if (flags[i])
+            {
+                passed &= (ints_out[kept++] == (cl_int) i);
+            }
+        }
+        passed &= (count == kept);
+        log_benchmark("stream compaction", n, elapsed_ms(&begin, &end) / BENCHMARK_REPETITIONS, passed);
+
+        // key-value radix sort, every repetition sorts the same unsorted input
+        double sort_ms = 0.0;
+        for (int r = 0; r < BENCHMARK_REPETITIONS; r++)
+        {
+            clEnqueueWriteBuffer(cqPrimitivesQueue, cl_keys, CL_FALSE, 0, n * sizeof(cl_uint), &keys[0], 0, NULL, NULL);
+            clEnqueueWriteBuffer(cqPrimitivesQueue, cl_ints, CL_FALSE, 0, n * sizeof(cl_int), &ints[0], 0, NULL, NULL);
+            clFinish(cqPrimitivesQueue);
+
+            gettimeofday(&begin, NULL);
+            primitives_radix_sort(cl_keys, cl_ints, n, 32);
+            clFinish(cqPrimitivesQueue);
+            gettimeofday(&end, NULL);
+            sort_ms += elapsed_ms(&begin, &end);
+        }
+
+        clEnqueueReadBuffer(cqPrimitivesQueue, cl_keys, CL_TRUE, 0, n * sizeof(cl_uint), &keys_out[0], 0, NULL, NULL);
+        clEnqueueReadBuffer(cqPrimitivesQueue, cl_ints, CL_TRUE, 0, n * sizeof(cl_int), &ints_out[0], 0, NULL, NULL);
+        passed = true;
+        for (unsigned int i = 0; i < n; i++)
+        {
+            passed &= (keys_out[i] == keys[ints_out[i]]);
+            passed &= (i == 0 || keys_out[i - 1] < keys_out[i] || (keys_out[i - 1] == keys_out[i] && ints_out[i - 1] < ints_out[i]));
+        }
+        log_benchmark("radix sort (kv)", n, sort_ms / BENCHMARK_REPETITIONS, passed);
+
+        // segmented reduce over segments of 1..64 values
+        std::vector<cl_int> offsets(1, 0);
+        while (offsets.back() < (cl_int) n)
+        {
+            offsets.push_back(std::min((cl_int) n, offsets.back() + 1 + (rand() & 63)));
+        }
+        unsigned int no_segments = offsets.size() - 1;
+        std::vector<cl_float> sums(no_segments);
+
+        cl_mem cl_offsets = clCreateBuffer(cxPrimitivesContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, offsets.size() * sizeof(cl_int), &offsets[0], &ciPrimitivesErrNum);
+        shrCheckErrorEX(ciPrimitivesErrNum, CL_SUCCESS, pCleanup);
+
+        gettimeofday(&begin, NULL);
+        for (int r = 0; r < BENCHMARK_REPETITIONS; r++)
+        {
+            primitives_segmented_reduce(cl_floats, cl_offsets, no_segments, cl_out, REDUCE_SUM);
+        }
+        clFinish(cqPrimitivesQueue);
+        gettimeofday(&end, NULL);
+
+        clEnqueueReadBuffer(cqPrimitivesQueue, cl_out, CL_TRUE, 0, no_segments * sizeof(cl_float), &sums[0], 0, NULL, NULL);
+        passed = true;
+        for (unsigned int s = 0; s < no_segments; s++)
+        {
+            float sum = 0.0f;
+            for (int i = offsets[s]; i < offsets[s + 1]; i++)
+            {
+                sum += floats[i];
+            }
+            passed &= fabs(sum - sums[s]) <= 1e-4f * (offsets[s + 1] - offsets[s] + 1);
+        }
+        log_benchmark("segmented reduce", n, elapsed_ms(&begin, &end) / BENCHMARK_REPETITIONS, passed);
+
+        // full reduction
+        gettimeofday(&begin, NULL);
+        for (int r = 0; r < BENCHMARK_REPETITIONS; r++)
+        {
+            primitives_reduce(cl_floats, n, cl_out, REDUCE_MAX);
+        }
+        clFinish(cqPrimitivesQueue);
+        gettimeofday(&end, NULL);
+
+        cl_float maximum;
+        clEnqueueReadBuffer(cqPrimitivesQueue, cl_out, CL_TRUE, 0, sizeof(cl_float), &maximum, 0, NULL, NULL);
+        log_benchmark("reduce (max)", n, elapsed_ms(&begin, &end) / BENCHMARK_REPETITIONS, maximum == *std::max_element(floats.begin(), floats.end()));
+
+        clReleaseMemObject(cl_offsets);
+        clReleaseMemObject(cl_flags);
+        clReleaseMemObject(cl_ints);
+        clReleaseMemObject(cl_keys);
+        clReleaseMemObject(cl_floats);
+        clReleaseMemObject(cl_out);
+        clReleaseMemObject(cl_count);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef PRIMITIVES_H_INCLUDED
+#define PRIMITIVES_H_INCLUDED
+
+#include <oclUtils.h>
+
+/**
+ *  PARALLEL PRIMITIVES
+ *  host side of primitives.cl; every call is enqueued on the queue given to
+ *  init_primitives() and returns without waiting, scratch memory is owned here
+ */
+#define PRIMITIVES_GROUP_SIZE   256
+
+#define REDUCE_SUM              0
+#define REDUCE_MIN              1
+#define REDUCE_MAX              2
+
+void init_primitives(cl_context context, cl_device_id device, cl_command_queue queue, const char* executable_path);
+void release_primitives();
+
+// exclusive prefix sum of n ints, in and out may be the same buffer
+void primitives_exclusive_scan(cl_mem in, cl_mem out, unsigned int n);
+
+// stable sort of n uint keys carrying int values, only the low key_bits bits are sorted
+void primitives_radix_sort(cl_mem keys, cl_mem values, unsigned int n, unsigned int key_bits);
+
+// out[s] = op over values[offsets[s] .. offsets[s + 1]), offsets holds no_segments + 1 ints
+void primitives_segmented_reduce(cl_mem values, cl_mem offsets, unsigned int no_segments, cl_mem out, int op);
+
+// out[0] = op over the n float values, the op's identity for n = 0
+void primitives_reduce(cl_mem values, unsigned int n, cl_mem out, int op);
+
+// out gets values[i] for every flags[i] == 1 in order, count[0] the number kept
+void primitives_compact(cl_mem flags, cl_mem values, unsigned int n, cl_mem out, cl_mem count);
+
+// per-primitive timings and checks against a host reference
+void benchmark_primitives();
+
+#endif // PRIMITIVES_H_INCLUDED
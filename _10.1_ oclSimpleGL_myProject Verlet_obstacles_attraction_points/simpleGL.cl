@@ -1,34 +1,160 @@
 // ! entities are POINTS
+// ! grid_layout.h is prepended to this source, every grid buffer is indexed with grid_index()
+// ! a constant under #ifndef may be set per world, createSimulationProgram() passes it as a build option
 
-#define BACK_OFF                    0.005
 //#define BOUNCING_SPEED_MODIFIER     0.95
+#ifndef GRAVITATIONAL_FORCE
 #define GRAVITATIONAL_FORCE         0.005
+#endif
+#ifndef ATTRACTION_FORCE
 #define ATTRACTION_FORCE            0.005
+#endif
+#ifndef ARRIVAL_DISTANCE
+#define ARRIVAL_DISTANCE            0.01
+#endif
 
-__kernel void labirinth(__global float2* pos, __global float2* target,
-                        __global int* matrix_x, __global int* matrix_y,
-                        __global int* neighbours_x, __global int* neighbours_y,
-                        __global float* lookahead_x, __global float* lookahead_y,
-                        __global int* activated)
+// two agents in adjacent cells are always closer than LIMIT_PROXIMITY on both axes
+#ifndef LIMIT_PROXIMITY
+#define LIMIT_PROXIMITY             0.02
+#endif
+// NEIGHBOUR_SKIN is always passed, the host rebuilds the lists by it
+#ifndef NEIGHBOUR_SKIN
+#define NEIGHBOUR_SKIN              0.02
+#endif
+#define NEIGHBOUR_SEARCH_CELLS      ((int) ((LIMIT_PROXIMITY + NEIGHBOUR_SKIN) * 100 + .999))
+
+// walls are felt closer than WALL_RANGE, the push out of a wall is WALL_REPULSION per step
+#ifndef WALL_RANGE
+#define WALL_RANGE                  0.03
+#endif
+#ifndef WALL_REPULSION
+#define WALL_REPULSION              0.0005
+#endif
+
+/* bilinear sample of the signed distance field, cell centres sit on whole cell coordinates */
+float4 sample_distance_field(__global float4* distance_field, float2 position)
 {
-    unsigned int gid = get_global_id(0);
+    float u = clamp(position.x * 100 + 96, 0.0f, GRID_SIDE - 1.0f);
+    float v = clamp(position.y * 100 + 96, 0.0f, GRID_SIDE - 1.0f);
+
+    int x = min((int) u, GRID_SIDE - 2);
+    int y = min((int) v, GRID_SIDE - 2);
+    float fx = u - x;
+    float fy = v - y;
+
+    float4 bottom = mix(distance_field[grid_index(x, y)], distance_field[grid_index(x + 1, y)], fx);
+    float4 top    = mix(distance_field[grid_index(x, y + 1)], distance_field[grid_index(x + 1, y + 1)], fx);
+
+    return mix(bottom, top, fy);
+}
+
+/**
+ *  AGENT STATE
+ *  position and velocity, which every step writes, stay full floats; the rest is
+ *  packed: the target as two 16 bit coordinates (grid_pack_point() on the host), the
+ *  colour as RGBA8 and the step multiplier as a byte
+ */
+float2 agent_target(__global uint* target, int gid)
+{
+    uint packed = target[gid];
+
+    return (float2) (grid_dequantise(packed & 0xffff), grid_dequantise(packed >> 16));
+}
+
+/* with FIXED_POSITIONS the positions are grid_fix() coordinates, see grid_layout.h */
+#ifdef FIXED_POSITIONS
+typedef short2 position_t;
+#else
+typedef float2 position_t;
+#endif
+
+float2 agent_position(__global position_t* pos, int gid)
+{
+#ifdef FIXED_POSITIONS
+    short2 fixed = pos[gid];
+
+    return (float2) (grid_unfix(fixed.x), grid_unfix(fixed.y));
+#else
+    return pos[gid];
+#endif
+}
+
+void store_position(__global position_t* pos, int gid, float2 position)
+{
+#ifdef FIXED_POSITIONS
+    pos[gid] = (short2) ((short) grid_fix(position.x), (short) grid_fix(position.y));
+#else
+    pos[gid] = position;
+#endif
+}
+
+/* grid cell of an agent, a shift of the stored coordinates for fixed-point positions */
+int2 agent_cell(__global position_t* pos, int gid)
+{
+#ifdef FIXED_POSITIONS
+    return (int2) (grid_fixed_cell(pos[gid].x), grid_fixed_cell(pos[gid].y));
+#else
+    return (int2) (grid_cell(pos[gid].x), grid_cell(pos[gid].y));
+#endif
+}
+
+/* moves an agent by step and returns where it ended; a fixed-point position adds the
+   step rounded to whole units, so the sum is exact and the same on every device */
+float2 move_agent(__global position_t* pos, int gid, float2 step)
+{
+#ifdef FIXED_POSITIONS
+    int2 moved = convert_int2(pos[gid]) + convert_int2_rte(step * (100.0f * GRID_FIXED_ONE));
+
+    pos[gid] = convert_short2_sat(moved);
+#else
+    pos[gid] += step;
+#endif
+
+    return agent_position(pos, gid);
+}
 
-    float2 current_point = (float2) pos[gid];
+/* an agent that sits on its target is frozen and dropped from the active list */
+int agent_arrived(float2 position, float2 target)
+{
+    return fabs(target.x - position.x) <= ARRIVAL_DISTANCE && fabs(target.y - position.y) <= ARRIVAL_DISTANCE;
+}
+
+/* direction away from the nearest wall and how strongly it is felt, 0 outside WALL_RANGE up to 1 on the wall */
+float wall_normal(float4 field, float2* normal)
+{
+    float normal_length = max(sqrt(field.y * field.y + field.z * field.z), 1e-6f);
+
+    *normal = (float2) (field.y / normal_length, field.z / normal_length);
+
+    return clamp((float) ((WALL_RANGE - field.x) / WALL_RANGE), 0.0f, 1.0f);
+}
 
-    int point_x = (int) (current_point.x * 100 + 96 + .5);
-    int point_y = (int) (current_point.y * 100 + 96 + .5);
+/* the part of step that goes into the wall, scaled by the wall proximity */
+float2 into_wall(float2 step, float2 normal, float wall)
+{
+    return min(step.x * normal.x + step.y * normal.y, 0.0f) * wall * normal;
+}
 
-    int point_x_in_matrix = 193 * point_y + point_x;
-    int point_y_in_matrix = 193 * point_x + point_y;
+/**
+ *   FOLLOW THE TARGET & AVOID OBSTACLES
+ *   the step an agent would take on its own; near a wall it loses its part going
+ *   into the wall, and a wall holding an activated obstacle end makes it slide
+ *   along towards that end
+ */
+float2 preferred_step(float2 current_point, float2 current_target, __global float4* distance_field,
+                      __global float* obstacle_range, __global int* obstacle_activation)
+{
+    float2 normal;
+    float wall = wall_normal(sample_distance_field(distance_field, current_point), &normal);
 
-//    float start_point_x = lookahead_x[2 * point_x_in_matrix];
-//    float end_point_x   = lookahead_x[2 * point_x_in_matrix + 1];
+    // nearest wall of the cell, id 0 is an empty obstacle with both ends inactive
+    int obstacle = (int) distance_field[grid_index(grid_cell(current_point.x), grid_cell(current_point.y))].w;
 
-    float start_point_y = lookahead_y[2 * point_y_in_matrix];
-    float end_point_y   = lookahead_y[2 * point_y_in_matrix + 1];
+    float start_point_y = obstacle_range[2 * obstacle];
+    float end_point_y   = obstacle_range[2 * obstacle + 1];
 
-    int activated_start_point = activated[2 * point_y_in_matrix];
-    int activated_end_point   = activated[2 * point_y_in_matrix + 1];
+    int activated_start_point = obstacle_activation[2 * obstacle];
+    int activated_end_point   = obstacle_activation[2 * obstacle + 1];
 
     /* here, there are only y coordinates */
     float obstacle_attraction_start_y = fabs(start_point_y - current_point.y) * activated_start_point;
@@ -39,87 +165,1561 @@ __kernel void labirinth(__global float2* pos, __global float2* target,
     int sign_obstacle_attraction_down = ((obstacle_attraction_start_y >= obstacle_attraction_end_y) * activated_end_point * activated_start_point)
                                     || (activated_end_point != 0 && activated_start_point == 0);
 
-    int down    = point_y_in_matrix - 1;
-    int up      = point_y_in_matrix + 1;
-    int left    = point_x_in_matrix - 1;
-    int right   = point_x_in_matrix + 1;
+    // both ways, an agent pushed past its target by the avoidance has to come back
+    float sign_x = sign(current_target.x - current_point.x);
+    float sign_y = sign(current_target.y - current_point.y);
+
+    float2 step = (float2) (0.001f * sign_x, 0.001f * sign_y);
+
+    // held by a wall, the agent slides along it towards its activated end
+    int attracted = (wall > 0.0f) && (sign_obstacle_attraction_up || sign_obstacle_attraction_down);
+    step.y = attracted ? 0.001f * (sign_obstacle_attraction_down - sign_obstacle_attraction_up) : step.y;
+
+    return step - into_wall(step, normal, wall);
+}
+
+/**
+ *  LEVEL OF DETAIL
+ *  every cell is micro (ORCA against the neighbours) or macro (walks the continuum
+ *  potential). Focus cells stay micro; elsewhere a cell turns macro above
+ *  LOD_DENSE_DENSITY agents and only turns back below LOD_SPARSE_DENSITY, so a
+ *  crowd near one threshold does not flip every frame
+ */
+#define LOD_MACRO                   0
+#define LOD_MICRO                   1
+#ifndef LOD_SPARSE_DENSITY
+#define LOD_SPARSE_DENSITY          0.3f
+#endif
+#ifndef LOD_DENSE_DENSITY
+#define LOD_DENSE_DENSITY           0.6f
+#endif
+// an agent this close to a micro cell is micro as well, its ORCA neighbours then avoid it in return;
+// lists are built a little wider, for agents that reach the band before the next rebuild
+#define LOD_HAND_OFF_CELLS          ((int) (LIMIT_PROXIMITY * 100 + .999))
+#define LOD_LIST_CELLS              (LOD_HAND_OFF_CELLS + (int) (NEIGHBOUR_SKIN * 50 + .999))
+
+__kernel void update_lod(__global float4* density, __global uchar* focus, __global uchar* lod, __global int* lod_changed)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= GRID_CELLS)
+    {
+        return;
+    }
+
+    int cell = grid_index(gid % GRID_SIDE, gid / GRID_SIDE);
+    int level = lod[cell];
+    float cell_density = density[cell].x;
+
+    int next = focus[cell] ? LOD_MICRO
+             : ((level == LOD_MICRO) ? ((cell_density > LOD_DENSE_DENSITY) ? LOD_MACRO : LOD_MICRO)
+                                     : ((cell_density < LOD_SPARSE_DENSITY) ? LOD_MICRO : LOD_MACRO));
+
+    if (next != level)
+    {
+        lod[cell] = next;
+        lod_changed[0] = 1;
+    }
+}
+
+/* whether a micro cell lies within reach cells of the agent */
+int agent_is_micro(__global uchar* lod, float2 position, int reach)
+{
+    int point_x = grid_cell(position.x);
+    int point_y = grid_cell(position.y);
+    int micro = 0;
+
+    for (int y = max(point_y - reach, 0); y <= min(point_y + reach, GRID_SIDE - 1); y++)
+    {
+        for (int x = max(point_x - reach, 0); x <= min(point_x + reach, GRID_SIDE - 1); x++)
+        {
+            micro |= lod[grid_index(x, y)];
+        }
+    }
+
+    return micro;
+}
+
+/**
+ *  ORCA (OPTIMAL RECIPROCAL COLLISION AVOIDANCE)
+ *  every one of the ORCA_MAX_NEIGHBOURS nearest neighbours gives a half-plane of
+ *  velocities that stay collision free for ORCA_TIME_HORIZON steps when both agents
+ *  take half of the avoidance; the velocity closest to the preferred step inside all
+ *  half-planes and the ORCA_MAX_SPEED disc is found with an incremental 2D linear
+ *  program. Velocities are in world units per step.
+ */
+#ifndef ORCA_MAX_NEIGHBOURS
+#define ORCA_MAX_NEIGHBOURS         10
+#endif
+#ifndef ORCA_RADIUS
+#define ORCA_RADIUS                 0.005f
+#endif
+#ifndef ORCA_TIME_HORIZON
+#define ORCA_TIME_HORIZON           10.0f
+#endif
+#ifndef ORCA_MAX_SPEED
+#define ORCA_MAX_SPEED              0.0015f
+#endif
+#define ORCA_EPSILON                1e-5f
+
+float det2(float2 a, float2 b)
+{
+    return a.x * b.y - a.y * b.x;
+}
+
+/* optimum on line line_no subject to the lines before it and the speed disc, 0 when infeasible */
+int orca_program1(float2* points, float2* directions, int line_no, float radius, float2 optimal,
+                  int direction_optimal, float2* result)
+{
+    float dot_product = dot(points[line_no], directions[line_no]);
+    float discriminant = dot_product * dot_product + radius * radius - dot(points[line_no], points[line_no]);
+
+    if (discriminant < 0.0f)
+    {
+        return 0;
+    }
+
+    float sqrt_discriminant = sqrt(discriminant);
+    float t_left  = -dot_product - sqrt_discriminant;
+    float t_right = -dot_product + sqrt_discriminant;
+
+    for (int i = 0; i < line_no; i++)
+    {
+        float denominator = det2(directions[line_no], directions[i]);
+        float numerator   = det2(directions[i], points[line_no] - points[i]);
+
+        if (fabs(denominator) <= ORCA_EPSILON)
+        {
+            // parallel lines, either line_no is outside line i or line i adds nothing
+            if (numerator < 0.0f)
+            {
+                return 0;
+            }
+            continue;
+        }
+
+        float t = numerator / denominator;
+
+        if (denominator >= 0.0f)
+        {
+            t_right = min(t_right, t);
+        }
+        else
+        {
+            t_left = max(t_left, t);
+        }
+
+        if (t_left > t_right)
+        {
+            return 0;
+        }
+    }
+
+    float t;
+    if (direction_optimal)
+    {
+        t = (dot(optimal, directions[line_no]) > 0.0f) ? t_right : t_left;
+    }
+    else
+    {
+        t = clamp(dot(directions[line_no], optimal - points[line_no]), t_left, t_right);
+    }
+    *result = points[line_no] + t * directions[line_no];
+
+    return 1;
+}
+
+/* returns the number of lines when it succeeded, otherwise the line it failed on */
+int orca_program2(float2* points, float2* directions, int no_lines, float radius, float2 optimal,
+                  int direction_optimal, float2* result)
+{
+    float optimal_length = length(optimal);
+
+    if (direction_optimal)
+    {
+        *result = optimal * radius;
+    }
+    else if (optimal_length > radius)
+    {
+        *result = optimal * (radius / optimal_length);
+    }
+    else
+    {
+        *result = optimal;
+    }
+
+    for (int i = 0; i < no_lines; i++)
+    {
+        if (det2(directions[i], points[i] - *result) > 0.0f)
+        {
+            float2 previous = *result;
+
+            if (!orca_program1(points, directions, i, radius, optimal, direction_optimal, result))
+            {
+                *result = previous;
+                return i;
+            }
+        }
+    }
+
+    return no_lines;
+}
+
+/* too crowded to satisfy every line, the velocity that violates the lines the least is taken */
+void orca_program3(float2* points, float2* directions, int no_lines, int first_line, float radius, float2* result)
+{
+    float2 projected_points[ORCA_MAX_NEIGHBOURS];
+    float2 projected_directions[ORCA_MAX_NEIGHBOURS];
+    float distance = 0.0f;
+
+    for (int i = first_line; i < no_lines; i++)
+    {
+        if (det2(directions[i], points[i] - *result) <= distance)
+        {
+            continue;
+        }
+
+        int no_projected = 0;
+
+        for (int j = 0; j < i; j++)
+        {
+            float determinant = det2(directions[i], directions[j]);
+
+            if (fabs(determinant) <= ORCA_EPSILON)
+            {
+                // same direction, line i already implies line j
+                if (dot(directions[i], directions[j]) > 0.0f)
+                {
+                    continue;
+                }
+                projected_points[no_projected] = 0.5f * (points[i] + points[j]);
+            }
+            else
+            {
+                projected_points[no_projected] = points[i] + (det2(directions[j], points[i] - points[j]) / determinant) * directions[i];
+            }
+            projected_directions[no_projected] = normalize(directions[j] - directions[i]);
+            no_projected++;
+        }
+
+        float2 previous = *result;
+        float2 away = (float2) (-directions[i].y, directions[i].x);
+
+        if (orca_program2(projected_points, projected_directions, no_projected, radius, away, 1, result) < no_projected)
+        {
+            // only rounding can fail here, the previous result is kept
+            *result = previous;
+        }
+
+        distance = det2(directions[i], points[i] - *result);
+    }
+}
+
+/* half-plane of agent velocities that avoid other, half of the needed change is left to other */
+void orca_line(float2 relative_position, float2 relative_velocity, float2 velocity, float2* point, float2* direction)
+{
+    float combined_radius = 2 * ORCA_RADIUS;
+    float distance2 = dot(relative_position, relative_position);
+    float2 u;
+
+    if (distance2 > combined_radius * combined_radius)
+    {
+        // vector from the cutoff centre to the relative velocity
+        float2 w = relative_velocity - relative_position / ORCA_TIME_HORIZON;
+        float w_length2 = dot(w, w);
+        float dot_product = dot(w, relative_position);
+
+        if (dot_product < 0.0f && dot_product * dot_product > combined_radius * combined_radius * w_length2)
+        {
+            // projected on the cutoff circle
+            float w_length = sqrt(w_length2);
+            float2 unit_w = w / w_length;
+
+            *direction = (float2) (unit_w.y, -unit_w.x);
+            u = (combined_radius / ORCA_TIME_HORIZON - w_length) * unit_w;
+        }
+        else
+        {
+            // projected on a leg of the cone
+            float leg = sqrt(distance2 - combined_radius * combined_radius);
+
+            if (det2(relative_position, w) > 0.0f)
+            {
+                *direction = (float2) (relative_position.x * leg - relative_position.y * combined_radius,
+                                       relative_position.x * combined_radius + relative_position.y * leg) / distance2;
+            }
+            else
+            {
+                *direction = -(float2) (relative_position.x * leg + relative_position.y * combined_radius,
+                                        -relative_position.x * combined_radius + relative_position.y * leg) / distance2;
+            }
+            u = dot(relative_velocity, *direction) * *direction - relative_velocity;
+        }
+    }
+    else
+    {
+        // already overlapping, separate within one step
+        float2 w = relative_velocity - relative_position;
+        float w_length = max(length(w), 1e-9f);
+        float2 unit_w = w / w_length;
+
+        *direction = (float2) (unit_w.y, -unit_w.x);
+        u = (combined_radius - w_length) * unit_w;
+    }
+
+    *point = velocity + 0.5f * u;
+}
+
+/**
+ *  AGENT VELOCITIES
+ *  the preferred step of every agent of the micro bucket corrected by ORCA against its
+ *  nearest neighbours; reads the velocities of the last step, labirinth applies the result
+ */
+__kernel void orca_velocities(__global position_t* pos, __global uint* target, __global float4* distance_field,
+                              __global float* obstacle_range, __global int* obstacle_activation,
+                              __global int* neighbour_offsets, __global int* neighbour_list,
+                              __global float2* velocity, __global float2* new_velocity,
+                              __global int* bucket_agents, int bucket_first, int bucket_size)
+{
+    unsigned int index = get_global_id(0);
+
+    if (index >= bucket_size)
+    {
+        return;
+    }
+
+    unsigned int gid = bucket_agents[bucket_first + index];
+
+    float2 current_point = agent_position(pos, gid);
+    float2 current_velocity = velocity[gid];
+
+    float2 preferred = preferred_step(current_point, agent_target(target, gid), distance_field, obstacle_range, obstacle_activation);
+
+    // the nearest neighbours closer than LIMIT_PROXIMITY, kept sorted by an insertion
+    float nearest_distance2[ORCA_MAX_NEIGHBOURS];
+    int   nearest[ORCA_MAX_NEIGHBOURS];
+    int   no_nearest = 0;
+
+    for (int k = neighbour_offsets[gid]; k < neighbour_offsets[gid + 1]; k++)
+    {
+        int other = neighbour_list[k];
+        float2 relative_position = agent_position(pos, other) - current_point;
+        float distance2 = dot(relative_position, relative_position);
+
+        if (distance2 >= LIMIT_PROXIMITY * LIMIT_PROXIMITY)
+        {
+            continue;
+        }
+        if (no_nearest == ORCA_MAX_NEIGHBOURS && distance2 >= nearest_distance2[ORCA_MAX_NEIGHBOURS - 1])
+        {
+            continue;
+        }
+
+        int slot = min(no_nearest, ORCA_MAX_NEIGHBOURS - 1);
+        while (slot > 0 && nearest_distance2[slot - 1] > distance2)
+        {
+            nearest_distance2[slot] = nearest_distance2[slot - 1];
+            nearest[slot] = nearest[slot - 1];
+            slot--;
+        }
+        nearest_distance2[slot] = distance2;
+        nearest[slot] = other;
+        no_nearest = min(no_nearest + 1, ORCA_MAX_NEIGHBOURS);
+    }
+
+    float2 points[ORCA_MAX_NEIGHBOURS];
+    float2 directions[ORCA_MAX_NEIGHBOURS];
+
+    for (int i = 0; i < no_nearest; i++)
+    {
+        int other = nearest[i];
+
+        orca_line(agent_position(pos, other) - current_point, current_velocity - velocity[other], current_velocity,
+                  &points[i], &directions[i]);
+    }
+
+    float2 result;
+    int failed_line = orca_program2(points, directions, no_nearest, ORCA_MAX_SPEED, preferred, 0, &result);
+
+    if (failed_line < no_nearest)
+    {
+        orca_program3(points, directions, no_nearest, failed_line, ORCA_MAX_SPEED, &result);
+    }
+
+    new_velocity[gid] = result;
+}
+
+/**
+ *  CONTINUUM CROWD
+ *  for crowds too dense for per-agent avoidance: the agents are splatted into a
+ *  density and mean velocity grid, every goal group gets a potential solving the
+ *  eikonal equation with a density dependent cost, and agents walk down the gradient
+ *  of their group's potential. The cost grows with the grid and the number of goal
+ *  groups, not with the number of agent pairs. Speeds are in cells per step.
+ */
+#define CONTINUUM_DENSITY_SCALE     1024.0f
+#define CONTINUUM_VELOCITY_SCALE    1048576.0f
+// agents per cell below which an agent walks at full speed and above which it moves with the flow
+#ifndef CONTINUUM_MIN_DENSITY
+#define CONTINUUM_MIN_DENSITY       0.5f
+#endif
+#ifndef CONTINUUM_MAX_DENSITY
+#define CONTINUUM_MAX_DENSITY       0.8f
+#endif
+#ifndef CONTINUUM_MAX_SPEED
+#define CONTINUUM_MAX_SPEED         0.14f
+#endif
+#ifndef CONTINUUM_MIN_SPEED
+#define CONTINUUM_MIN_SPEED         0.01f
+#endif
+#ifndef CONTINUUM_PATH_WEIGHT
+#define CONTINUUM_PATH_WEIGHT       1.0f
+#endif
+#ifndef CONTINUUM_TIME_WEIGHT
+#define CONTINUUM_TIME_WEIGHT       1.0f
+#endif
+#define CONTINUUM_FAR               1e9f
+
+/* bilinear splat of every agent, density and velocity are summed in fixed point with integer atomics */
+__kernel void splat_crowd(__global position_t* pos, __global float2* velocity, int no_points, __global int* splat)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= no_points)
+    {
+        return;
+    }
+
+    float2 position = agent_position(pos, gid);
+    float u = clamp(position.x * 100 + 96, 0.0f, GRID_SIDE - 1.0f);
+    float v = clamp(position.y * 100 + 96, 0.0f, GRID_SIDE - 1.0f);
+
+    int x = min((int) u, GRID_SIDE - 2);
+    int y = min((int) v, GRID_SIDE - 2);
+    float fx = u - x;
+    float fy = v - y;
+
+    int size = grid_size();
+
+    for (int corner = 0; corner < 4; corner++)
+    {
+        int dx = corner & 1;
+        int dy = corner >> 1;
+        float weight = (dx ? fx : 1.0f - fx) * (dy ? fy : 1.0f - fy);
+        int cell = grid_index(x + dx, y + dy);
+
+        atomic_add(&splat[cell], (int) (weight * CONTINUUM_DENSITY_SCALE + .5f));
+        atomic_add(&splat[size + cell], (int) (weight * velocity[gid].x * CONTINUUM_VELOCITY_SCALE));
+        atomic_add(&splat[2 * size + cell], (int) (weight * velocity[gid].y * CONTINUUM_VELOCITY_SCALE));
+    }
+}
+
+/* density and mean velocity of every cell; the splat sums are reset for the next frame */
+__kernel void resolve_crowd_splat(__global int* splat, __global float4* density)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= GRID_CELLS)
+    {
+        return;
+    }
+
+    int size = grid_size();
+    int cell = grid_index(gid % GRID_SIDE, gid / GRID_SIDE);
+
+    float cell_density = splat[cell] / CONTINUUM_DENSITY_SCALE;
+    float weight = max(cell_density, 1e-6f) * CONTINUUM_VELOCITY_SCALE;
+
+    // world units per step to cells per step
+    density[cell] = (float4) (cell_density, 100 * splat[size + cell] / weight, 100 * splat[2 * size + cell] / weight, 0.0f);
+
+    splat[cell] = 0;
+    splat[size + cell] = 0;
+    splat[2 * size + cell] = 0;
+}
+
+/* speed of a cell towards its neighbour in one direction, judged by the density in that neighbour */
+float crowd_speed_towards(__global float4* density, __global ushort* obstacle_id, int x, int y, int dx, int dy)
+{
+    if (x + dx < 0 || x + dx >= GRID_SIDE || y + dy < 0 || y + dy >= GRID_SIDE)
+    {
+        return 0.0f;
+    }
+
+    int cell = grid_index(x + dx, y + dy);
+
+    if (obstacle_id[cell] != 0)
+    {
+        return 0.0f;
+    }
+
+    float4 ahead = density[cell];
+    float flow = max(ahead.y * dx + ahead.z * dy, 0.0f);
+    float crowded = clamp((ahead.x - CONTINUUM_MIN_DENSITY) / (CONTINUUM_MAX_DENSITY - CONTINUUM_MIN_DENSITY), 0.0f, 1.0f);
+
+    return max(mix(CONTINUUM_MAX_SPEED, flow, crowded), CONTINUUM_MIN_SPEED);
+}
+
+/* speeds towards east, north, west and south */
+__kernel void crowd_speed(__global float4* density, __global ushort* obstacle_id, __global float4* speed)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= GRID_CELLS)
+    {
+        return;
+    }
+
+    int x = gid % GRID_SIDE;
+    int y = gid / GRID_SIDE;
+
+    speed[grid_index(x, y)] = (float4) (crowd_speed_towards(density, obstacle_id, x, y, 1, 0),
+                                        crowd_speed_towards(density, obstacle_id, x, y, 0, 1),
+                                        crowd_speed_towards(density, obstacle_id, x, y, -1, 0),
+                                        crowd_speed_towards(density, obstacle_id, x, y, 0, -1));
+}
+
+/* cost of one cell at the given speed, a blocked direction costs CONTINUUM_FAR */
+float crowd_cost(float speed)
+{
+    return speed > 0.0f ? CONTINUUM_PATH_WEIGHT + CONTINUUM_TIME_WEIGHT / speed : CONTINUUM_FAR;
+}
+
+/* upwind solution of |grad phi| = cost from the cheaper neighbour on each axis */
+float eikonal_update(float phi_x, float cost_x, float phi_y, float cost_y)
+{
+    float one_sided = min(phi_x + cost_x, phi_y + cost_y);
+
+    if (phi_x + cost_x >= CONTINUUM_FAR || phi_y + cost_y >= CONTINUUM_FAR)
+    {
+        return min(one_sided, CONTINUUM_FAR);
+    }
+
+    // (t / cost_x)^2 + ((t - d) / cost_y)^2 = 1 with t = phi - phi_x
+    float a = 1.0f / (cost_x * cost_x);
+    float b = 1.0f / (cost_y * cost_y);
+    float d = phi_y - phi_x;
+    float discriminant = a + b - a * b * d * d;
+
+    if (discriminant < 0.0f)
+    {
+        return one_sided;
+    }
+
+    float t = (b * d + sqrt(discriminant)) / (a + b);
+
+    return (t >= max(d, 0.0f)) ? phi_x + t : one_sided;
+}
+
+/* one Jacobi sweep over the potentials of every goal group, gid runs over GRID_CELLS * no_groups */
+__kernel void eikonal_sweep(__global float* potential_in, __global float* potential_out, __global float4* speed,
+                            __global int* goal_group, __global ushort* obstacle_id, int no_groups)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= GRID_CELLS * no_groups)
+    {
+        return;
+    }
+
+    int group = gid / GRID_CELLS;
+    int x = (gid % GRID_CELLS) % GRID_SIDE;
+    int y = (gid % GRID_CELLS) / GRID_SIDE;
+    int cell = grid_index(x, y);
+
+    __global float* phi_in = potential_in + group * grid_size();
+
+    if (obstacle_id[cell] != 0 || goal_group[cell] == group)
+    {
+        potential_out[group * grid_size() + cell] = (obstacle_id[cell] != 0) ? CONTINUUM_FAR : 0.0f;
+        return;
+    }
+
+    float4 cell_speed = speed[cell];
+
+    float phi_east  = (x + 1 < GRID_SIDE) ? phi_in[grid_index(x + 1, y)] : CONTINUUM_FAR;
+    float phi_north = (y + 1 < GRID_SIDE) ? phi_in[grid_index(x, y + 1)] : CONTINUUM_FAR;
+    float phi_west  = (x > 0) ? phi_in[grid_index(x - 1, y)] : CONTINUUM_FAR;
+    float phi_south = (y > 0) ? phi_in[grid_index(x, y - 1)] : CONTINUUM_FAR;
+
+    int to_east  = phi_east + crowd_cost(cell_speed.x) < phi_west + crowd_cost(cell_speed.z);
+    int to_north = phi_north + crowd_cost(cell_speed.y) < phi_south + crowd_cost(cell_speed.w);
+
+    potential_out[group * grid_size() + cell] = eikonal_update(to_east ? phi_east : phi_west,
+                                                               crowd_cost(to_east ? cell_speed.x : cell_speed.z),
+                                                               to_north ? phi_north : phi_south,
+                                                               crowd_cost(to_north ? cell_speed.y : cell_speed.w));
+}
+
+/* potential of a neighbour for the gradient, a wall or the grid border gives back the cell's own */
+float crowd_potential_at(__global float* phi, int x, int y, float own)
+{
+    if (x < 0 || x >= GRID_SIDE || y < 0 || y >= GRID_SIDE)
+    {
+        return own;
+    }
+
+    float neighbour = phi[grid_index(x, y)];
+
+    return (neighbour >= CONTINUUM_FAR) ? own : neighbour;
+}
+
+/* every agent of the macro bucket walks down its group's potential at the speed of the crowd in that direction */
+__kernel void continuum_velocities(__global position_t* pos, __global uint* target, __global float* potential,
+                                   __global float4* speed, __global int* goal_group, __global float2* new_velocity,
+                                   __global int* bucket_agents, int bucket_first, int bucket_size)
+{
+    unsigned int index = get_global_id(0);
+
+    if (index >= bucket_size)
+    {
+        return;
+    }
+
+    unsigned int gid = bucket_agents[bucket_first + index];
+
+    float2 current_point = agent_position(pos, gid);
+    float2 current_target = agent_target(target, gid);
+
+    int x = clamp(grid_cell(current_point.x), 0, GRID_SIDE - 1);
+    int y = clamp(grid_cell(current_point.y), 0, GRID_SIDE - 1);
+    int cell = grid_index(x, y);
+    int group = goal_group[grid_index(clamp(grid_cell(current_target.x), 0, GRID_SIDE - 1),
+                                      clamp(grid_cell(current_target.y), 0, GRID_SIDE - 1))];
+
+    // within the goal region the last cells are walked straight
+    float2 straight = (float2) (clamp(current_target.x - current_point.x, -0.001f, 0.001f),
+                                clamp(current_target.y - current_point.y, -0.001f, 0.001f));
+
+    if (group < 0 || goal_group[cell] == group)
+    {
+        new_velocity[gid] = straight;
+        return;
+    }
+
+    __global float* phi = potential + group * grid_size();
+    float own = phi[cell];
+
+    float gradient_x = crowd_potential_at(phi, x + 1, y, own) - crowd_potential_at(phi, x - 1, y, own);
+    float gradient_y = crowd_potential_at(phi, x, y + 1, own) - crowd_potential_at(phi, x, y - 1, own);
+    float gradient_length = sqrt(gradient_x * gradient_x + gradient_y * gradient_y);
+
+    // no potential reached this cell yet
+    if (own >= CONTINUUM_FAR || gradient_length < 1e-6f)
+    {
+        new_velocity[gid] = straight;
+        return;
+    }
+
+    float direction_x = -gradient_x / gradient_length;
+    float direction_y = -gradient_y / gradient_length;
+
+    float4 cell_speed = speed[cell];
+    float speed_x = (direction_x > 0.0f) ? cell_speed.x : cell_speed.z;
+    float speed_y = (direction_y > 0.0f) ? cell_speed.y : cell_speed.w;
+    float along = (fabs(direction_x) * speed_x + fabs(direction_y) * speed_y) / (fabs(direction_x) + fabs(direction_y));
+
+    // cells per step to world units per step
+    new_velocity[gid] = (float2) (direction_x * along * 0.01f, direction_y * along * 0.01f);
+}
+
+/**
+ *  moves the active agents by the velocity ORCA or the continuum solver gave them, walls stay hard;
+ *  an agent of a quiet tile only moves on its frame, by as many steps as it waited
+ */
+__kernel void labirinth(__global position_t* pos, __global uint* target, __global float4* distance_field,
+                        __global float2* velocity, __global float2* new_velocity,
+                        __global int* active_agents, int no_active, __global uchar* step_multiplier)
+{
+    unsigned int index = get_global_id(0);
+
+    if (index >= no_active)
+    {
+        return;
+    }
+
+    unsigned int gid = active_agents[index];
+
+    float2 current_point = agent_position(pos, gid);
+    int multiplier = step_multiplier[gid];
+
+    // a waiting agent keeps its velocity, its neighbours still see it walking
+    if (multiplier == 0)
+    {
+        return;
+    }
+
+    // agents that arrived between two compactions are already frozen
+    if (agent_arrived(current_point, agent_target(target, gid)))
+    {
+        velocity[gid] = (float2) (0.0f, 0.0f);
+        return;
+    }
+
+    float2 normal;
+    float wall = wall_normal(sample_distance_field(distance_field, current_point), &normal);
+
+    // an avoidance step may still point into a wall, it loses that part and the agent is pushed out
+    float2 step = new_velocity[gid];
+    step = step - into_wall(step, normal, wall) + (float) WALL_REPULSION * wall * normal;
+
+    float2 next_point = move_agent(pos, gid, (float) multiplier * step);
+
+    // frozen agents must not be avoided as if they still moved
+    velocity[gid] = agent_arrived(next_point, agent_target(target, gid)) ? (float2) (0.0f, 0.0f) : step;
+}
+
+/**
+ *  MULTI-RATE STEPPING
+ *  the grid is split in GRID_TILE x GRID_TILE tiles and every tile gets a step interval
+ *  of 1, 2, 4 or 8 frames from its activity: a tile with many agents, agents going
+ *  different ways or an obstacle that just moved steps every frame, a tile with a
+ *  couple of agents walking the same way only every few frames, by that many steps.
+ *  Near a wall, its target or a listed neighbour an agent drops to the interval its
+ *  longer step allows.
+ */
+#define ACTIVITY_LEVELS             4
+#define ACTIVITY_SCALE              4096.0f
+#ifndef ACTIVITY_BUSY_AGENTS
+#define ACTIVITY_BUSY_AGENTS        8
+#endif
+#ifndef ACTIVITY_BUSY_VARIANCE
+#define ACTIVITY_BUSY_VARIANCE      0.005f      // (cells per step)^2
+#endif
+
+int agent_tile(float2 position)
+{
+    int x = clamp(grid_cell(position.x), 0, GRID_SIDE - 1);
+    int y = clamp(grid_cell(position.y), 0, GRID_SIDE - 1);
+
+    return (y >> GRID_TILE_BITS) * GRID_TILES_PER_ROW + (x >> GRID_TILE_BITS);
+}
+
+/* per tile: agents, sum of the velocities and of their squared lengths in cells per step, fixed point */
+__kernel void tile_activity(__global position_t* pos, __global float2* velocity, int no_points, __global int* tile_stats)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= no_points)
+    {
+        return;
+    }
+
+    int tile = agent_tile(agent_position(pos, gid));
+    float2 v = velocity[gid] * 100.0f;
 
-    /**
-     *   FOLLOW THE TARGET & AVOID OBSTACLES
-     */
-    float sign_x = (target[gid].x - pos[gid].x) > 0;
-    float sign_y = (target[gid].y - pos[gid].y) > 0;
+    atomic_inc(&tile_stats[4 * tile]);
+    atomic_add(&tile_stats[4 * tile + 1], convert_int_sat_rte(v.x * ACTIVITY_SCALE));
+    atomic_add(&tile_stats[4 * tile + 2], convert_int_sat_rte(v.y * ACTIVITY_SCALE));
+    atomic_add(&tile_stats[4 * tile + 3], convert_int_sat_rte((v.x * v.x + v.y * v.y) * ACTIVITY_SCALE));
+}
+
+/* step interval of every tile from its statistics, which are cleared for the next window */
+__kernel void classify_tiles(__global int* tile_stats, __global int* tile_hold, __global int* tile_interval)
+{
+    unsigned int tile = get_global_id(0);
+
+    if (tile >= GRID_TILES_PER_ROW * GRID_TILES_PER_ROW)
+    {
+        return;
+    }
+
+    int count = tile_stats[4 * tile];
+    float mean_x = tile_stats[4 * tile + 1] / (ACTIVITY_SCALE * max(count, 1));
+    float mean_y = tile_stats[4 * tile + 2] / (ACTIVITY_SCALE * max(count, 1));
+    float variance = tile_stats[4 * tile + 3] / (ACTIVITY_SCALE * max(count, 1)) - mean_x * mean_x - mean_y * mean_y;
+
+    int busy = tile_hold[tile] > 0 || count > ACTIVITY_BUSY_AGENTS || variance > ACTIVITY_BUSY_VARIANCE;
+    int level = busy ? 0 : ((count <= 2) ? ACTIVITY_LEVELS - 1 : ((count <= 4) ? 2 : 1));
+
+    tile_interval[tile] = 1 << level;
+    tile_stats[4 * tile]     = 0;
+    tile_stats[4 * tile + 1] = 0;
+    tile_stats[4 * tile + 2] = 0;
+    tile_stats[4 * tile + 3] = 0;
+}
+
+/**
+ *  multiplier of every active agent for this frame, 0 while it waits; the tiles are
+ *  staggered so the quiet agents do not all step on the same frame. last_step is the
+ *  frame an agent's time has been covered up to: it steps on its tile's frame, and at
+ *  the latest once interval frames are owed, by the frames owed, so an agent that
+ *  moved into another tile or got a shorter interval neither gains nor loses time. A
+ *  step is never longer than the interval, what it cannot cover is owed to the next
+ *  ones; an agent back in the active list owes at most the longest interval. The
+ *  neighbour lists are only read when use_neighbours is set, they are not kept for
+ *  the continuum.
+ */
+__kernel void schedule_agents(__global position_t* pos, __global uint* target, __global float4* distance_field,
+                              __global int* tile_interval, __global int* active_agents, int no_active, int frame,
+                              __global uchar* step_multiplier, __global int* neighbour_offsets,
+                              __global int* neighbour_list, int use_neighbours, __global int* last_step)
+{
+    unsigned int index = get_global_id(0);
+
+    if (index >= no_active)
+    {
+        return;
+    }
+
+    unsigned int gid = active_agents[index];
+
+    float2 current_point = agent_position(pos, gid);
+    float2 current_target = agent_target(target, gid);
+    int tile = agent_tile(current_point);
+    int interval = tile_interval[tile];
+
+    // the longer step has to end outside the walls' range and short of the arrival box
+    float wall_clearance = sample_distance_field(distance_field, current_point).x - WALL_RANGE;
+    float target_clearance = max(fabs(current_target.x - current_point.x), fabs(current_target.y - current_point.y)) - ARRIVAL_DISTANCE;
+    float clearance = min(wall_clearance, target_clearance);
+
+    // two agents walking at each other close twice the step, ORCA only sees them within LIMIT_PROXIMITY
+    for (int k = use_neighbours ? neighbour_offsets[gid] : 0; interval > 1 && k < (use_neighbours ? neighbour_offsets[gid + 1] : 0); k++)
+    {
+        float2 relative_position = agent_position(pos, neighbour_list[k]) - current_point;
+
+        clearance = min(clearance, (float) (0.5f * (length(relative_position) - LIMIT_PROXIMITY)));
+    }
+
+    while (interval > 1 && interval * ORCA_MAX_SPEED > clearance)
+    {
+        interval >>= 1;
+    }
+
+    int owed = min(frame - last_step[gid], 1 << (ACTIVITY_LEVELS - 1));
+
+    if ((frame + tile) % interval == 0 || owed >= interval)
+    {
+        int multiplier = min(owed, interval);
+
+        step_multiplier[gid] = (uchar) multiplier;
+        last_step[gid] = frame - owed + multiplier;
+    }
+    else
+    {
+        step_multiplier[gid] = 0;
+    }
+}
+
+/**
+ *  AGENT TYPES
+ *  the behaviour of every active agent this frame, as the key the host buckets the
+ *  active list by: micro agents solve ORCA, macro agents walk the continuum and idle
+ *  agents (waiting for their tile's frame, or arrived since the last compaction)
+ *  solve nothing. The velocity kernels only get the agents of their own bucket, so
+ *  this is the one place that tests an agent's behaviour.
+ */
+#define AGENT_TYPE_MICRO            0
+#define AGENT_TYPE_MACRO            1
+#define AGENT_TYPE_IDLE             2
+
+__kernel void agent_types(__global position_t* pos, __global uint* target, __global int* active_agents, int no_active,
+                          __global uchar* lod, __global uchar* step_multiplier, __global uint* type_keys,
+                          __global int* bucket_agents, __global int* type_counts)
+{
+    unsigned int index = get_global_id(0);
+
+    if (index >= no_active)
+    {
+        return;
+    }
+
+    int gid = active_agents[index];
+    float2 current_point = agent_position(pos, gid);
+
+    uint type = (step_multiplier[gid] == 0 || agent_arrived(current_point, agent_target(target, gid))) ? AGENT_TYPE_IDLE
+              : (agent_is_micro(lod, current_point, LOD_HAND_OFF_CELLS) ? AGENT_TYPE_MICRO : AGENT_TYPE_MACRO);
 
-    int obstacle_up         = (matrix_x[point_x_in_matrix] == 1) && (matrix_y[up] == 1);
-    int obstacle_up_left    = (matrix_x[left] == 1) && (matrix_y[up] == 1);
-    int obstacle_up_right   = (matrix_x[right] == 1) && (matrix_y[up] == 1);
-    int obstacle_left       = (matrix_x[left] == 1) && (matrix_y[point_y_in_matrix] == 1);
-    int obstacle_right      = (matrix_x[right] == 1) && (matrix_y[point_y_in_matrix] == 1);
-    int obstacle_down       = (matrix_x[point_x_in_matrix] == 1) && (matrix_y[down] == 1);
-    int obstacle_down_left  = (matrix_x[left] == 1) && (matrix_y[down] == 1);
-    int obstacle_down_right = (matrix_x[right] == 1) && (matrix_y[down] == 1);
+    type_keys[index] = type;
+    bucket_agents[index] = gid;
+    atomic_inc(&type_counts[type]);
+}
+
+/**
+ *  NEIGHBOUR LISTS
+ *  agents are binned per grid cell (count, scan, fill), then every agent gets the
+ *  agents closer than LIMIT_PROXIMITY + NEIGHBOUR_SKIN on both axes as a compressed
+ *  sparse row (count, scan, fill again); the fill resets the bin counters so no clear
+ *  pass is needed. The lists stay valid until some agent moved half the skin.
+ */
+__kernel void count_cell_agents(__global position_t* pos, int no_points, __global int* cell_counts, __global int* agent_rank)
+{
+    unsigned int gid = get_global_id(0);
 
-    int obstacle_exists = obstacle_up || obstacle_up_left || obstacle_up_right || obstacle_left
-                       || obstacle_right || obstacle_down || obstacle_down_left || obstacle_down_right;
+    if (gid >= no_points)
+    {
+        return;
+    }
+
+    int2 point = agent_cell(pos, gid);
+    int cell = grid_index(point.x, point.y);
+
+    agent_rank[gid] = atomic_inc(&cell_counts[cell]);
+}
 
-    int obstacle_for_x = obstacle_left + obstacle_right;
-    int obstacle_for_y = obstacle_up + obstacle_down;
+__kernel void fill_cell_agents(__global position_t* pos, int no_points, __global int* cell_counts, __global int* agent_rank,
+                               __global int* cell_start, __global int* cell_agents)
+{
+    unsigned int gid = get_global_id(0);
 
-    pos[gid].x += 0.001 * sign_x * (obstacle_for_x == 0);// - 0.001 * (obstacle_for_x != 0 && obstacle_for_y == 0));
-    pos[gid].y += 0.001 * sign_y * (obstacle_for_y == 0) + 0.001 * (sign_obstacle_attraction_down - sign_obstacle_attraction_up) * (obstacle_for_y != 0);
+    if (gid >= no_points)
+    {
+        return;
+    }
 
-/*-----------------------------------------------------------------------------------------------------------------*/
+    int2 point = agent_cell(pos, gid);
+    int cell = grid_index(point.x, point.y);
 
-    /**
-     *   AVOID NEIGHBOUR COLLISION
-     */
-    float2 back_off = (float2) (0.0f, 0.0f);
+    cell_agents[cell_start[cell] + agent_rank[gid]] = gid;
+    cell_counts[cell] = 0;
+}
 
-    int neighbour_up         = (neighbours_x[point_x_in_matrix] == 1) && (neighbours_y[up] == 1);
-    int neighbour_up_left    = (neighbours_x[left] == 1) && (neighbours_y[up] == 1);
-    int neighbour_up_right   = (neighbours_x[right] == 1) && (neighbours_y[up] == 1);
-    int neighbour_left       = (neighbours_x[left] == 1) && (neighbours_y[point_y_in_matrix] == 1);
-    int neighbour_right      = (neighbours_x[right] == 1) && (neighbours_y[point_y_in_matrix] == 1);
-    int neighbour_down       = (neighbours_x[point_x_in_matrix] == 1) && (neighbours_y[down] == 1);
-    int neighbour_down_left  = (neighbours_x[left] == 1) && (neighbours_y[down] == 1);
-    int neighbour_down_right = (neighbours_x[right] == 1) && (neighbours_y[down] == 1);
+/* counts the agents within the skinned radius of agent gid, neighbour_list is only written when fill is set */
+int cell_neighbours(unsigned int gid, __global position_t* pos, __global int* cell_start, __global int* cell_agents,
+                    __global int* neighbour_list, int fill)
+{
+    float2 position = agent_position(pos, gid);
+    int2 point = agent_cell(pos, gid);
+    int count = 0;
 
-    int neighbour_exists = neighbour_up || neighbour_up_left || neighbour_up_right || neighbour_left
-                        || neighbour_right || neighbour_down || neighbour_down_left || neighbour_down_right;
+    // only cells inside the grid, a clamped border cell would be searched twice
+    for (int y = max(point.y - NEIGHBOUR_SEARCH_CELLS, 0); y <= min(point.y + NEIGHBOUR_SEARCH_CELLS, GRID_SIDE - 1); y++)
+    {
+        for (int x = max(point.x - NEIGHBOUR_SEARCH_CELLS, 0); x <= min(point.x + NEIGHBOUR_SEARCH_CELLS, GRID_SIDE - 1); x++)
+        {
+            int cell = grid_index(x, y);
 
-    int neighbour_for_x = neighbour_left + neighbour_right;
-    int neighbour_for_y = neighbour_up + neighbour_down;
+            for (int k = cell_start[cell]; k < cell_start[cell + 1]; k++)
+            {
+                int other = cell_agents[k];
+                float2 distance = fabs(agent_position(pos, other) - position);
 
-    back_off.x += (neighbour_left == 1 || neighbour_down_left == 1 || neighbour_up_left == 1) * BACK_OFF * (obstacle_right == 0 || obstacle_up_right == 0 || obstacle_down_right == 0)
-            - (neighbour_right == 1 || neighbour_up_right == 1 || neighbour_down_right == 1) * BACK_OFF * (obstacle_left == 0 || obstacle_up_left == 0 || obstacle_down_left == 0);
-    back_off.y += (neighbour_down == 1 || neighbour_down_left == 1 || neighbour_down_right == 1) * BACK_OFF * (obstacle_up == 0 || obstacle_up_right == 0 || obstacle_up_left == 0)
-            - (neighbour_up == 1 || neighbour_up_right == 1 || neighbour_up_left == 1) * BACK_OFF * (obstacle_down == 0 || obstacle_down_right == 0 || obstacle_down_left == 0);
+                if (other != gid && distance.x < LIMIT_PROXIMITY + NEIGHBOUR_SKIN && distance.y < LIMIT_PROXIMITY + NEIGHBOUR_SKIN)
+                {
+                    if (fill)
+                    {
+                        neighbour_list[count] = other;
+                    }
+                    count++;
+                }
+            }
+        }
+    }
 
-    neighbours_x[point_x_in_matrix] = 0;
-    neighbours_y[point_y_in_matrix] = 0;
+    return count;
+}
 
-    pos[gid].x += back_off.x;
-    pos[gid].y += back_off.y;
+/* the scan of the counts is 32 bit, total holds their exact sum as a low word and its carries */
+__kernel void count_neighbours(__global position_t* pos, int no_points, __global int* cell_start, __global int* cell_agents,
+                               __global int* neighbour_offsets, __global uchar* lod, __global uint* total)
+{
+    unsigned int gid = get_global_id(0);
 
-    /**
-     *  UPDATE NEIGHBOURS COLLISION MATRIX
-     */
-    int new_point_x = (int) (pos[gid].x * 100 + 96 + .5);
-    int new_point_y = (int) (pos[gid].y * 100 + 96 + .5);
+    if (gid >= no_points)
+    {
+        return;
+    }
 
-    int new_point_x_in_matrix = 193 * new_point_y + new_point_x;
-    int new_point_y_in_matrix = 193 * new_point_x + new_point_y;
+    // macro agents never look at their neighbours
+    int count = agent_is_micro(lod, agent_position(pos, gid), LOD_LIST_CELLS) ? cell_neighbours(gid, pos, cell_start, cell_agents, neighbour_offsets, 0) : 0;
+    neighbour_offsets[gid] = count;
 
-    neighbours_x[new_point_x_in_matrix] = 1;
-    neighbours_y[new_point_y_in_matrix] = 1;
+    if (count > 0 && atomic_add(&total[0], (uint) count) > UINT_MAX - (uint) count)
+    {
+        atomic_inc(&total[1]);
+    }
+
+    // the scan is done in place, the slot behind the last agent must hold 0 again
+    if (gid == 0)
+    {
+        neighbour_offsets[no_points] = 0;
+    }
 }
 
+__kernel void fill_neighbours(__global position_t* pos, int no_points, __global int* cell_start, __global int* cell_agents,
+                              __global int* neighbour_offsets, __global int* neighbour_list, __global position_t* pos_at_build,
+                              __global uchar* lod)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= no_points)
+    {
+        return;
+    }
 
-__kernel void activate_deactivate_obstacle_attraction(int start_index_y, int end_start, int value, __global int* activated)
+    if (agent_is_micro(lod, agent_position(pos, gid), LOD_LIST_CELLS))
+    {
+        cell_neighbours(gid, pos, cell_start, cell_agents, neighbour_list + neighbour_offsets[gid], 1);
+    }
+    pos_at_build[gid] = pos[gid];
+}
+
+/* largest per-axis move since the lists were built, reduced with primitives_reduce() */
+__kernel void neighbour_displacement(__global position_t* pos, __global position_t* pos_at_build, int no_points, __global float* displacement)
 {
-    unsigned int gid = get_global_id(0) + start_index_y;
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= no_points)
+    {
+        return;
+    }
+
+    float2 moved = fabs(agent_position(pos, gid) - agent_position(pos_at_build, gid));
+
+    displacement[gid] = fmax(moved.x, moved.y);
+}
+
+
+/**
+ *  ACTIVE AGENTS COMPACTION
+ *  flags the agents of the active list that still have to move, primitives_compact() does the rest
+ */
+__kernel void flag_active_agents(__global position_t* pos, __global uint* target,
+                                 __global int* active_agents, int no_active, __global int* flags)
+{
+    unsigned int index = get_global_id(0);
+
+    if (index >= no_active)
+    {
+        return;
+    }
+
+    int gid = active_agents[index];
+
+    flags[index] = !agent_arrived(agent_position(pos, gid), agent_target(target, gid));
+}
+
+/**
+ *  LOAD BALANCE
+ *  an active agent costs one plus the neighbours ORCA goes through; the costs are
+ *  scanned and the shares of the per-agent kernels cut at even quantiles of the sum
+ */
+int agent_work_of(int gid, __global int* neighbour_offsets, int use_neighbours)
+{
+    return 1 + (use_neighbours ? neighbour_offsets[gid + 1] - neighbour_offsets[gid] : 0);
+}
+
+/* cost of every entry of the active list, and a 0 after the last one for the scan total */
+__kernel void agent_work(__global int* active_agents, int no_active, __global int* neighbour_offsets, int use_neighbours,
+                         __global int* work)
+{
+    unsigned int index = get_global_id(0);
+
+    if (index > no_active)
+    {
+        return;
+    }
+
+    work[index] = (index < no_active) ? agent_work_of(active_agents[index], neighbour_offsets, use_neighbours) : 0;
+}
+
+/* first entry of every share in the scanned costs and the cost before it, share no_shares is the end */
+__kernel void work_cuts(__global int* work_offsets, int no_active, int no_shares, __global int2* cuts)
+{
+    unsigned int share = get_global_id(0);
+
+    if (share > no_shares)
+    {
+        return;
+    }
+
+    int target = (int) ((long) work_offsets[no_active] * share / no_shares);
+    int low = 0;
+    int high = no_active;
+
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+
+        if (work_offsets[middle] < target)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    cuts[share] = (int2) (low, work_offsets[low]);
+}
+
+/**
+ *  DOMAIN DECOMPOSITION
+ *  with several ranks each one owns the agents whose row lies in its strip of rows
+ *  domain_rows[rank] .. domain_rows[rank + 1], the other slots are ghosts of agents
+ *  owned elsewhere. agent_domain holds the owner in its low bits and, on the owner,
+ *  one bit per rank the agent was sent to last frame. The owner sends an agent every
+ *  frame it is within halo_rows of another strip and once more after it left, so the
+ *  last copy a rank keeps is out of its reach; an agent whose row is in another strip
+ *  is handed to that rank with the same record.
+ */
+#define DOMAIN_OWNER_MASK           0xffff
+#define DOMAIN_SENT_SHIFT           16
+#define DOMAIN_HANDOFF              0x10000
+
+int agent_row(float2 position)
+{
+    return clamp(grid_cell(position.y), 0, GRID_SIDE - 1);
+}
+
+/* records of position and velocity, with the slot and the receiving rank (| DOMAIN_HANDOFF) */
+__kernel void domain_outbox(__global position_t* pos, __global float2* velocity, __global int* agent_domain, int no_points,
+                            __global int* domain_rows, int no_ranks, int rank, int halo_rows,
+                            __global int* outbox_count, __global int2* outbox_info, __global float4* outbox_state, int outbox_capacity)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= no_points)
+    {
+        return;
+    }
+
+    int domain = agent_domain[gid];
+
+    if ((domain & DOMAIN_OWNER_MASK) != rank)
+    {
+        return;
+    }
+
+    float2 current_point = agent_position(pos, gid);
+    float2 current_velocity = velocity[gid];
+    int row = agent_row(current_point);
+    int owner = rank;
+    int sent = 0;
+
+    for (int r = 0; r < no_ranks; r++)
+    {
+        int inside = row >= domain_rows[r] && row < domain_rows[r + 1];
+        int in_halo = row >= domain_rows[r] - halo_rows && row < domain_rows[r + 1] + halo_rows;
+
+        if (r == rank || !(in_halo || ((domain >> (DOMAIN_SENT_SHIFT + r)) & 1)))
+        {
+            continue;
+        }
+
+        // the host checks the count against the capacity
+        int slot = atomic_inc(outbox_count);
+        if (slot < outbox_capacity)
+        {
+            outbox_info[slot]  = (int2) (gid, r | (inside ? DOMAIN_HANDOFF : 0));
+            outbox_state[slot] = (float4) (current_point.x, current_point.y, current_velocity.x, current_velocity.y);
+        }
+
+        owner = inside ? r : owner;
+        sent |= in_halo << (DOMAIN_SENT_SHIFT + r);
+    }
+
+    agent_domain[gid] = (owner == rank) ? (rank | sent) : owner;
+}
+
+/* received records, info.y is the sending rank by now; a handed agent becomes this rank's */
+__kernel void domain_inbox(__global position_t* pos, __global float2* velocity, __global int* agent_domain,
+                           __global int2* inbox_info, __global float4* inbox_state, int no_records, int rank)
+{
+    unsigned int index = get_global_id(0);
+
+    if (index >= no_records)
+    {
+        return;
+    }
+
+    int2 info = inbox_info[index];
+    float4 state = inbox_state[index];
+
+    store_position(pos, info.x, (float2) (state.x, state.y));
+    velocity[info.x]     = (float2) (state.z, state.w);
+    agent_domain[info.x] = (info.y & DOMAIN_HANDOFF) ? rank : (info.y & DOMAIN_OWNER_MASK);
+}
+
+/* flags the owned slots that still have to move, the active list is rebuilt from them */
+__kernel void domain_flag_agents(__global position_t* pos, __global uint* target, __global int* agent_domain, int no_points,
+                                 int rank, __global int* active_flags, __global int* all_agents)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= no_points)
+    {
+        return;
+    }
+
+    active_flags[gid] = (agent_domain[gid] & DOMAIN_OWNER_MASK) == rank && !agent_arrived(agent_position(pos, gid), agent_target(target, gid));
+    all_agents[gid]   = gid;
+}
+
+/* cost of the active agents per grid row, the load the strips are cut by */
+__kernel void domain_row_load(__global position_t* pos, __global int* active_agents, int no_active, __global int* row_load,
+                              __global int* neighbour_offsets, int use_neighbours)
+{
+    unsigned int index = get_global_id(0);
+
+    if (index >= no_active)
+    {
+        return;
+    }
+
+    int gid = active_agents[index];
+
+    atomic_add(&row_load[agent_row(agent_position(pos, gid))], agent_work_of(gid, neighbour_offsets, use_neighbours));
+}
+
+/**
+ *  MORTON REORDERING
+ *  agents are sorted by the Z-order of their cell so that agents close in space
+ *  sit close in memory; agent_ids follows the agents and keeps their world.ads id
+ */
+__kernel void morton_keys(__global position_t* pos, __global uint* keys, __global int* order, int no_points)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= no_points)
+    {
+        return;
+    }
+
+    int2 point = clamp(agent_cell(pos, gid), 0, GRID_SIDE - 1);
+
+    keys[gid]  = grid_index_in(GRID_LAYOUT_MORTON, point.x, point.y);
+    order[gid] = gid;
+}
+
+/* moves every agent to its sorted slot and flags the slots that still have to move */
+__kernel void gather_agents(__global position_t* pos, __global uint* target, __global uchar4* color, __global int* agent_ids,
+                            __global int* order, int no_points,
+                            __global position_t* sorted_pos, __global uint* sorted_target, __global uchar4* sorted_color, __global int* sorted_agent_ids,
+                            __global int* active_flags, __global int* all_agents,
+                            __global float2* velocity, __global float2* sorted_velocity,
+                            __global int* last_step, __global int* sorted_last_step)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= no_points)
+    {
+        return;
+    }
+
+    int from = order[gid];
+
+    sorted_pos[gid]       = pos[from];
+    sorted_target[gid]    = target[from];
+    sorted_color[gid]     = color[from];
+    sorted_agent_ids[gid] = agent_ids[from];
+    sorted_velocity[gid]  = velocity[from];
+    sorted_last_step[gid] = last_step[from];
+
+    active_flags[gid] = !agent_arrived(agent_position(pos, from), agent_target(target, from));
+    all_agents[gid]   = gid;
+}
+
+/**
+ *  OBSTACLE RASTERISATION
+ *  conservative: every cell a segment passes through is marked. A segment is cut
+ *  into one span per column of its major axis (rows for steep segments), the span
+ *  holds the one or two cells the segment crosses inside that column
+ */
+
+/* endpoints in continuous cell coordinates (cell k covers [k, k + 1)), swapped so that .x is the major axis and from.x <= to.x */
+int segment_major_axis(float4 segment, float2* from, float2* to)
+{
+    float2 a = (float2) (segment.x * 100 + 96.5f, segment.y * 100 + 96.5f);
+    float2 b = (float2) (segment.z * 100 + 96.5f, segment.w * 100 + 96.5f);
+    int y_major = fabs(b.y - a.y) > fabs(b.x - a.x);
+
+    if (y_major)
+    {
+        a = (float2) (a.y, a.x);
+        b = (float2) (b.y, b.x);
+    }
+
+    *from = (a.x <= b.x) ? a : b;
+    *to   = (a.x <= b.x) ? b : a;
+
+    return y_major;
+}
+
+/* first column of the segment clipped to the grid, the number of columns is returned */
+int segment_columns(float2 from, float2 to, int* first_column)
+{
+    *first_column = max((int) floor(from.x), 0);
+
+    return max(min((int) floor(to.x), GRID_SIDE - 1) - *first_column + 1, 0);
+}
+
+__kernel void count_segment_spans(__global float4* segments, int no_segments, __global int* span_offsets)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= no_segments)
+    {
+        return;
+    }
+
+    float2 from, to;
+    int first_column;
+
+    segment_major_axis(segments[gid], &from, &to);
+    span_offsets[gid] = segment_columns(from, to, &first_column);
+
+    // the scan is done in place, the slot behind the last segment must hold 0 again
+    if (gid == 0)
+    {
+        span_offsets[no_segments] = 0;
+    }
+}
+
+__kernel void rasterise_segments(__global float4* segments, __global ushort* segment_ids, __global int* span_offsets,
+                                 int no_segments, __global int* matrix_x, __global int* matrix_y, __global ushort* obstacle_id)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= span_offsets[no_segments])
+    {
+        return;
+    }
+
+    // last segment starting at or before gid, empty segments share their offset with the next one
+    int segment = 0;
+    int last    = no_segments - 1;
+    while (segment < last)
+    {
+        int middle = (segment + last + 1) / 2;
+
+        if (span_offsets[middle] <= gid)
+        {
+            segment = middle;
+        }
+        else
+        {
+            last = middle - 1;
+        }
+    }
+
+    float2 from, to;
+    int first_column;
+
+    int y_major = segment_major_axis(segments[segment], &from, &to);
+    segment_columns(from, to, &first_column);
+
+    int column = first_column + gid - span_offsets[segment];
+
+    // part of the segment inside the column
+    float enter = clamp((float) column, from.x, to.x);
+    float leave = clamp((float) column + 1, from.x, to.x);
+    float slope = (to.x > from.x) ? (to.y - from.y) / (to.x - from.x) : 0.0f;
+
+    float enter_y = from.y + (enter - from.x) * slope;
+    float leave_y = from.y + (leave - from.x) * slope;
+
+    int first_row = max((int) floor(min(enter_y, leave_y)), 0);
+    int last_row  = min((int) floor(max(enter_y, leave_y)), GRID_SIDE - 1);
+
+    for (int row = first_row; row <= last_row; row++)
+    {
+        int cell = y_major ? grid_index(row, column) : grid_index(column, row);
+
+        matrix_x[cell]    = 1;
+        matrix_y[cell]    = 1;
+        obstacle_id[cell] = segment_ids[segment];
+    }
+}
+
+/**
+ *  SIGNED DISTANCE FIELD
+ *  jump flooding: every cell keeps the nearest wall cell (.xy) and the nearest free
+ *  cell (.zw) seen so far, -1 when none, and looks at 9 cells step apart for better
+ *  ones; steps halve from the largest power of two below GRID_SIDE down to 1
+ */
+__kernel void jfa_init(__global ushort* obstacle_id, __global int4* seeds)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= GRID_CELLS)
+    {
+        return;
+    }
+
+    int x = gid % GRID_SIDE;
+    int y = gid / GRID_SIDE;
+    int cell = grid_index(x, y);
+
+    seeds[cell] = (obstacle_id[cell] != 0) ? (int4) (x, y, -1, -1) : (int4) (-1, -1, x, y);
+}
+
+int seed_distance2(int x, int y, int seed_x, int seed_y)
+{
+    return (seed_x < 0) ? INT_MAX : (seed_x - x) * (seed_x - x) + (seed_y - y) * (seed_y - y);
+}
+
+__kernel void jfa_step(__global int4* seeds_in, __global int4* seeds_out, int step)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= GRID_CELLS)
+    {
+        return;
+    }
+
+    int x = gid % GRID_SIDE;
+    int y = gid / GRID_SIDE;
+
+    int4 best = seeds_in[grid_index(x, y)];
+    int best_wall = seed_distance2(x, y, best.x, best.y);
+    int best_free = seed_distance2(x, y, best.z, best.w);
+
+    for (int dy = -step; dy <= step; dy += step)
+    {
+        for (int dx = -step; dx <= step; dx += step)
+        {
+            int other_x = x + dx;
+            int other_y = y + dy;
+
+            if (other_x < 0 || other_y < 0 || other_x >= GRID_SIDE || other_y >= GRID_SIDE)
+            {
+                continue;
+            }
+
+            int4 other = seeds_in[grid_index(other_x, other_y)];
+            int wall = seed_distance2(x, y, other.x, other.y);
+            int free = seed_distance2(x, y, other.z, other.w);
+
+            if (wall < best_wall)
+            {
+                best_wall = wall;
+                best.x = other.x;
+                best.y = other.y;
+            }
+            if (free < best_free)
+            {
+                best_free = free;
+                best.z = other.z;
+                best.w = other.w;
+            }
+        }
+    }
+
+    seeds_out[grid_index(x, y)] = best;
+}
+
+/* (signed distance in world units, direction away from the wall, id of the nearest wall) */
+__kernel void jfa_distance(__global int4* seeds, __global ushort* obstacle_id, __global float4* distance_field)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= GRID_CELLS)
+    {
+        return;
+    }
+
+    int x = gid % GRID_SIDE;
+    int y = gid / GRID_SIDE;
+    int cell = grid_index(x, y);
+
+    int4 seed = seeds[cell];
+    int inside = (seed.x == x) && (seed.y == y);
+
+    // inside a wall the way out leads to the nearest free cell
+    float away_x = inside ? seed.z - x : x - seed.x;
+    float away_y = inside ? seed.w - y : y - seed.y;
+    float length = sqrt(away_x * away_x + away_y * away_y);
+    int found = inside ? (seed.z >= 0) : (seed.x >= 0);
+
+    // the wall surface lies half a cell from the centre of a wall cell
+    float distance = found ? (length - 0.5f) * 0.01f : 1.0f;
+    float normal_x = (found && length > 0) ? away_x / length : 0.0f;
+    float normal_y = (found && length > 0) ? away_y / length : 0.0f;
+    int id = (seed.x >= 0) ? obstacle_id[grid_index(seed.x, seed.y)] : 0;
+
+    distance_field[cell] = (float4) (inside ? -distance : distance, normal_x, normal_y, (float) id);
+}
+
+/**
+ *  DIRTY RECTANGLES
+ *  cells (x0, y0) .. (x1, y1) of every rectangle are cleared before the segments
+ *  touching them are rasterised again; rectangle_offsets is the exclusive scan of
+ *  their areas so a single launch clears all of them
+ */
+__kernel void clear_dirty_rectangles(__global int4* rectangles, __global int* rectangle_offsets, int no_rectangles,
+                                     __global int* matrix_x, __global int* matrix_y, __global ushort* obstacle_id)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= rectangle_offsets[no_rectangles])
+    {
+        return;
+    }
+
+    // last rectangle starting at or before gid
+    int rectangle = 0;
+    int last      = no_rectangles - 1;
+    while (rectangle < last)
+    {
+        int middle = (rectangle + last + 1) / 2;
+
+        if (rectangle_offsets[middle] <= gid)
+        {
+            rectangle = middle;
+        }
+        else
+        {
+            last = middle - 1;
+        }
+    }
+
+    int4 bounds = rectangles[rectangle];
+    int width   = bounds.z - bounds.x + 1;
+    int inside  = gid - rectangle_offsets[rectangle];
+    int cell    = grid_index(bounds.x + inside % width, bounds.y + inside / width);
+
+    matrix_x[cell]    = 0;
+    matrix_y[cell]    = 0;
+    obstacle_id[cell] = 0;
+}
+
+/**
+ *  OBSTACLE COMMANDS
+ *  every command is (obstacle id, end_start, value) and sets one end of one obstacle,
+ *  a single launch covers every pending command
+ */
+__kernel void apply_obstacle_commands(__global int4* commands, int no_commands, __global int* obstacle_activation)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= no_commands)
+    {
+        return;
+    }
+
+    int4 command = commands[gid];
+
+    obstacle_activation[2 * command.x + command.y] = command.z;
+}
+
+/**
+ *  GRID LAYOUT BENCHMARK
+ *  the 3x3 stencil of labirinth over one grid buffer, timed by benchmark_grid_layouts()
+ */
+__kernel void grid_stencil(__global int* grid, __global int2* cells, int no_cells, __global int* out)
+{
+    unsigned int gid = get_global_id(0);
+
+    if (gid >= no_cells)
+    {
+        return;
+    }
+
+    int2 cell = cells[gid];
+    int sum = 0;
+
+    for (int dy = -1; dy <= 1; dy++)
+    {
+        for (int dx = -1; dx <= 1; dx++)
+        {
+            sum += grid[grid_index(cell.x + dx, cell.y + dy)] << ((dy + 1) * 3 + dx + 1);
+        }
+    }
 
-    activated[2 * gid + end_start] = value;
+    out[gid] = sum;
 }
 
 //__kernel void compute_velocity(__global float2* position, __global float2* old_position, __global float2* velocity)
@@ -0,0 +1,216 @@
+#include "tasks.hpp"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+
+#define TASKS_IDLE_WAIT_MS          1       // an idle worker looks for work at least this often
+
+struct task
+{
+    std::function<void()> run;
+    std::atomic<int>* pending;              // tasks of the call that queued it still to finish
+};
+
+/**
+ *  WORKER DEQUES
+ *  one lock per deque, the owner and a thief only meet on it while stealing; the
+ *  owner pushes and pops at the back, thieves take from the front
+ */
+struct worker_deque
+{
+    std::mutex lock;
+    std::deque<task*> tasks;
+};
+
+static int                      no_workers = 1;
+static worker_deque*            deques = NULL;
+static std::vector<std::thread> threads;
+static std::atomic<int>         queued(0);
+static std::atomic<bool>        stopping(false);
+static std::mutex               idle_lock;
+static std::condition_variable  idle;
+
+// the thread calling into the pool from outside is worker 0
+static thread_local int         worker_index = 0;
+
+static void push_task(task* t, int hint)
+{
+    int worker = (hint == TASKS_ANY_WORKER) ? worker_index : hint % no_workers;
+
+    std::lock_guard<std::mutex> guard(deques[worker].lock);
+    deques[worker].tasks.push_back(t);
+    queued.fetch_add(1);
+}
+
+static void wake_workers()
+{
+    // taking the lock orders the wake-up after a worker's last look at queued
+    {
+        std::lock_guard<std::mutex> guard(idle_lock);
+    }
+    idle.notify_all();
+}
+
+/* the newest task of the worker's own deque, or the oldest one of the first other deque holding any */
+static task* take_task(int worker)
+{
+    for (int k = 0; k < no_workers; k++)
+    {
+        worker_deque& victim = deques[(worker + k) % no_workers];
+        std::lock_guard<std::mutex> guard(victim.lock);
+
+        if (!victim.tasks.empty())
+        {
+            task* t;
+            if (k == 0)
+            {
+                t = victim.tasks.back();
+                victim.tasks.pop_back();
+            }
+            else
+            {
+                t = victim.tasks.front();
+                victim.tasks.pop_front();
+            }
+            queued.fetch_sub(1);
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+static void execute_task(task* t)
+{
+    t->run();
+    t->pending->fetch_sub(1, std::memory_order_release);
+    delete t;
+}
+
+/* the waiting thread keeps running tasks, its own first, until the call's tasks are done */
+static void wait_for_tasks(std::atomic<int>& pending)
+{
+    while (pending.load(std::memory_order_acquire) > 0)
+    {
+        task* t = take_task(worker_index);
+        if (t)
+        {
+            execute_task(t);
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+static void worker_loop(int index)
+{
+    worker_index = index;
+
+    while (!stopping.load())
+    {
+        task* t = take_task(index);
+        if (t)
+        {
+            execute_task(t);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(idle_lock);
+        idle.wait_for(lock, std::chrono::milliseconds(TASKS_IDLE_WAIT_MS),
+                      [] { return queued.load() > 0 || stopping.load(); });
+    }
+}
+
+void init_tasks(int workers)
+{
+    if (workers <= 0)
+    {
+        workers = std::max((int) std::thread::hardware_concurrency(), 1);
+    }
+    no_workers = std::min(workers, TASKS_MAX_WORKERS);
+
+    deques = new worker_deque[no_workers];
+    for (int w = 1; w < no_workers; w++)
+    {
+        threads.push_back(std::thread(worker_loop, w));
+    }
+}
+
+void release_tasks()
+{
+    stopping.store(true);
+    wake_workers();
+    for (size_t w = 0; w < threads.size(); w++)
+    {
+        threads[w].join();
+    }
+    threads.clear();
+
+    delete[] deques;
+    deques = NULL;
+    no_workers = 1;
+    stopping.store(false);
+}
+
+int tasks_workers()
+{
+    return no_workers;
+}
+
+void tasks_run(const std::vector<std::function<void()> >& tasks, const std::vector<int>& hints)
+{
+    if (no_workers == 1 || deques == NULL || tasks.size() < 2)
+    {
+        for (size_t t = 0; t < tasks.size(); t++)
+        {
+            tasks[t]();
+        }
+        return;
+    }
+
+    std::atomic<int> pending((int) tasks.size());
+
+    // the owner pops from the back, queued backwards its tasks run in order
+    for (size_t t = tasks.size(); t-- > 0; )
+    {
+        task* queued_task = new task;
+        queued_task->run = tasks[t];
+        queued_task->pending = &pending;
+
+        push_task(queued_task, hints[t]);
+    }
+    wake_workers();
+
+    wait_for_tasks(pending);
+}
+
+void tasks_for(int begin, int end, int grain, const std::function<void(int, int)>& body)
+{
+    if (end <= begin)
+    {
+        return;
+    }
+
+    grain = std::max(grain, 1);
+    int no_pieces = (end - begin + grain - 1) / grain;
+
+    std::vector<std::function<void()> > pieces(no_pieces);
+    std::vector<int> hints(no_pieces);
+    for (int k = 0; k < no_pieces; k++)
+    {
+        int piece_begin = begin + k * grain;
+        int piece_end = std::min(piece_begin + grain, end);
+
+        pieces[k] = [&body, piece_begin, piece_end] { body(piece_begin, piece_end); };
+        hints[k] = (int) ((long long) k * no_workers / no_pieces);
+    }
+
+    tasks_run(pieces, hints);
+}
@@ -0,0 +1,32 @@
+#ifndef TASKS_H_INCLUDED
+#define TASKS_H_INCLUDED
+
+#include <vector>
+#include <functional>
+
+/**
+ *  TASK POOL
+ *  host side work cut into small tasks for one worker per core, the calling thread
+ *  being worker 0. Every worker has its own deque: it runs its newest task from the
+ *  back and, once that is empty, steals the oldest task from the front of another
+ *  deque, so pieces of uneven cost even out between the cores on their own. A task
+ *  may name the worker it starts on, the affinity hint; a thread waiting for its
+ *  tasks runs tasks meanwhile, so tasks may start tasks of their own.
+ */
+#define TASKS_MAX_WORKERS           64
+#define TASKS_ANY_WORKER            -1
+
+// no_workers 0 takes one worker per hardware thread, 1 runs every task on the calling thread
+void init_tasks(int no_workers);
+void release_tasks();
+
+int tasks_workers();
+
+// runs every task, tasks[t] is queued on worker hints[t] (the calling worker for TASKS_ANY_WORKER), returns once all ran
+void tasks_run(const std::vector<std::function<void()> >& tasks, const std::vector<int>& hints);
+
+// body(begin, end) over pieces of at most grain items; piece k of n starts on worker k * workers / n,
+// so a range run again lands on the same workers
+void tasks_for(int begin, int end, int grain, const std::function<void(int, int)>& body);
+
+#endif // TASKS_H_INCLUDED
@@ -0,0 +1,290 @@
+#include "worksize.hpp"
+
+#include <map>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cctype>
+#include <algorithm>
+#include <sys/time.h>
+#include <unistd.h>
+
+extern void (*pCleanup)(int);
+
+/**
+ *  KERNEL STATES
+ *  one per kernel object, kept until release_worksizes(); the profile entries are
+ *  shared by name and build options between the kernels of every program built from
+ *  the same source, so each grid layout or compile-time variant is tuned on its own
+ */
+struct kernel_worksize
+{
+    size_t local_size;                      // 0: the driver picks
+    bool tuned;
+    int trials;                             // timed launches so far, over all candidates
+    std::vector<size_t> candidates;
+    std::vector<double> seconds;            // summed per candidate
+    std::vector<double> items;
+};
+
+struct profile_entry
+{
+    size_t local_size;
+    double ns_per_item;
+};
+
+static cl_device_id                             worksize_device;
+static cl_command_queue                         worksize_queue;
+static std::string                              profile_name;
+static std::map<cl_kernel, kernel_worksize>     kernels;
+static std::map<std::string, profile_entry>     profile;
+static bool                                     profile_changed = false;
+
+static double seconds_now()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    return now.tv_sec + now.tv_usec * 1e-6;
+}
+
+static std::string device_string(cl_device_info info)
+{
+    char value[256] = "";
+    clGetDeviceInfo(worksize_device, info, sizeof(value), value, NULL);
+
+    return value;
+}
+
+static std::string kernel_name(cl_kernel kernel)
+{
+    char name[256] = "";
+    clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, NULL);
+
+    return name;
+}
+
+/* kernel name and a hash of its program's build options, without spaces for the profile file */
+static std::string kernel_key(cl_kernel kernel)
+{
+    cl_program program = NULL;
+    size_t size = 0;
+    clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(program), &program, NULL);
+    clGetProgramBuildInfo(program, worksize_device, CL_PROGRAM_BUILD_OPTIONS, 0, NULL, &size);
+
+    std::vector<char> options(size + 1, '\0');
+    clGetProgramBuildInfo(program, worksize_device, CL_PROGRAM_BUILD_OPTIONS, size, &options[0], NULL);
+
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (size_t c = 0; c < size && options[c] != '\0'; c++)
+    {
+        hash = (hash ^ (unsigned char) options[c]) * 16777619u;
+    }
+
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "@%08x", hash);
+
+    return kernel_name(kernel) + suffix;
+}
+
+/* device name and driver version, everything but letters and digits made an underscore */
+static std::string profile_file_name()
+{
+    std::string name = "oclSimpleGL_" + device_string(CL_DEVICE_NAME) + "_" + device_string(CL_DRIVER_VERSION) + ".worksizes";
+
+    for (size_t c = 0; c < name.size(); c++)
+    {
+        if (!isalnum((unsigned char) name[c]) && name[c] != '.')
+        {
+            name[c] = '_';
+        }
+    }
+
+    return name;
+}
+
+/* a kernel seen for the first time starts from its profile entry, when that still fits the
+   kernel's largest work-group, or from its candidates */
+static kernel_worksize& kernel_state(cl_kernel kernel)
+{
+    std::map<cl_kernel, kernel_worksize>::iterator found = kernels.find(kernel);
+    if (found != kernels.end())
+    {
+        return found->second;
+    }
+
+    kernel_worksize& state = kernels[kernel];
+    state.local_size = 0;
+    state.tuned = false;
+    state.trials = 0;
+
+    size_t largest = 0, multiple = 1;
+    cl_int ciErrNum  = clGetKernelWorkGroupInfo(kernel, worksize_device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(largest), &largest, NULL);
+    ciErrNum |= clGetKernelWorkGroupInfo(kernel, worksize_device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, NULL);
+    shrCheckErrorEX(ciErrNum, CL_SUCCESS, pCleanup);
+
+    std::map<std::string, profile_entry>::iterator entry = profile.find(kernel_key(kernel));
+    if (entry != profile.end())
+    {
+        if (entry->second.local_size <= largest)
+        {
+            state.local_size = entry->second.local_size;
+            state.tuned = true;
+            return state;
+        }
+
+        shrLog("Local work sizes: %s no longer fits %d, tuned again\n", entry->first.c_str(), (int) largest);
+        profile.erase(entry);
+        profile_changed = true;
+    }
+
+    state.candidates.push_back(0);
+    for (size_t local = std::max(multiple, (size_t) 1); local <= std::min(largest, (size_t) WORKSIZE_MAX_LOCAL); local *= 2)
+    {
+        state.candidates.push_back(local);
+    }
+    state.seconds.assign(state.candidates.size(), 0.0);
+    state.items.assign(state.candidates.size(), 0.0);
+
+    return state;
+}
+
+static cl_int launch(cl_kernel kernel, size_t global_size, size_t local_size)
+{
+    size_t chunk = (local_size > 0) ? WORKSIZE_CHUNK_ITEMS / local_size * local_size : WORKSIZE_CHUNK_ITEMS;
+    size_t szLocalWorkSize[] = {local_size, 1};
+    cl_int ciErrNum = CL_SUCCESS;
+
+    for (size_t begin = 0; begin < global_size; begin += chunk)
+    {
+        size_t szOffset[] = {begin, 0};
+        size_t szGlobalWorkSize[] = {std::min(chunk, global_size - begin), 1};
+
+        if (local_size > 0)
+        {
+            szGlobalWorkSize[0] = (szGlobalWorkSize[0] + local_size - 1) / local_size * local_size;
+        }
+
+        ciErrNum |= clEnqueueNDRangeKernel(worksize_queue, kernel, 1, (begin > 0) ? szOffset : NULL, szGlobalWorkSize,
+                                           (local_size > 0) ? szLocalWorkSize : NULL, 0, NULL, NULL);
+    }
+
+    return ciErrNum;
+}
+
+/* the candidate with the least time per work-item over all its trials */
+static void pick_local_size(cl_kernel kernel, kernel_worksize& state)
+{
+    size_t best = 0;
+    for (size_t c = 1; c < state.candidates.size(); c++)
+    {
+        if (state.seconds[c] / state.items[c] < state.seconds[best] / state.items[best])
+        {
+            best = c;
+        }
+    }
+
+    state.local_size = state.candidates[best];
+    state.tuned = true;
+
+    profile_entry entry = {state.local_size, 1e9 * state.seconds[best] / state.items[best]};
+    profile[kernel_key(kernel)] = entry;
+    profile_changed = true;
+}
+
+void init_worksizes(cl_device_id device, cl_command_queue queue, bool load_profile)
+{
+    worksize_device = device;
+    worksize_queue  = queue;
+    profile_name    = profile_file_name();
+
+    std::ifstream file(profile_name.c_str());
+    std::string line;
+    while (load_profile && std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string name;
+        profile_entry entry;
+
+        if (line[0] != '#' && (fields >> name >> entry.local_size >> entry.ns_per_item))
+        {
+            profile[name] = entry;
+        }
+    }
+
+    shrLog("Local work sizes: %d kernels from %s\n\n", (int) profile.size(), profile_name.c_str());
+}
+
+void release_worksizes()
+{
+    if (profile_changed)
+    {
+        // written aside and renamed, ranks sharing a node may save at the same time
+        std::ostringstream temporary;
+        temporary << profile_name << "." << getpid();
+
+        std::ofstream file(temporary.str().c_str());
+        file << "# kernel@options_hash local_size ns_per_item, local_size 0 is the driver's choice\n";
+        for (std::map<std::string, profile_entry>::iterator entry = profile.begin(); entry != profile.end(); ++entry)
+        {
+            file << entry->first << " " << entry->second.local_size << " " << entry->second.ns_per_item << "\n";
+            shrLog("  %-33s local size %4d, %.3f ns per work-item\n", entry->first.c_str(), (int) entry->second.local_size, entry->second.ns_per_item);
+        }
+        file.close();
+
+        rename(temporary.str().c_str(), profile_name.c_str());
+    }
+
+    kernels.clear();
+    profile.clear();
+    profile_changed = false;
+}
+
+cl_int worksize_enqueue(cl_kernel kernel, size_t global_size)
+{
+    kernel_worksize& state = kernel_state(kernel);
+
+    if (state.tuned || global_size < WORKSIZE_MIN_RANGE)
+    {
+        return launch(kernel, global_size, state.local_size);
+    }
+
+    // the candidates take turns, so a drift over the first frames hits all of them
+    size_t c = state.trials % state.candidates.size();
+
+    cl_int ciErrNum = clFinish(worksize_queue);
+    double start = seconds_now();
+    ciErrNum |= launch(kernel, global_size, state.candidates[c]);
+    ciErrNum |= clFinish(worksize_queue);
+
+    state.seconds[c] += seconds_now() - start;
+    state.items[c] += global_size;
+
+    if (++state.trials == WORKSIZE_TRIALS * (int) state.candidates.size())
+    {
+        pick_local_size(kernel, state);
+    }
+
+    return ciErrNum;
+}
+
+cl_int worksize_enqueue_range(cl_command_queue queue, cl_kernel kernel, size_t begin, size_t end, cl_event* wait_event, cl_event* done)
+{
+    cl_int ciErrNum = CL_SUCCESS;
+
+    for (size_t chunk_begin = begin; chunk_begin < end; chunk_begin += WORKSIZE_CHUNK_ITEMS)
+    {
+        size_t szOffset[] = {chunk_begin, 0};
+        size_t szGlobalWorkSize[] = {std::min((size_t) WORKSIZE_CHUNK_ITEMS, end - chunk_begin), 1};
+        bool first = chunk_begin == begin;
+        bool last = chunk_begin + szGlobalWorkSize[0] == end;
+
+        ciErrNum |= clEnqueueNDRangeKernel(queue, kernel, 1, szOffset, szGlobalWorkSize, NULL,
+                                           (first && wait_event) ? 1 : 0, first ? wait_event : NULL, last ? done : NULL);
+    }
+
+    return ciErrNum;
+}
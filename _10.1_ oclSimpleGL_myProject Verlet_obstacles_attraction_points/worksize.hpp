@@ -0,0 +1,36 @@
+#ifndef WORKSIZE_H_INCLUDED
+#define WORKSIZE_H_INCLUDED
+
+#include <oclUtils.h>
+
+/**
+ *  LOCAL WORK SIZES
+ *  the local work size of every 1D kernel of the simulation, tuned on the device in
+ *  use: the first launches of a kernel try the candidates in turn (the driver's own
+ *  choice and the multiples of the kernel's preferred size), each over the kernel's
+ *  real range, and the least time per work-item wins. The global range is padded
+ *  up to a multiple of the winner, every kernel returns for the work-items past its
+ *  count. The winners are kept per kernel and build options in a profile file per
+ *  device and driver version, so the next run starts tuned; a winner larger than the
+ *  kernel's work-group limit is tuned again. A range past WORKSIZE_CHUNK_ITEMS is
+ *  launched as several kernels over consecutive chunks through the global offset,
+ *  each chunk a multiple of the local size, so no single launch of a large crowd
+ *  runs into the display watchdog and only the last chunk is padded.
+ */
+#define WORKSIZE_TRIALS             4       // timed launches per candidate
+#define WORKSIZE_MIN_RANGE          1024    // smaller launches run with the driver's choice and are not timed
+#define WORKSIZE_MAX_LOCAL          1024
+#define WORKSIZE_CHUNK_ITEMS        (1 << 22)
+
+// with load_profile false every kernel is tuned again, the profile is rewritten on release
+void init_worksizes(cl_device_id device, cl_command_queue queue, bool load_profile);
+void release_worksizes();
+
+// kernel over work-items 0 .. global_size - 1 on the queue given to init_worksizes(), as clEnqueueNDRangeKernel
+cl_int worksize_enqueue(cl_kernel kernel, size_t global_size);
+
+// kernel over work-items begin .. end - 1 on queue, in chunks of WORKSIZE_CHUNK_ITEMS with the driver's local size;
+// the first chunk waits for wait_event when given, the last one sets done when given
+cl_int worksize_enqueue_range(cl_command_queue queue, cl_kernel kernel, size_t begin, size_t end, cl_event* wait_event, cl_event* done);
+
+#endif // WORKSIZE_H_INCLUDED